@@ -0,0 +1,375 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "mod_gnutls.h"
+
+#include "apr_hash.h"
+#include "apr_thread_rwlock.h"
+#include <gnutls/crypto.h>
+
+/**
+ * Client CA directories
+ *
+ * GnuTLSClientCAPath names a directory with one CA certificate per
+ * file, named after the hash of its subject the way
+ * "openssl x509 -subject_hash_old" prints it, with a ".0" suffix (".1"
+ * and so on for more CAs with the same hash), like "c_rehash -old"
+ * creates them.
+ *
+ * Nothing is read at startup. When a client chain is verified the
+ * issuers of its certificates are looked up in the directory, and the
+ * CAs found are kept by the child for the rest of its life, up to
+ * MGS_CA_PATH_MAX_ENTRIES issuers; the CAs of further issuers are read
+ * for each verification. Kept CAs are never freed, so they can be used
+ * without the lock.
+ *
+ * The issuers come from the client, so issuers that are not in the
+ * directory are only remembered in a fixed table of
+ * MGS_CA_PATH_MISSES digests, and looked up again after
+ * MGS_CA_PATH_RETRY, so new files are picked up without a restart.
+ */
+
+/* How long an issuer missing from the directory is not looked up */
+#define MGS_CA_PATH_RETRY apr_time_from_sec(60)
+/* Issuers found in the directory kept per directory */
+#define MGS_CA_PATH_MAX_ENTRIES 1024
+/* Issuers missing from the directory remembered per directory */
+#define MGS_CA_PATH_MISSES 256
+
+typedef struct {
+	gnutls_x509_crt_t *crts;
+	unsigned int ncrts;
+} mgs_ca_path_entry_t;
+
+typedef struct {
+	/* the SHA-256 of the issuer DN */
+	unsigned char digest[32];
+	/* when to look for the issuer again */
+	apr_time_t retry;
+} mgs_ca_path_miss_t;
+
+struct mgs_ca_path {
+	const char *dir;
+	/* the entries and their keys, the issuer DNs */
+	apr_pool_t *pool;
+	apr_hash_t *entries;
+	unsigned int nentries;
+	/* indexed by the first bytes of the digest */
+	mgs_ca_path_miss_t *misses;
+#if APR_HAS_THREADS
+	apr_thread_rwlock_t *lock;
+#endif
+};
+
+/* what a missing issuer yields */
+static const mgs_ca_path_entry_t ca_path_none = { NULL, 0 };
+
+/* The DER encoding of dn */
+static int ca_path_dn(apr_pool_t * p, gnutls_x509_dn_t dn,
+		      gnutls_datum_t * der)
+{
+	size_t size = 0;
+	int ret;
+
+	ret = gnutls_x509_dn_export(dn, GNUTLS_X509_FMT_DER, NULL, &size);
+	if (ret != GNUTLS_E_SHORT_MEMORY_BUFFER)
+		return ret < 0 ? ret : GNUTLS_E_ASN1_DER_ERROR;
+	der->data = apr_palloc(p, size);
+	ret = gnutls_x509_dn_export(dn, GNUTLS_X509_FMT_DER, der->data,
+				    &size);
+	der->size = size;
+	return ret;
+}
+
+static int ca_path_read(apr_pool_t * p, const char *file,
+			gnutls_datum_t * data)
+{
+	apr_file_t *fp;
+	apr_finfo_t finfo;
+	apr_size_t br = 0;
+
+	if (apr_file_open(&fp, file, APR_READ | APR_BINARY,
+			  APR_OS_DEFAULT, p) != APR_SUCCESS)
+		return -1;
+	if (apr_file_info_get(&finfo, APR_FINFO_SIZE, fp) != APR_SUCCESS
+	    || finfo.size == 0) {
+		apr_file_close(fp);
+		return -1;
+	}
+	data->data = apr_palloc(p, finfo.size);
+	if (apr_file_read_full(fp, data->data, finfo.size, &br) !=
+	    APR_SUCCESS) {
+		apr_file_close(fp);
+		return -1;
+	}
+	apr_file_close(fp);
+	data->size = br;
+	return 0;
+}
+
+/* Read the CAs with the subject dn from the directory */
+static void ca_path_load(apr_pool_t * p, server_rec * s, const char *dir,
+			 const gnutls_datum_t * dn,
+			 mgs_ca_path_entry_t * entry)
+{
+	unsigned char md[16];
+	unsigned long hash;
+	gnutls_datum_t data, subject;
+	gnutls_x509_crt_t crt;
+	gnutls_x509_dn_t sdn;
+	const char *file;
+	apr_array_header_t *crts;
+	int i, ret;
+
+	/* OpenSSL's X509_NAME_hash_old(), the MD5 of the encoded name */
+	gnutls_hash_fast(GNUTLS_DIG_MD5, dn->data, dn->size, md);
+	hash = ((unsigned long) md[0] | ((unsigned long) md[1] << 8)
+		| ((unsigned long) md[2] << 16)
+		| ((unsigned long) md[3] << 24)) & 0xffffffffUL;
+
+	crts = apr_array_make(p, 1, sizeof(gnutls_x509_crt_t));
+	for (i = 0;; i++) {
+		file = apr_psprintf(p, "%s/%08lx.%d", dir, hash, i);
+		if (ca_path_read(p, file, &data) != 0)
+			break;
+
+		if (gnutls_x509_crt_init(&crt) < 0)
+			break;
+		ret = gnutls_x509_crt_import(crt, &data,
+					     data.data[0] == 0x30 ?
+					     GNUTLS_X509_FMT_DER :
+					     GNUTLS_X509_FMT_PEM);
+		if (ret == 0)
+			ret = gnutls_x509_crt_get_subject(crt, &sdn);
+		if (ret == 0)
+			ret = ca_path_dn(p, sdn, &subject);
+		if (ret < 0) {
+			ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+				     "GnuTLS: Failed to load CA '%s': "
+				     "(%d) %s", file, ret,
+				     gnutls_strerror(ret));
+			gnutls_x509_crt_deinit(crt);
+			continue;
+		}
+
+		/* another subject with the same hash */
+		if (subject.size != dn->size
+		    || memcmp(subject.data, dn->data, dn->size) != 0) {
+			gnutls_x509_crt_deinit(crt);
+			continue;
+		}
+
+		APR_ARRAY_PUSH(crts, gnutls_x509_crt_t) = crt;
+	}
+
+	entry->crts = (gnutls_x509_crt_t *) crts->elts;
+	entry->ncrts = crts->nelts;
+}
+
+static apr_status_t ca_path_crt_cleanup(void *data)
+{
+	gnutls_x509_crt_deinit(data);
+	return APR_SUCCESS;
+}
+
+/* Free the CAs of entry with pool p */
+static void ca_path_crts_cleanup(apr_pool_t * p,
+				 const mgs_ca_path_entry_t * entry)
+{
+	unsigned int i;
+
+	for (i = 0; i < entry->ncrts; i++)
+		apr_pool_cleanup_register(p, entry->crts[i],
+					  ca_path_crt_cleanup,
+					  apr_pool_cleanup_null);
+}
+
+/* Find the CAs with the subject dn, reading them if needed */
+static const mgs_ca_path_entry_t *ca_path_get(apr_pool_t * p,
+					      server_rec * s,
+					      mgs_ca_path_t * cap,
+					      const gnutls_datum_t * dn)
+{
+	const mgs_ca_path_entry_t *found;
+	mgs_ca_path_entry_t *entry, *loaded;
+	mgs_ca_path_miss_t *miss;
+	unsigned char digest[32];
+	int missing;
+
+	gnutls_hash_fast(GNUTLS_DIG_SHA256, dn->data, dn->size, digest);
+	miss = &cap->misses[((digest[0] << 8) | digest[1])
+			    % MGS_CA_PATH_MISSES];
+
+#if APR_HAS_THREADS
+	apr_thread_rwlock_rdlock(cap->lock);
+#endif
+	found = apr_hash_get(cap->entries, dn->data, dn->size);
+	missing = memcmp(miss->digest, digest, sizeof(digest)) == 0
+	    && miss->retry > apr_time_now();
+#if APR_HAS_THREADS
+	apr_thread_rwlock_unlock(cap->lock);
+#endif
+	if (found != NULL)
+		return found;
+	if (missing)
+		return &ca_path_none;
+
+	/* read the files without holding the lock */
+	loaded = apr_palloc(p, sizeof(*loaded));
+	ca_path_load(p, s, cap->dir, dn, loaded);
+
+#if APR_HAS_THREADS
+	apr_thread_rwlock_wrlock(cap->lock);
+#endif
+	if (loaded->ncrts == 0) {
+		/* takes the place of whichever issuer was there */
+		memcpy(miss->digest, digest, sizeof(digest));
+		miss->retry = apr_time_now() + MGS_CA_PATH_RETRY;
+		found = loaded;
+	} else {
+		/* another thread may have been faster */
+		found = apr_hash_get(cap->entries, dn->data, dn->size);
+		if (found == NULL
+		    && cap->nentries < MGS_CA_PATH_MAX_ENTRIES) {
+			entry = apr_palloc(cap->pool, sizeof(*entry));
+			entry->ncrts = loaded->ncrts;
+			entry->crts = apr_pmemdup(cap->pool, loaded->crts,
+						  loaded->ncrts *
+						  sizeof(*loaded->crts));
+			ca_path_crts_cleanup(cap->pool, entry);
+			apr_hash_set(cap->entries,
+				     apr_pmemdup(cap->pool, dn->data,
+						 dn->size), dn->size, entry);
+			cap->nentries++;
+			found = entry;
+		} else {
+			/* used for this verification only */
+			ca_path_crts_cleanup(p, loaded);
+			if (found == NULL)
+				found = loaded;
+		}
+	}
+#if APR_HAS_THREADS
+	apr_thread_rwlock_unlock(cap->lock);
+#endif
+
+	return found;
+}
+
+int mgs_ca_path_verify(apr_pool_t * p, server_rec * s,
+		       mgs_srvconf_rec * sc, gnutls_x509_crt_t * chain,
+		       unsigned int n, unsigned int *status)
+{
+	const mgs_ca_path_entry_t *entry;
+	apr_array_header_t *cas;
+	gnutls_x509_dn_t idn;
+	gnutls_datum_t dn;
+	unsigned int i, j;
+	int ret;
+
+	if (sc->ca_path->entries == NULL)
+		return GNUTLS_E_INTERNAL_ERROR;
+
+	/* the CAs of GnuTLSX509CAFile and the issuers from the directory */
+	cas = apr_array_make(p, sc->ca_list_size + n,
+			     sizeof(gnutls_x509_crt_t));
+	for (j = 0; j < sc->ca_list_size; j++)
+		APR_ARRAY_PUSH(cas, gnutls_x509_crt_t) = sc->ca_list[j];
+
+	for (i = 0; i < n; i++) {
+		ret = gnutls_x509_crt_get_issuer(chain[i], &idn);
+		if (ret == 0)
+			ret = ca_path_dn(p, idn, &dn);
+		if (ret < 0)
+			return ret;
+
+		entry = ca_path_get(p, s, sc->ca_path, &dn);
+		for (j = 0; j < entry->ncrts; j++)
+			APR_ARRAY_PUSH(cas, gnutls_x509_crt_t) =
+			    entry->crts[j];
+	}
+
+	return gnutls_x509_crt_list_verify(chain, n,
+					   (gnutls_x509_crt_t *) cas->elts,
+					   cas->nelts, NULL, 0, 0, status);
+}
+
+int mgs_ca_path_post_config(apr_pool_t * p, server_rec * base_server)
+{
+	apr_finfo_t finfo;
+	apr_status_t rv;
+	apr_hash_t *dirs = apr_hash_make(p);
+	server_rec *s;
+	mgs_srvconf_rec *sc;
+
+	for (s = base_server; s; s = s->next) {
+		sc = ap_get_module_config(s->module_config, &gnutls_module);
+		sc->ca_path = NULL;
+		if (sc->enabled != GNUTLS_ENABLED_TRUE
+		    || sc->ca_path_dir == NULL)
+			continue;
+
+		rv = apr_stat(&finfo, sc->ca_path_dir, APR_FINFO_TYPE, p);
+		if (rv != APR_SUCCESS || finfo.filetype != APR_DIR) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, s,
+				     "GnuTLS: GnuTLSClientCAPath '%s' is not "
+				     "a directory", sc->ca_path_dir);
+			return -1;
+		}
+
+		/* hosts with the same directory share the CAs read */
+		sc->ca_path = apr_hash_get(dirs, sc->ca_path_dir,
+					   APR_HASH_KEY_STRING);
+		if (sc->ca_path == NULL) {
+			sc->ca_path = apr_pcalloc(p, sizeof(*sc->ca_path));
+			sc->ca_path->dir = sc->ca_path_dir;
+			apr_hash_set(dirs, sc->ca_path_dir,
+				     APR_HASH_KEY_STRING, sc->ca_path);
+		}
+	}
+
+	return 0;
+}
+
+void mgs_ca_path_child_init(apr_pool_t * p, server_rec * base_server)
+{
+	apr_status_t rv;
+	server_rec *s;
+	mgs_srvconf_rec *sc;
+	mgs_ca_path_t *cap;
+
+	for (s = base_server; s; s = s->next) {
+		sc = ap_get_module_config(s->module_config, &gnutls_module);
+		cap = sc->ca_path;
+		if (cap == NULL || cap->pool != NULL)
+			continue;
+
+		apr_pool_create(&cap->pool, p);
+#if APR_HAS_THREADS
+		rv = apr_thread_rwlock_create(&cap->lock, cap->pool);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s,
+				     "GnuTLS: Failed to create the lock of "
+				     "GnuTLSClientCAPath '%s'", cap->dir);
+			continue;
+		}
+#endif
+		cap->entries = apr_hash_make(cap->pool);
+		cap->misses = apr_pcalloc(cap->pool, MGS_CA_PATH_MISSES *
+					  sizeof(*cap->misses));
+	}
+}
@@ -25,6 +25,11 @@
 #include "apr_dbm.h"
 
 #include "ap_mpm.h"
+#include "apr_atomic.h"
+#if APR_HAS_THREADS
+#include "apr_thread_proc.h"
+#endif
+#include "mod_status.h"
 
 #include <unistd.h>
 #include <sys/types.h>
@@ -41,7 +46,58 @@
 
 #if MODULE_MAGIC_NUMBER_MAJOR < 20081201
 #define ap_unixd_config unixd_config
+#define ap_unixd_set_global_mutex_perms unixd_set_global_mutex_perms
+#endif
+
+apr_status_t mgs_shm_create(apr_shm_t ** shm, apr_size_t size,
+			    const char *file, apr_pool_t * p)
+{
+	apr_status_t rv;
+
+	/* Anonymous shared memory is inherited by the children on fork,
+	 * fall back to a file based segment where it is not supported.
+	 */
+	rv = apr_shm_create(shm, size, NULL, p);
+	if (rv == APR_ENOTIMPL) {
+		apr_shm_remove(file, p);
+		rv = apr_shm_create(shm, size, file, p);
+	}
+
+	if (rv == APR_SUCCESS)
+		memset(apr_shm_baseaddr_get(*shm), 0, size);
+
+	return rv;
+}
+
+apr_status_t mgs_mutex_create(apr_global_mutex_t ** mutex,
+			      server_rec * s, apr_pool_t * p)
+{
+	apr_status_t rv;
+
+	rv = apr_global_mutex_create(mutex, NULL, APR_LOCK_DEFAULT, p);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+#if !defined(OS2) && !defined(WIN32) && !defined(BEOS) && !defined(NETWARE)
+	rv = ap_unixd_set_global_mutex_perms(*mutex);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_CRIT, rv, s,
+			     "GnuTLS: Cannot set permissions on mutex");
+	}
 #endif
+	return rv;
+}
+
+apr_status_t mgs_mutex_child_init(apr_global_mutex_t ** mutex,
+				  apr_pool_t * p)
+{
+	if (*mutex == NULL)
+		return APR_SUCCESS;
+
+	return apr_global_mutex_child_init(mutex,
+					   apr_global_mutex_lockfile(*mutex),
+					   p);
+}
 
 char *mgs_session_id2sz(unsigned char *id, int idlen,
 			char *str, int strsize)
@@ -299,83 +355,467 @@ static int mc_cache_delete(void *baton, gnutls_datum_t key)
 
 #endif				/* have_apr_memcache */
 
+/* FNV-1a, to spread the session keys */
+static apr_uint32_t cache_hash(const char *key, apr_size_t len)
+{
+	apr_uint32_t h = 2166136261U;
+	apr_size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) key[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
 const char *db_type(mgs_srvconf_rec * sc)
 {
 	if (sc->cache_type == mgs_cache_gdbm)
 		return "gdbm";
+	else if (sc->cache_type == mgs_cache_sdbm)
+		return "sdbm";
 	else
 		return "db";
 }
 
 #define SSL_DBM_FILE_MODE ( APR_UREAD | APR_UWRITE | APR_GREAD | APR_WREAD )
 
-static void dbm_cache_expire(mgs_handle_t * ctxt)
+/**
+ * GnuTLS Session Cache in DBM files
+ *
+ * With GnuTLSDBMShards the sessions are spread over that many files by a
+ * hash of their key, named after GnuTLSCache with the number of the
+ * shard appended. Every shard has a global mutex held for each operation
+ * on it, so children never see a file another one is writing, and
+ * writers of different shards do not wait for each other.
+ *
+ * The sdbm type writes every change to the file right away and does not
+ * lock the file while it is open, so each process keeps its handles
+ * open. A counter per shard in shared memory is bumped by every write;
+ * a process reopens a handle when another one wrote since it last used
+ * it, as SDBM keeps the last page read. Berkeley DB and GDBM cache
+ * writes or lock the file for as long as it is open, their files are
+ * opened for each operation.
+ *
+ * Expiry: every shard has a queue in shared memory of the keys stored,
+ * in the order they were stored. Every MGS_DBM_EXPIRY_INTERVAL one
+ * process (whichever claims the pass first) deletes the sessions at the
+ * head of the queues whose time has come, a batch at a time, from a
+ * thread of its own. Sessions that do not fit into a queue are left to a
+ * full scan of the shard, done once all of them have expired. Fetching
+ * checks the expiry too, so a session is never resumed past its time.
+ *
+ * Limits: with GnuTLSCacheMaxEntries the queues hold that many sessions
+ * between them, and a session stored into a full queue evicts the oldest
+ * one. With GnuTLSCacheAdmission a full queue only takes the sessions of
+ * clients that stored one recently, so clients seen once do not push out
+ * those that come back. The addresses are kept in a two bit filter in
+ * shared memory, cleared after MGS_DBM_DOORKEEPER_RESET clients. The
+ * sessions of each virtual host with a GnuTLSCacheQuota are counted per
+ * shard against its share of the quota; a host at its share evicts its
+ * own oldest session of the shard, or keeps no new one if none is near
+ * the head of the queue. A session is refused before anything is
+ * evicted for it. With either limit set, sessions whose key is too long
+ * for the queue are not stored, as they could not be counted.
+ */
+
+/* the longest key kept in the expiry queue, longer ones are scanned */
+#define MGS_DBM_EXPIRY_KEY_LEN 116
+/* the entries of the expiry queues of all shards */
+#define MGS_DBM_EXPIRY_ENTRIES 32768
+/* the sessions expired per shard before its lock is released */
+#define MGS_DBM_EXPIRY_BATCH 64
+#define MGS_DBM_EXPIRY_INTERVAL 5
+/* the entries searched for the oldest session of a host over its quota */
+#define MGS_DBM_QUOTA_SCAN 64
+/* the bits of the filter of GnuTLSCacheAdmission */
+#define MGS_DBM_DOORKEEPER_BITS 65536
+#define MGS_DBM_DOORKEEPER_RESET (MGS_DBM_DOORKEEPER_BITS / 8)
+
+typedef struct {
+	apr_time_t expires;
+	/* 0 once the session was evicted */
+	apr_uint16_t key_len;
+	/* the cache_owner of the virtual host that stored it */
+	apr_uint16_t owner;
+	char key[MGS_DBM_EXPIRY_KEY_LEN];
+} mgs_dbm_expiry_t;
+
+typedef struct {
+	/* the second of the next expiry pass */
+	apr_uint32_t next_pass;
+	/* the clients added to the filter since it was cleared */
+	apr_uint32_t doorkeeper_added;
+} mgs_dbm_header_t;
+
+/* the state of a shard shared by all processes */
+typedef struct {
+	/* when all sessions missing from the queue have expired, 0 if
+	 * there are none
+	 */
+	apr_time_t scan_at;
+	apr_uint32_t generation;
+	/* the expiry queue */
+	apr_uint32_t head;
+	apr_uint32_t used;
+	apr_uint32_t pad;
+} mgs_dbm_shared_t;
+
+typedef struct {
+	const char *path;
+	apr_global_mutex_t *mutex;
+	mgs_dbm_shared_t *shared;
+	mgs_dbm_expiry_t *queue;
+	/* the sessions of the shard of each host with a quota, by
+	 * cache_owner
+	 */
+	apr_uint32_t *counts;
+	/* the handle kept open by this process, sdbm only */
+	apr_pool_t *pool;
+	apr_dbm_t *dbm;
+	/* the generation of the shard the handle has seen */
+	apr_uint32_t generation;
+} mgs_dbm_shard_t;
+
+static mgs_srvconf_rec *dbm_sc;
+static mgs_dbm_shard_t *dbm_shards;
+static unsigned int dbm_nshards;
+static unsigned int dbm_queue_len;
+static apr_shm_t *dbm_shm;
+static mgs_dbm_header_t *dbm_header;
+/* the filter of GnuTLSCacheAdmission, NULL if off */
+static apr_uint32_t *dbm_doorkeeper;
+#if APR_HAS_THREADS
+static apr_thread_t *dbm_expiry_thread;
+static volatile int dbm_expiry_stop;
+#endif
+
+static mgs_dbm_shard_t *dbm_shard(const apr_datum_t * key)
 {
+	return &dbm_shards[cache_hash(key->dptr, key->dsize) % dbm_nshards];
+}
+
+/* Lock shard and get a handle to its file, opened from p unless the
+ * process keeps it open
+ */
+static apr_status_t dbm_shard_lock(mgs_dbm_shard_t * shard,
+				   apr_int32_t mode, apr_pool_t * p,
+				   apr_dbm_t ** dbm)
+{
+	apr_uint32_t generation;
 	apr_status_t rv;
-	apr_dbm_t *dbm;
+
+	rv = apr_global_mutex_lock(shard->mutex);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	if (shard->pool == NULL) {
+		rv = apr_dbm_open_ex(dbm, db_type(dbm_sc), shard->path, mode,
+				     SSL_DBM_FILE_MODE, p);
+	} else {
+		generation = shard->shared->generation;
+		if (shard->dbm != NULL && shard->generation != generation) {
+			apr_dbm_close(shard->dbm);
+			shard->dbm = NULL;
+			apr_pool_clear(shard->pool);
+		}
+		rv = APR_SUCCESS;
+		if (shard->dbm == NULL)
+			rv = apr_dbm_open_ex(&shard->dbm, db_type(dbm_sc),
+					     shard->path, APR_DBM_RWCREATE,
+					     SSL_DBM_FILE_MODE, shard->pool);
+		if (rv == APR_SUCCESS)
+			shard->generation = generation;
+		else
+			shard->dbm = NULL;
+		*dbm = shard->dbm;
+	}
+
+	if (rv != APR_SUCCESS)
+		apr_global_mutex_unlock(shard->mutex);
+	return rv;
+}
+
+/* Release the handle and the lock of shard, after changing the file if
+ * written
+ */
+static void dbm_shard_unlock(mgs_dbm_shard_t * shard, apr_dbm_t * dbm,
+			     int written)
+{
+	if (shard->pool == NULL)
+		apr_dbm_close(dbm);
+	else if (written)
+		shard->generation = ++shard->shared->generation;
+	apr_global_mutex_unlock(shard->mutex);
+}
+
+/* Queue key stored by the virtual host owner until expires, with the
+ * shard locked
+ */
+static void dbm_expiry_push(mgs_dbm_shard_t * shard,
+			    const apr_datum_t * key, apr_time_t expires,
+			    unsigned int owner)
+{
+	mgs_dbm_shared_t *sh = shard->shared;
+	mgs_dbm_expiry_t *e;
+
+	if (key->dsize > MGS_DBM_EXPIRY_KEY_LEN || sh->used == dbm_queue_len) {
+		if (expires > sh->scan_at)
+			sh->scan_at = expires;
+		return;
+	}
+
+	e = &shard->queue[(sh->head + sh->used) % dbm_queue_len];
+	e->expires = expires;
+	e->key_len = key->dsize;
+	e->owner = owner;
+	memcpy(e->key, key->dptr, key->dsize);
+	sh->used++;
+	if (owner != 0)
+		shard->counts[owner]++;
+}
+
+/* Whether the session in dbmval expired at now */
+static int dbm_expired(apr_datum_t dbmval, apr_time_t now)
+{
+	apr_time_t dtime;
+
+	if (dbmval.dptr == NULL || dbmval.dsize < sizeof(apr_time_t))
+		return 1;
+	memcpy(&dtime, dbmval.dptr, sizeof(apr_time_t));
+	return now >= dtime;
+}
+
+/* Evict the session of entry e of the queue of shard, unless it was
+ * stored again since, with the shard locked. Returns 1 if a session was
+ * deleted.
+ */
+static int dbm_expiry_drop(mgs_dbm_shard_t * shard, apr_dbm_t * dbm,
+			   mgs_dbm_expiry_t * e, apr_time_t now)
+{
 	apr_datum_t dbmkey;
 	apr_datum_t dbmval;
-	apr_time_t now;
-	apr_time_t dtime;
-	apr_pool_t *spool;
-	int total, deleted;
+	int deleted = 0;
 
-	now = apr_time_now();
+	if (e->key_len == 0)
+		return 0;
 
-	if (now - ctxt->sc->last_cache_check <
-	    (ctxt->sc->cache_timeout) / 2)
-		return;
+	dbmkey.dptr = e->key;
+	dbmkey.dsize = e->key_len;
+	dbmval.dptr = NULL;
+	if (apr_dbm_fetch(dbm, dbmkey, &dbmval) == APR_SUCCESS
+	    && dbmval.dptr != NULL) {
+		if (dbm_expired(dbmval, e->expires > now ? e->expires : now)) {
+			apr_dbm_delete(dbm, dbmkey);
+			deleted = 1;
+		}
+		apr_dbm_freedatum(dbm, dbmval);
+	}
 
-	ctxt->sc->last_cache_check = now;
+	if (e->owner != 0)
+		shard->counts[e->owner]--;
+	e->key_len = 0;
+	return deleted;
+}
 
-	apr_pool_create(&spool, ctxt->c->pool);
+/* Evict the oldest session of the queue of shard */
+static int dbm_expiry_pop(mgs_dbm_shard_t * shard, apr_dbm_t * dbm,
+			  apr_time_t now)
+{
+	mgs_dbm_shared_t *sh = shard->shared;
+	int deleted;
 
-	total = 0;
-	deleted = 0;
+	deleted = dbm_expiry_drop(shard, dbm, &shard->queue[sh->head], now);
+	sh->head = (sh->head + 1) % dbm_queue_len;
+	sh->used--;
+	return deleted;
+}
 
-	rv = apr_dbm_open_ex(&dbm, db_type(ctxt->sc),
-			     ctxt->sc->cache_config, APR_DBM_RWCREATE,
-			     SSL_DBM_FILE_MODE, spool);
-	if (rv != APR_SUCCESS) {
-		ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
-			     ctxt->c->base_server,
-			     "[gnutls_cache] error opening cache searcher '%s'",
-			     ctxt->sc->cache_config);
-		apr_pool_destroy(spool);
-		return;
+/* Whether the client of c stored a session since the filter was last
+ * cleared, adding it
+ */
+static int dbm_doorkeeper_check(conn_rec * c)
+{
+	apr_sockaddr_t *addr = MGS_CLIENT_ADDR(c);
+	apr_uint32_t h, bit, old, *word;
+	int i, known = 1;
+
+	h = cache_hash(addr->ipaddr_ptr, addr->ipaddr_len);
+	for (i = 0; i < 2; i++, h >>= 16) {
+		word = &dbm_doorkeeper[(h % MGS_DBM_DOORKEEPER_BITS) / 32];
+		bit = 1U << (h % 32);
+		do {
+			old = apr_atomic_read32(word);
+			if (old & bit)
+				break;
+			known = 0;
+		} while (apr_atomic_cas32(word, old | bit, old) != old);
+	}
+
+	/* forget the clients once the filter fills up */
+	if (!known && apr_atomic_inc32(&dbm_header->doorkeeper_added) ==
+	    MGS_DBM_DOORKEEPER_RESET - 1) {
+		memset(dbm_doorkeeper, 0, MGS_DBM_DOORKEEPER_BITS / 8);
+		apr_atomic_set32(&dbm_header->doorkeeper_added, 0);
+	}
+
+	return known;
+}
+
+/* Make room in the queue of shard for a session of the virtual host sc,
+ * with the shard locked. known tells if the client passed the filter of
+ * GnuTLSCacheAdmission. Returns -1 if the session is not to be stored.
+ */
+static int dbm_make_room(mgs_dbm_shard_t * shard, apr_dbm_t * dbm,
+			 mgs_srvconf_rec * sc, int known, apr_time_t now)
+{
+	mgs_dbm_shared_t *sh = shard->shared;
+	mgs_dbm_expiry_t *e = NULL;
+	unsigned int i;
+	int full = dbm_sc->cache_max_entries != 0
+	    && sh->used == dbm_queue_len;
+
+	/* nothing is evicted for a session that is refused */
+	if (full && !known)
+		return -1;
+
+	/* the share of the quota of the shard, rounded up */
+	if (sc->cache_owner != 0 && shard->counts[sc->cache_owner] >=
+	    (sc->cache_quota + dbm_nshards - 1) / dbm_nshards) {
+		for (i = 0; i < sh->used && i < MGS_DBM_QUOTA_SCAN; i++) {
+			e = &shard->queue[(sh->head + i) % dbm_queue_len];
+			if (e->key_len != 0 && e->owner == sc->cache_owner)
+				break;
+		}
+		if (i == sh->used || i == MGS_DBM_QUOTA_SCAN)
+			return -1;
+		dbm_expiry_drop(shard, dbm, e, now);
 	}
 
+	/* a session of a host with a quota must be queued to be counted */
+	if (full || (sc->cache_owner != 0 && sh->used == dbm_queue_len))
+		dbm_expiry_pop(shard, dbm, now);
+	return 0;
+}
+
+/* Delete every expired session of the file, with the shard locked */
+static int dbm_expire_scan(apr_dbm_t * dbm, apr_time_t now)
+{
+	apr_datum_t dbmkey;
+	apr_datum_t dbmval;
+	int deleted = 0;
+
 	apr_dbm_firstkey(dbm, &dbmkey);
 	while (dbmkey.dptr != NULL) {
+		dbmval.dptr = NULL;
 		apr_dbm_fetch(dbm, dbmkey, &dbmval);
-		if (dbmval.dptr != NULL
-		    && dbmval.dsize >= sizeof(apr_time_t)) {
-			memcpy(&dtime, dbmval.dptr, sizeof(apr_time_t));
-
-			if (now >= dtime) {
-				apr_dbm_delete(dbm, dbmkey);
-				deleted++;
-			}
-			apr_dbm_freedatum(dbm, dbmval);
-		} else {
+		if (dbm_expired(dbmval, now)) {
 			apr_dbm_delete(dbm, dbmkey);
 			deleted++;
 		}
-		total++;
+		if (dbmval.dptr != NULL)
+			apr_dbm_freedatum(dbm, dbmval);
 		apr_dbm_nextkey(dbm, &dbmkey);
 	}
-	apr_dbm_close(dbm);
+	return deleted;
+}
+
+/* Delete the sessions of shard whose time has come */
+static int dbm_expire_shard(mgs_dbm_shard_t * shard, apr_time_t now,
+			    apr_pool_t * p)
+{
+	mgs_dbm_shared_t *sh = shard->shared;
+	mgs_dbm_expiry_t *e;
+	apr_dbm_t *dbm;
+	int n, more, deleted = 0;
+
+	do {
+		if (dbm_shard_lock(shard, APR_DBM_RWCREATE, p, &dbm) !=
+		    APR_SUCCESS)
+			break;
+
+		n = 0;
+		if (sh->scan_at != 0 && sh->scan_at <= now) {
+			n = dbm_expire_scan(dbm, now);
+			sh->scan_at = 0;
+		}
 
-	ap_log_error(APLOG_MARK, APLOG_DEBUG, rv,
-		     ctxt->c->base_server,
-		     "[gnutls_cache] Cleaned up cache '%s'. Deleted %d and left %d",
-		     ctxt->sc->cache_config, deleted, total - deleted);
+		more = 0;
+		while (sh->used > 0) {
+			e = &shard->queue[sh->head];
+			/* evicted entries go right away */
+			if (e->key_len != 0 && e->expires > now)
+				break;
+			if (n >= MGS_DBM_EXPIRY_BATCH) {
+				more = 1;
+				break;
+			}
+			n += dbm_expiry_pop(shard, dbm, now);
+		}
 
+		dbm_shard_unlock(shard, dbm, n > 0);
+		apr_pool_clear(p);
+		deleted += n;
+	} while (more);
+
+	return deleted;
+}
+
+/* Run an expiry pass unless it is not due or another process claimed
+ * it
+ */
+static void dbm_expire(server_rec * s, apr_pool_t * p)
+{
+	apr_time_t now = apr_time_now();
+	apr_uint32_t sec = apr_time_sec(now), next;
+	apr_pool_t *spool;
+	unsigned int i;
+	int deleted = 0;
+
+	next = apr_atomic_read32(&dbm_header->next_pass);
+	if (sec < next || apr_atomic_cas32(&dbm_header->next_pass,
+					   sec + MGS_DBM_EXPIRY_INTERVAL,
+					   next) != next)
+		return;
+
+	apr_pool_create(&spool, p);
+	for (i = 0; i < dbm_nshards; i++)
+		deleted += dbm_expire_shard(&dbm_shards[i], now, spool);
 	apr_pool_destroy(spool);
 
-	return;
+	if (deleted > 0)
+		ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+			     "[gnutls_cache] Cleaned up cache '%s'. "
+			     "Deleted %d", dbm_sc->cache_config, deleted);
+}
+
+#if APR_HAS_THREADS
+static void *APR_THREAD_FUNC dbm_expiry_thread_main(apr_thread_t * thread,
+						    void *data)
+{
+	server_rec *s = data;
+
+	while (!dbm_expiry_stop) {
+		dbm_expire(s, apr_thread_pool_get(thread));
+		apr_sleep(apr_time_from_sec(1));
+	}
+
+	apr_thread_exit(thread, APR_SUCCESS);
+	return NULL;
 }
 
+static apr_status_t dbm_expiry_thread_cleanup(void *data)
+{
+	apr_status_t rv;
+
+	dbm_expiry_stop = 1;
+	if (dbm_expiry_thread != NULL)
+		apr_thread_join(&rv, dbm_expiry_thread);
+	dbm_expiry_thread = NULL;
+	return APR_SUCCESS;
+}
+#endif
+
 static gnutls_datum_t dbm_cache_fetch(void *baton, gnutls_datum_t key)
 {
 	gnutls_datum_t data = { NULL, 0 };
@@ -383,32 +823,35 @@ static gnutls_datum_t dbm_cache_fetch(void *baton, gnutls_datum_t key)
 	apr_datum_t dbmkey;
 	apr_datum_t dbmval;
 	mgs_handle_t *ctxt = baton;
+	mgs_dbm_shard_t *shard;
 	apr_status_t rv;
 
 	if (mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
 		return data;
 
-	rv = apr_dbm_open_ex(&dbm, db_type(ctxt->sc),
-			     ctxt->sc->cache_config, APR_DBM_READONLY,
-			     SSL_DBM_FILE_MODE, ctxt->c->pool);
+	shard = dbm_shard(&dbmkey);
+	rv = dbm_shard_lock(shard, APR_DBM_READONLY, ctxt->c->pool, &dbm);
 	if (rv != APR_SUCCESS) {
 		ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
 			     ctxt->c->base_server,
 			     "[gnutls_cache] error opening cache '%s'",
-			     ctxt->sc->cache_config);
+			     shard->path);
 		return data;
 	}
 
 	rv = apr_dbm_fetch(dbm, dbmkey, &dbmval);
 
 	if (rv != APR_SUCCESS) {
-		apr_dbm_close(dbm);
+		dbm_shard_unlock(shard, dbm, 0);
 		return data;
 	}
 
-	if (dbmval.dptr == NULL || dbmval.dsize <= sizeof(apr_time_t)) {
-		apr_dbm_freedatum(dbm, dbmval);
-		apr_dbm_close(dbm);
+	/* not deleted yet by the expiry pass */
+	if (dbmval.dptr == NULL || dbmval.dsize <= sizeof(apr_time_t)
+	    || dbm_expired(dbmval, apr_time_now())) {
+		if (dbmval.dptr != NULL)
+			apr_dbm_freedatum(dbm, dbmval);
+		dbm_shard_unlock(shard, dbm, 0);
 		return data;
 	}
 
@@ -417,14 +860,14 @@ static gnutls_datum_t dbm_cache_fetch(void *baton, gnutls_datum_t key)
 	data.data = gnutls_malloc(data.size);
 	if (data.data == NULL) {
 		apr_dbm_freedatum(dbm, dbmval);
-		apr_dbm_close(dbm);
+		dbm_shard_unlock(shard, dbm, 0);
 		return data;
 	}
 
 	memcpy(data.data, dbmval.dptr + sizeof(apr_time_t), data.size);
 
 	apr_dbm_freedatum(dbm, dbmval);
-	apr_dbm_close(dbm);
+	dbm_shard_unlock(shard, dbm, 0);
 
 	return data;
 }
@@ -436,16 +879,33 @@ static int dbm_cache_store(void *baton, gnutls_datum_t key,
 	apr_datum_t dbmkey;
 	apr_datum_t dbmval;
 	mgs_handle_t *ctxt = baton;
+	mgs_dbm_shard_t *shard;
 	apr_status_t rv;
-	apr_time_t expiry;
+	apr_time_t now, expiry;
 	apr_pool_t *spool;
+	int known = 1;
 
 	if (mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
 		return -1;
 
-	/* we expire dbm only on every store
+	/* the limits count the sessions in the expiry queue */
+	if ((dbm_sc->cache_max_entries != 0 || ctxt->sc->cache_owner != 0)
+	    && dbmkey.dsize > MGS_DBM_EXPIRY_KEY_LEN) {
+		ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, ctxt->c->base_server,
+			     "[gnutls_cache] not storing the session, its "
+			     "key of %" APR_SIZE_T_FMT " bytes is too long "
+			     "to be counted", dbmkey.dsize);
+		return -1;
+	}
+
+	if (dbm_doorkeeper != NULL)
+		known = dbm_doorkeeper_check(ctxt->c);
+
+#if !APR_HAS_THREADS
+	/* without an expiry thread the stores take turns
 	 */
-	dbm_cache_expire(ctxt);
+	dbm_expire(ctxt->c->base_server, ctxt->c->pool);
+#endif
 
 	apr_pool_create(&spool, ctxt->c->pool);
 
@@ -453,20 +913,30 @@ static int dbm_cache_store(void *baton, gnutls_datum_t key,
 	dbmval.dsize = data.size + sizeof(apr_time_t);
 	dbmval.dptr = (char *) apr_palloc(spool, dbmval.dsize);
 
-	expiry = apr_time_now() + ctxt->sc->cache_timeout;
+	now = apr_time_now();
+	expiry = now + ctxt->sc->cache_timeout;
 
 	memcpy((char *) dbmval.dptr, &expiry, sizeof(apr_time_t));
 	memcpy((char *) dbmval.dptr + sizeof(apr_time_t),
 	       data.data, data.size);
 
-	rv = apr_dbm_open_ex(&dbm, db_type(ctxt->sc),
-			     ctxt->sc->cache_config, APR_DBM_RWCREATE,
-			     SSL_DBM_FILE_MODE, ctxt->c->pool);
+	shard = dbm_shard(&dbmkey);
+	rv = dbm_shard_lock(shard, APR_DBM_RWCREATE, ctxt->c->pool, &dbm);
 	if (rv != APR_SUCCESS) {
 		ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
 			     ctxt->c->base_server,
 			     "[gnutls_cache] error opening cache '%s'",
-			     ctxt->sc->cache_config);
+			     shard->path);
+		apr_pool_destroy(spool);
+		return -1;
+	}
+
+	if (dbm_make_room(shard, dbm, ctxt->sc, known, now) < 0) {
+		ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, ctxt->c->base_server,
+			     "[gnutls_cache] not storing the session in "
+			     "cache '%s', it is full or the host is at its "
+			     "quota", shard->path);
+		dbm_shard_unlock(shard, dbm, 1);
 		apr_pool_destroy(spool);
 		return -1;
 	}
@@ -477,13 +947,14 @@ static int dbm_cache_store(void *baton, gnutls_datum_t key,
 		ap_log_error(APLOG_MARK, APLOG_DEBUG, rv,
 			     ctxt->c->base_server,
 			     "[gnutls_cache] error storing in cache '%s'",
-			     ctxt->sc->cache_config);
-		apr_dbm_close(dbm);
+			     shard->path);
+		dbm_shard_unlock(shard, dbm, 1);
 		apr_pool_destroy(spool);
 		return -1;
 	}
 
-	apr_dbm_close(dbm);
+	dbm_expiry_push(shard, &dbmkey, expiry, ctxt->sc->cache_owner);
+	dbm_shard_unlock(shard, dbm, 1);
 
 	apr_pool_destroy(spool);
 
@@ -495,19 +966,19 @@ static int dbm_cache_delete(void *baton, gnutls_datum_t key)
 	apr_dbm_t *dbm;
 	apr_datum_t dbmkey;
 	mgs_handle_t *ctxt = baton;
+	mgs_dbm_shard_t *shard;
 	apr_status_t rv;
 
 	if (mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
 		return -1;
 
-	rv = apr_dbm_open_ex(&dbm, db_type(ctxt->sc),
-			     ctxt->sc->cache_config, APR_DBM_RWCREATE,
-			     SSL_DBM_FILE_MODE, ctxt->c->pool);
+	shard = dbm_shard(&dbmkey);
+	rv = dbm_shard_lock(shard, APR_DBM_RWCREATE, ctxt->c->pool, &dbm);
 	if (rv != APR_SUCCESS) {
 		ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
 			     ctxt->c->base_server,
 			     "[gnutls_cache] error opening cache '%s'",
-			     ctxt->sc->cache_config);
+			     shard->path);
 		return -1;
 	}
 
@@ -517,12 +988,12 @@ static int dbm_cache_delete(void *baton, gnutls_datum_t key)
 		ap_log_error(APLOG_MARK, APLOG_NOTICE, rv,
 			     ctxt->c->base_server,
 			     "[gnutls_cache] error deleting from cache '%s'",
-			     ctxt->sc->cache_config);
-		apr_dbm_close(dbm);
+			     shard->path);
+		dbm_shard_unlock(shard, dbm, 1);
 		return -1;
 	}
 
-	apr_dbm_close(dbm);
+	dbm_shard_unlock(shard, dbm, 1);
 
 	return 0;
 }
@@ -534,53 +1005,699 @@ static int dbm_cache_post_config(apr_pool_t * p, server_rec * s,
 	apr_dbm_t *dbm;
 	const char *path1;
 	const char *path2;
+	unsigned char *base;
+	apr_size_t head_size;
+	unsigned int i, owners = 0;
+	server_rec *vs;
+	mgs_srvconf_rec *vsc;
+
+	dbm_sc = sc;
+	dbm_nshards = sc->dbm_shards;
+	dbm_shards = apr_pcalloc(p, dbm_nshards * sizeof(*dbm_shards));
+	if (sc->cache_max_entries != 0)
+		dbm_queue_len = (sc->cache_max_entries + dbm_nshards - 1)
+		    / dbm_nshards;
+	else
+		dbm_queue_len = MGS_DBM_EXPIRY_ENTRIES / dbm_nshards;
+
+	/* number the hosts with a quota, 0 is for those without */
+	for (vs = s; vs; vs = vs->next) {
+		vsc = ap_get_module_config(vs->module_config, &gnutls_module);
+		vsc->cache_owner = 0;
+		if (vsc->cache_quota != 0 && owners < 0xffff)
+			vsc->cache_owner = ++owners;
+	}
 
-	rv = apr_dbm_open_ex(&dbm, db_type(sc), sc->cache_config,
-			     APR_DBM_RWCREATE, SSL_DBM_FILE_MODE, p);
-
+	head_size = sizeof(mgs_dbm_header_t) +
+	    dbm_nshards * (owners + 1) * sizeof(apr_uint32_t);
+	if (sc->cache_admission == GNUTLS_ENABLED_TRUE)
+		head_size += MGS_DBM_DOORKEEPER_BITS / 8;
+	head_size = APR_ALIGN_DEFAULT(head_size);
+
+	rv = mgs_shm_create(&dbm_shm, head_size +
+			    dbm_nshards * (sizeof(mgs_dbm_shared_t) +
+					   dbm_queue_len *
+					   sizeof(mgs_dbm_expiry_t)),
+			    ap_server_root_relative(p,
+						    "logs/gnutls_dbm.shm"),
+			    p);
 	if (rv != APR_SUCCESS) {
 		ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
-			     "GnuTLS: Cannot create DBM Cache at `%s'",
-			     sc->cache_config);
+			     "GnuTLS: Cannot create the shared memory "
+			     "of the DBM cache");
 		return rv;
 	}
+	base = apr_shm_baseaddr_get(dbm_shm);
+	dbm_header = (mgs_dbm_header_t *) base;
+	for (i = 0; i < dbm_nshards; i++)
+		dbm_shards[i].counts = (apr_uint32_t *) (dbm_header + 1) +
+		    i * (owners + 1);
+	dbm_doorkeeper = NULL;
+	if (sc->cache_admission == GNUTLS_ENABLED_TRUE)
+		dbm_doorkeeper = (apr_uint32_t *) (dbm_header + 1) +
+		    dbm_nshards * (owners + 1);
+	base += head_size;
+
+	for (i = 0; i < dbm_nshards; i++) {
+		dbm_shards[i].shared = (mgs_dbm_shared_t *) base;
+		base += sizeof(mgs_dbm_shared_t);
+		dbm_shards[i].queue = (mgs_dbm_expiry_t *) base;
+		base += dbm_queue_len * sizeof(mgs_dbm_expiry_t);
+
+		/* a single file keeps the name it always had */
+		dbm_shards[i].path = dbm_nshards == 1 ? sc->cache_config :
+		    apr_psprintf(p, "%s.%u", sc->cache_config, i);
+
+		rv = mgs_mutex_create(&dbm_shards[i].mutex, s, p);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+				     "GnuTLS: Cannot create the DBM cache "
+				     "mutex");
+			return rv;
+		}
 
-	apr_dbm_close(dbm);
+		rv = apr_dbm_open_ex(&dbm, db_type(sc), dbm_shards[i].path,
+				     APR_DBM_RWCREATE, SSL_DBM_FILE_MODE, p);
 
-	apr_dbm_get_usednames_ex(p, db_type(sc), sc->cache_config, &path1,
-				 &path2);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+				     "GnuTLS: Cannot create DBM Cache at `%s'",
+				     dbm_shards[i].path);
+			return rv;
+		}
+
+		/* the sessions left from before the restart are not in
+		 * the queue
+		 */
+		dbm_shards[i].shared->scan_at = apr_time_now() +
+		    sc->cache_timeout;
+
+		apr_dbm_close(dbm);
 
-	/* The Following Code takes logic directly from mod_ssl's DBM Cache */
+		apr_dbm_get_usednames_ex(p, db_type(sc), dbm_shards[i].path,
+					 &path1, &path2);
+
+		/* The Following Code takes logic directly from mod_ssl's DBM Cache */
 #if !defined(OS2) && !defined(WIN32) && !defined(BEOS) && !defined(NETWARE)
-	/* Running as Root */
-	if (path1 && geteuid() == 0) {
-		chown(path1, ap_unixd_config.user_id, -1);
-		if (path2 != NULL) {
-			chown(path2, ap_unixd_config.user_id, -1);
+		/* Running as Root */
+		if (path1 && geteuid() == 0) {
+			chown(path1, ap_unixd_config.user_id, -1);
+			if (path2 != NULL) {
+				chown(path2, ap_unixd_config.user_id, -1);
+			}
 		}
+#endif
 	}
+
+	return 0;
+}
+
+static int dbm_cache_child_init(apr_pool_t * p, server_rec * s,
+				mgs_srvconf_rec * sc)
+{
+	apr_status_t rv;
+	unsigned int i;
+
+	for (i = 0; i < dbm_nshards; i++) {
+		rv = mgs_mutex_child_init(&dbm_shards[i].mutex, p);
+		if (rv != APR_SUCCESS)
+			return rv;
+		if (sc->cache_type == mgs_cache_sdbm)
+			apr_pool_create(&dbm_shards[i].pool, p);
+	}
+
+#if APR_HAS_THREADS
+	dbm_expiry_stop = 0;
+	rv = apr_thread_create(&dbm_expiry_thread, NULL,
+			       dbm_expiry_thread_main, s, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s,
+			     "GnuTLS: Failed to start the session cache "
+			     "expiry thread");
+		dbm_expiry_thread = NULL;
+		return 0;
+	}
+	/* join before the pools used by the thread go away */
+	apr_pool_pre_cleanup_register(p, NULL, dbm_expiry_thread_cleanup);
 #endif
 
-	return rv;
+	return 0;
+}
+
+/**
+ * GnuTLS Session Cache in shared memory
+ *
+ * The segment is split into MGS_SHMCB_SUBCACHES subcaches, picked by a
+ * hash of the session key, each with a lock of its own. A subcache is a
+ * cyclic index of its sessions in the order they were stored, over a
+ * cyclic buffer with their keys and data. Storing appends to both and
+ * drops the oldest sessions until there is room; expired and deleted
+ * sessions are dropped from the front as well. The index entries are
+ * also chained into hash buckets, one per entry, so a lookup only
+ * compares the few sessions of its bucket.
+ */
+
+#define MGS_SHMCB_SUBCACHES 16
+/* the size of a session with its key assumed to size the index */
+#define MGS_SHMCB_AVG_SESSION 300
+
+typedef struct {
+	apr_time_t expires;
+	apr_uint32_t hash;
+	/* where the key starts in the buffer, the data follows it */
+	apr_uint32_t pos;
+	apr_uint32_t key_len;
+	apr_uint32_t data_len;
+	apr_uint32_t removed;
+	/* the next entry in the bucket, plus one; 0 ends the chain */
+	apr_uint32_t next;
+} mgs_shmcb_index_t;
+
+/* followed by shmcb_nbuckets bucket heads (an index entry plus one, or
+ * 0), shmcb_index_num index entries and the buffer
+ */
+typedef struct {
+	apr_uint32_t idx_pos;
+	apr_uint32_t idx_used;
+	apr_uint32_t data_pos;
+	apr_uint32_t data_used;
+} mgs_shmcb_subcache_t;
+
+static apr_shm_t *shmcb_shm;
+static unsigned char *shmcb_base;
+static apr_global_mutex_t *shmcb_mutex[MGS_SHMCB_SUBCACHES];
+static apr_size_t shmcb_subcache_size;
+static apr_uint32_t shmcb_nbuckets;
+static apr_uint32_t shmcb_index_num;
+static apr_uint32_t shmcb_data_size;
+
+#define SHMCB_BUCKETS(sub) ((apr_uint32_t *) ((sub) + 1))
+#define SHMCB_INDEX(sub) \
+	((mgs_shmcb_index_t *) (SHMCB_BUCKETS(sub) + shmcb_nbuckets))
+#define SHMCB_DATA(sub) \
+	((unsigned char *) (SHMCB_INDEX(sub) + shmcb_index_num))
+
+static mgs_shmcb_subcache_t *shmcb_subcache(apr_uint32_t hash,
+					    apr_global_mutex_t ** mutex)
+{
+	unsigned int i = (hash >> 16) % MGS_SHMCB_SUBCACHES;
+
+	*mutex = shmcb_mutex[i];
+	return (mgs_shmcb_subcache_t *) (shmcb_base +
+					 i * shmcb_subcache_size);
+}
+
+/* Copy into and out of the cyclic buffer at pos */
+static void shmcb_put(mgs_shmcb_subcache_t * sub, apr_uint32_t pos,
+		      const void *src, apr_uint32_t len)
+{
+	apr_uint32_t n = shmcb_data_size - pos;
+
+	if (n > len)
+		n = len;
+	memcpy(SHMCB_DATA(sub) + pos, src, n);
+	memcpy(SHMCB_DATA(sub), (const unsigned char *) src + n, len - n);
+}
+
+static void shmcb_get(mgs_shmcb_subcache_t * sub, apr_uint32_t pos,
+		      void *dst, apr_uint32_t len)
+{
+	apr_uint32_t n = shmcb_data_size - pos;
+
+	if (n > len)
+		n = len;
+	memcpy(dst, SHMCB_DATA(sub) + pos, n);
+	memcpy((unsigned char *) dst + n, SHMCB_DATA(sub), len - n);
+}
+
+static int shmcb_cmp(mgs_shmcb_subcache_t * sub, apr_uint32_t pos,
+		     const void *buf, apr_uint32_t len)
+{
+	apr_uint32_t n = shmcb_data_size - pos;
+
+	if (n > len)
+		n = len;
+	if (memcmp(SHMCB_DATA(sub) + pos, buf, n) != 0)
+		return 1;
+	return memcmp(SHMCB_DATA(sub), (const unsigned char *) buf + n,
+		      len - n);
+}
+
+/* The head of the bucket of hash in sub */
+static apr_uint32_t *shmcb_bucket(mgs_shmcb_subcache_t * sub,
+				  apr_uint32_t hash)
+{
+	return &SHMCB_BUCKETS(sub)[hash % shmcb_nbuckets];
+}
+
+/* Drop the oldest session of sub */
+static void shmcb_drop(mgs_shmcb_subcache_t * sub)
+{
+	mgs_shmcb_index_t *idx = &SHMCB_INDEX(sub)[sub->idx_pos];
+	apr_uint32_t len = idx->key_len + idx->data_len;
+	apr_uint32_t *link = shmcb_bucket(sub, idx->hash);
+
+	while (*link != 0 && *link != sub->idx_pos + 1)
+		link = &SHMCB_INDEX(sub)[*link - 1].next;
+	if (*link != 0)
+		*link = idx->next;
+
+	sub->data_pos = (sub->data_pos + len) % shmcb_data_size;
+	sub->data_used -= len;
+	sub->idx_pos = (sub->idx_pos + 1) % shmcb_index_num;
+	sub->idx_used--;
+}
+
+/* Drop the expired and deleted sessions at the front of sub */
+static void shmcb_expire(mgs_shmcb_subcache_t * sub, apr_time_t now)
+{
+	mgs_shmcb_index_t *idx;
+
+	while (sub->idx_used > 0) {
+		idx = &SHMCB_INDEX(sub)[sub->idx_pos];
+		if (!idx->removed && idx->expires > now)
+			break;
+		shmcb_drop(sub);
+	}
+}
+
+static mgs_shmcb_index_t *shmcb_find(mgs_shmcb_subcache_t * sub,
+				     apr_uint32_t hash, const char *key,
+				     apr_uint32_t key_len, apr_time_t now)
+{
+	mgs_shmcb_index_t *idx;
+	apr_uint32_t i;
+
+	for (i = *shmcb_bucket(sub, hash); i != 0; i = idx->next) {
+		idx = &SHMCB_INDEX(sub)[i - 1];
+		if (!idx->removed && idx->expires > now && idx->hash == hash
+		    && idx->key_len == key_len
+		    && shmcb_cmp(sub, idx->pos, key, key_len) == 0)
+			return idx;
+	}
+	return NULL;
+}
+
+static gnutls_datum_t shm_cache_fetch(void *baton, gnutls_datum_t key)
+{
+	gnutls_datum_t data = { NULL, 0 };
+	mgs_handle_t *ctxt = baton;
+	mgs_shmcb_subcache_t *sub;
+	mgs_shmcb_index_t *idx;
+	apr_global_mutex_t *mutex;
+	apr_datum_t dbmkey;
+	apr_uint32_t hash;
+
+	if (shmcb_base == NULL
+	    || mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
+		return data;
+
+	hash = cache_hash(dbmkey.dptr, dbmkey.dsize);
+	sub = shmcb_subcache(hash, &mutex);
+	if (apr_global_mutex_lock(mutex) != APR_SUCCESS)
+		return data;
+
+	idx = shmcb_find(sub, hash, dbmkey.dptr, dbmkey.dsize,
+			 apr_time_now());
+	if (idx != NULL) {
+		data.data = gnutls_malloc(idx->data_len);
+		if (data.data != NULL) {
+			data.size = idx->data_len;
+			shmcb_get(sub, (idx->pos + idx->key_len) %
+				  shmcb_data_size, data.data, data.size);
+		}
+	}
+
+	apr_global_mutex_unlock(mutex);
+
+	return data;
+}
+
+static int shm_cache_store(void *baton, gnutls_datum_t key,
+			   gnutls_datum_t data)
+{
+	mgs_handle_t *ctxt = baton;
+	mgs_shmcb_subcache_t *sub;
+	mgs_shmcb_index_t *idx;
+	apr_global_mutex_t *mutex;
+	apr_datum_t dbmkey;
+	apr_uint32_t hash, len, pos, i;
+	apr_time_t now;
+
+	if (shmcb_base == NULL
+	    || mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
+		return -1;
+
+	len = dbmkey.dsize + data.size;
+	if (len > shmcb_data_size) {
+		ap_log_error(APLOG_MARK, APLOG_DEBUG, 0,
+			     ctxt->c->base_server,
+			     "[gnutls_cache] session of %u bytes does not "
+			     "fit into the cache", data.size);
+		return -1;
+	}
+
+	hash = cache_hash(dbmkey.dptr, dbmkey.dsize);
+	sub = shmcb_subcache(hash, &mutex);
+	if (apr_global_mutex_lock(mutex) != APR_SUCCESS)
+		return -1;
+
+	now = apr_time_now();
+	idx = shmcb_find(sub, hash, dbmkey.dptr, dbmkey.dsize, now);
+	if (idx != NULL)
+		idx->removed = 1;
+	shmcb_expire(sub, now);
+	while (sub->idx_used == shmcb_index_num
+	       || shmcb_data_size - sub->data_used < len)
+		shmcb_drop(sub);
+
+	pos = (sub->data_pos + sub->data_used) % shmcb_data_size;
+	shmcb_put(sub, pos, dbmkey.dptr, dbmkey.dsize);
+	shmcb_put(sub, (pos + dbmkey.dsize) % shmcb_data_size, data.data,
+		  data.size);
+	sub->data_used += len;
+
+	i = (sub->idx_pos + sub->idx_used) % shmcb_index_num;
+	idx = &SHMCB_INDEX(sub)[i];
+	idx->expires = now + ctxt->sc->cache_timeout;
+	idx->hash = hash;
+	idx->pos = pos;
+	idx->key_len = dbmkey.dsize;
+	idx->data_len = data.size;
+	idx->removed = 0;
+	idx->next = *shmcb_bucket(sub, hash);
+	*shmcb_bucket(sub, hash) = i + 1;
+	sub->idx_used++;
+
+	apr_global_mutex_unlock(mutex);
+
+	return 0;
+}
+
+static int shm_cache_delete(void *baton, gnutls_datum_t key)
+{
+	mgs_handle_t *ctxt = baton;
+	mgs_shmcb_subcache_t *sub;
+	mgs_shmcb_index_t *idx;
+	apr_global_mutex_t *mutex;
+	apr_datum_t dbmkey;
+	apr_uint32_t hash;
+
+	if (shmcb_base == NULL
+	    || mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
+		return -1;
+
+	hash = cache_hash(dbmkey.dptr, dbmkey.dsize);
+	sub = shmcb_subcache(hash, &mutex);
+	if (apr_global_mutex_lock(mutex) != APR_SUCCESS)
+		return -1;
+
+	idx = shmcb_find(sub, hash, dbmkey.dptr, dbmkey.dsize,
+			 apr_time_now());
+	if (idx != NULL)
+		idx->removed = 1;
+
+	apr_global_mutex_unlock(mutex);
+
+	return idx != NULL ? 0 : -1;
+}
+
+static int shm_cache_post_config(apr_pool_t * p, server_rec * s,
+				 mgs_srvconf_rec * sc)
+{
+	apr_status_t rv;
+	unsigned int i;
+
+	shmcb_base = NULL;
+	shmcb_subcache_size = (sc->cache_size / MGS_SHMCB_SUBCACHES) &
+	    ~(apr_size_t) 7;
+	shmcb_index_num = (shmcb_subcache_size -
+			   sizeof(mgs_shmcb_subcache_t) - sizeof(apr_uint32_t)) /
+	    (sizeof(apr_uint32_t) + sizeof(mgs_shmcb_index_t) +
+	     MGS_SHMCB_AVG_SESSION);
+	/* an even number keeps the index entries aligned */
+	shmcb_nbuckets = (shmcb_index_num + 1) & ~(apr_uint32_t) 1;
+	shmcb_data_size = shmcb_subcache_size -
+	    sizeof(mgs_shmcb_subcache_t) -
+	    shmcb_nbuckets * sizeof(apr_uint32_t) -
+	    shmcb_index_num * sizeof(mgs_shmcb_index_t);
+
+	rv = mgs_shm_create(&shmcb_shm,
+			    shmcb_subcache_size * MGS_SHMCB_SUBCACHES,
+			    ap_server_root_relative(p,
+						    "logs/gnutls_cache.shm"),
+			    p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+			     "GnuTLS: Cannot create the shared memory "
+			     "session cache of %" APR_SIZE_T_FMT " bytes",
+			     sc->cache_size);
+		return rv;
+	}
+
+	for (i = 0; i < MGS_SHMCB_SUBCACHES; i++) {
+		rv = mgs_mutex_create(&shmcb_mutex[i], s, p);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+				     "GnuTLS: Cannot create the session "
+				     "cache mutex");
+			return rv;
+		}
+	}
+
+	shmcb_base = apr_shm_baseaddr_get(shmcb_shm);
+	return 0;
+}
+
+static int shm_cache_child_init(apr_pool_t * p, server_rec * s,
+				mgs_srvconf_rec * sc)
+{
+	apr_status_t rv;
+	unsigned int i;
+
+	for (i = 0; i < MGS_SHMCB_SUBCACHES; i++) {
+		rv = mgs_mutex_child_init(&shmcb_mutex[i], p);
+		if (rv != APR_SUCCESS) {
+			/* run without the cache */
+			shmcb_base = NULL;
+			return rv;
+		}
+	}
+	return 0;
+}
+
+#if HAVE_AP_SOCACHE
+/**
+ * GnuTLS Session Cache through a mod_socache provider
+ *
+ * GnuTLSCache socache:<provider> hands the sessions to the shared object
+ * cache provider of that name (shmcb, dc, memcache, redis...), set up
+ * with the same argument as in mod_ssl. Providers that are not safe to
+ * use from several processes and threads at once are called with
+ * socache_mutex held, as mod_ssl does.
+ */
+
+/* the largest session that can be fetched */
+#define MGS_SOCACHE_MAX_SESSION (16 * 1024)
+
+static const ap_socache_provider_t *socache;
+static ap_socache_instance_t *socache_instance;
+static apr_global_mutex_t *socache_mutex;
+
+static int socache_lock(void)
+{
+	return socache_mutex == NULL
+	    || apr_global_mutex_lock(socache_mutex) == APR_SUCCESS;
+}
+
+static void socache_unlock(void)
+{
+	if (socache_mutex != NULL)
+		apr_global_mutex_unlock(socache_mutex);
+}
+
+static gnutls_datum_t socache_fetch(void *baton, gnutls_datum_t key)
+{
+	gnutls_datum_t data = { NULL, 0 };
+	mgs_handle_t *ctxt = baton;
+	apr_datum_t dbmkey;
+	apr_status_t rv;
+	unsigned char *buf;
+	unsigned int len = MGS_SOCACHE_MAX_SESSION;
+
+	if (socache == NULL
+	    || mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
+		return data;
+
+	buf = apr_palloc(ctxt->c->pool, len);
+	if (!socache_lock())
+		return data;
+	rv = socache->retrieve(socache_instance, ctxt->c->base_server,
+			       (unsigned char *) dbmkey.dptr, dbmkey.dsize,
+			       buf, &len, ctxt->c->pool);
+	socache_unlock();
+	if (rv != APR_SUCCESS)
+		return data;
+
+	data.data = gnutls_malloc(len);
+	if (data.data == NULL)
+		return data;
+	data.size = len;
+	memcpy(data.data, buf, len);
+
+	return data;
+}
+
+static int socache_store(void *baton, gnutls_datum_t key,
+			 gnutls_datum_t data)
+{
+	mgs_handle_t *ctxt = baton;
+	apr_datum_t dbmkey;
+	apr_status_t rv;
+
+	if (socache == NULL
+	    || mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
+		return -1;
+
+	if (!socache_lock())
+		return -1;
+	rv = socache->store(socache_instance, ctxt->c->base_server,
+			    (unsigned char *) dbmkey.dptr, dbmkey.dsize,
+			    apr_time_now() + ctxt->sc->cache_timeout,
+			    data.data, data.size, ctxt->c->pool);
+	socache_unlock();
+
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_DEBUG, rv,
+			     ctxt->c->base_server,
+			     "[gnutls_cache] error storing in socache '%s'",
+			     socache->name);
+		return -1;
+	}
+
+	return 0;
 }
 
+static int socache_delete(void *baton, gnutls_datum_t key)
+{
+	mgs_handle_t *ctxt = baton;
+	apr_datum_t dbmkey;
+	apr_status_t rv;
+
+	if (socache == NULL
+	    || mgs_session_id2dbm(ctxt->c, key.data, key.size, &dbmkey) < 0)
+		return -1;
+
+	if (!socache_lock())
+		return -1;
+	rv = socache->remove(socache_instance, ctxt->c->base_server,
+			     (unsigned char *) dbmkey.dptr, dbmkey.dsize,
+			     ctxt->c->pool);
+	socache_unlock();
+
+	return rv == APR_SUCCESS ? 0 : -1;
+}
+
+static apr_status_t socache_cleanup(void *data)
+{
+	server_rec *s = data;
+
+	if (socache != NULL)
+		socache->destroy(socache_instance, s);
+	socache = NULL;
+	return APR_SUCCESS;
+}
+
+static int socache_post_config(apr_pool_t * p, server_rec * s,
+			       mgs_srvconf_rec * sc)
+{
+	struct ap_socache_hints hints;
+	apr_status_t rv;
+
+	socache = NULL;
+	socache_mutex = NULL;
+
+	if (sc->socache->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+		rv = mgs_mutex_create(&socache_mutex, s, p);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+				     "GnuTLS: Cannot create the session "
+				     "cache mutex");
+			return rv;
+		}
+	}
+
+	/* "server:port.id" keys and sessions of a few hundred bytes */
+	hints.avg_id_len = 80;
+	hints.avg_obj_size = 300;
+	hints.expiry_interval = apr_time_from_sec(30);
+
+	rv = sc->socache->init(sc->socache_instance, "mod_gnutls-session",
+			       &hints, s, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+			     "GnuTLS: Cannot set up the session cache "
+			     "'socache:%s'", sc->socache->name);
+		return rv;
+	}
+
+	socache = sc->socache;
+	socache_instance = sc->socache_instance;
+	apr_pool_cleanup_register(p, s, socache_cleanup,
+				  apr_pool_cleanup_null);
+	return 0;
+}
+
+int mgs_cache_status_hook(request_rec * r, int flags)
+{
+	if (socache == NULL)
+		return OK;
+
+	if (flags & AP_STATUS_SHORT)
+		ap_rprintf(r, "GnuTLSSessionCache: socache:%s\n",
+			   socache->name);
+	else
+		ap_rprintf(r, "<hr>\n<h2>GnuTLS session cache "
+			   "(socache:%s)</h2>\n", socache->name);
+
+	if (socache_lock()) {
+		socache->status(socache_instance, r, flags);
+		socache_unlock();
+	}
+
+	return OK;
+}
+#endif
+
 int mgs_cache_post_config(apr_pool_t * p, server_rec * s,
 			  mgs_srvconf_rec * sc)
 {
-	if (sc->cache_type == mgs_cache_dbm
-	    || sc->cache_type == mgs_cache_gdbm) {
+	if (MGS_CACHE_IS_DBM(sc->cache_type)) {
 		return dbm_cache_post_config(p, s, sc);
+	} else if (sc->cache_type == mgs_cache_shm) {
+		return shm_cache_post_config(p, s, sc);
 	}
+#if HAVE_AP_SOCACHE
+	else if (sc->cache_type == mgs_cache_socache) {
+		return socache_post_config(p, s, sc);
+	}
+#endif
 	return 0;
 }
 
 int mgs_cache_child_init(apr_pool_t * p, server_rec * s,
 			 mgs_srvconf_rec * sc)
 {
-	if (sc->cache_type == mgs_cache_dbm
-	    || sc->cache_type == mgs_cache_gdbm) {
-		return 0;
+	if (MGS_CACHE_IS_DBM(sc->cache_type)) {
+		return dbm_cache_child_init(p, s, sc);
+	} else if (sc->cache_type == mgs_cache_shm) {
+		return shm_cache_child_init(p, s, sc);
 	}
+#if HAVE_AP_SOCACHE
+	else if (sc->cache_type == mgs_cache_socache) {
+		return mgs_mutex_child_init(&socache_mutex, p);
+	}
+#endif
 #if HAVE_APR_MEMCACHE
 	else if (sc->cache_type == mgs_cache_memcache) {
 		return mc_cache_child_init(p, s, sc);
@@ -593,8 +1710,7 @@ int mgs_cache_child_init(apr_pool_t * p, server_rec * s,
 
 int mgs_cache_session_init(mgs_handle_t * ctxt)
 {
-	if (ctxt->sc->cache_type == mgs_cache_dbm
-	    || ctxt->sc->cache_type == mgs_cache_gdbm) {
+	if (MGS_CACHE_IS_DBM(ctxt->sc->cache_type)) {
 		gnutls_db_set_retrieve_function(ctxt->session,
 						dbm_cache_fetch);
 		gnutls_db_set_remove_function(ctxt->session,
@@ -602,7 +1718,26 @@ int mgs_cache_session_init(mgs_handle_t * ctxt)
 		gnutls_db_set_store_function(ctxt->session,
 					     dbm_cache_store);
 		gnutls_db_set_ptr(ctxt->session, ctxt);
+	} else if (ctxt->sc->cache_type == mgs_cache_shm) {
+		gnutls_db_set_retrieve_function(ctxt->session,
+						shm_cache_fetch);
+		gnutls_db_set_remove_function(ctxt->session,
+					      shm_cache_delete);
+		gnutls_db_set_store_function(ctxt->session,
+					     shm_cache_store);
+		gnutls_db_set_ptr(ctxt->session, ctxt);
 	}
+#if HAVE_AP_SOCACHE
+	else if (ctxt->sc->cache_type == mgs_cache_socache) {
+		gnutls_db_set_retrieve_function(ctxt->session,
+						socache_fetch);
+		gnutls_db_set_remove_function(ctxt->session,
+					      socache_delete);
+		gnutls_db_set_store_function(ctxt->session,
+					     socache_store);
+		gnutls_db_set_ptr(ctxt->session, ctxt);
+	}
+#endif
 #if HAVE_APR_MEMCACHE
 	else if (ctxt->sc->cache_type == mgs_cache_memcache) {
 		gnutls_db_set_retrieve_function(ctxt->session,
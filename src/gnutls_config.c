@@ -140,89 +140,84 @@ const char *mgs_set_rsa_export_file(cmd_parms * parms, void *dummy,
 }
 
 
+/* httpd -t and -D DUMP_... exit before post config, so parse the file
+ * named by a directive right away to still report bad files there
+ */
+static const char *mgs_test_cred_file(cmd_parms * parms,
+				      mgs_cred_kind_e kind, const char *file)
+{
+#ifdef AP_SQ_RUN_MODE
+	int mode = ap_state_query(AP_SQ_RUN_MODE);
+
+	if (mode == AP_SQ_RM_CONFIG_TEST || mode == AP_SQ_RM_CONFIG_DUMP)
+		return mgs_credentials_test(parms->temp_pool, kind, file);
+#endif
+	return NULL;
+}
+
 const char *mgs_set_cert_file(cmd_parms * parms, void *dummy,
 			      const char *arg)
 {
-	int ret;
-	gnutls_datum_t data;
-	const char *file;
-	apr_pool_t *spool;
 	mgs_srvconf_rec *sc =
 	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
 						     module_config,
 						     &gnutls_module);
-	apr_pool_create(&spool, parms->pool);
-
-	file = ap_server_root_relative(spool, arg);
-
-	if (load_datum_from_file(spool, file, &data) != 0) {
-		return apr_psprintf(parms->pool, "GnuTLS: Error Reading "
-				    "Certificate '%s'", file);
-	}
 
-	sc->certs_x509_num = MAX_CHAIN_SIZE;
-	ret =
-	    gnutls_x509_crt_list_import(sc->certs_x509,
-					&sc->certs_x509_num, &data,
-					GNUTLS_X509_FMT_PEM, 0);
-	if (ret < 0) {
-		return apr_psprintf(parms->pool,
-				    "GnuTLS: Failed to Import "
-				    "Certificate '%s': (%d) %s", file, ret,
-				    gnutls_strerror(ret));
-	}
+	/* parsed with the files of all hosts at post config */
+	sc->x509_cert_file = ap_server_root_relative(parms->pool, arg);
 
-	apr_pool_destroy(spool);
-	return NULL;
+	return mgs_test_cred_file(parms, MGS_CRED_X509_CERT, sc->x509_cert_file);
 }
 
 const char *mgs_set_key_file(cmd_parms * parms, void *dummy,
 			     const char *arg)
 {
-	int ret;
-	gnutls_datum_t data;
-	const char *file;
-	apr_pool_t *spool;
 	mgs_srvconf_rec *sc =
 	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
 						     module_config,
 						     &gnutls_module);
-	apr_pool_create(&spool, parms->pool);
 
-	file = ap_server_root_relative(spool, arg);
+	/* parsed with the files of all hosts at post config */
+	sc->x509_key_file = ap_server_root_relative(parms->pool, arg);
 
-	if (load_datum_from_file(spool, file, &data) != 0) {
-		return apr_psprintf(parms->pool, "GnuTLS: Error Reading "
-				    "Private Key '%s'", file);
-	}
+	return mgs_test_cred_file(parms, MGS_CRED_X509_KEY, sc->x509_key_file);
+}
 
-	ret = gnutls_x509_privkey_init(&sc->privkey_x509);
-	if (ret < 0) {
-		return apr_psprintf(parms->pool,
-				    "GnuTLS: Failed to initialize"
-				    ": (%d) %s", ret,
-				    gnutls_strerror(ret));
-	}
+const char *mgs_set_key_server(cmd_parms * parms, void *dummy,
+			       const char *arg)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030000 && APR_HAS_THREADS
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
 
-	ret =
-	    gnutls_x509_privkey_import(sc->privkey_x509, &data,
-				       GNUTLS_X509_FMT_PEM);
+	if (strncasecmp(arg, "unix:", 5) == 0)
+		arg += 5;
+	sc->key_server = ap_server_root_relative(parms->pool, arg);
 
-	if (ret < 0)
-		ret =
-		    gnutls_x509_privkey_import_pkcs8(sc->privkey_x509,
-						     &data,
-						     GNUTLS_X509_FMT_PEM,
-						     NULL,
-						     GNUTLS_PKCS_PLAIN);
+	return NULL;
+#else
+	return "GnuTLSKeyServer requires GnuTLS 3.0 or later and a "
+	    "threaded APR";
+#endif
+}
+
+const char *mgs_set_key_server_timeout(cmd_parms * parms, void *dummy,
+				       const char *arg)
+{
+	int argint;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	argint = atoi(arg);
+	if (argint <= 0)
+		return "GnuTLSKeyServerTimeout: Invalid argument";
+
+	sc->key_server_timeout = apr_time_from_sec(argint);
 
-	if (ret < 0) {
-		return apr_psprintf(parms->pool,
-				    "GnuTLS: Failed to Import "
-				    "Private Key '%s': (%d) %s", file, ret,
-				    gnutls_strerror(ret));
-	}
-	apr_pool_destroy(spool);
 	return NULL;
 }
 
@@ -384,6 +379,7 @@ const char *mgs_set_srp_tpasswd_conf_file(cmd_parms * parms, void *dummy,
 const char *mgs_set_cache(cmd_parms * parms, void *dummy,
 			  const char *type, const char *arg)
 {
+	int argint;
 	const char *err;
 	mgs_srvconf_rec *sc =
 	    ap_get_module_config(parms->server->module_config,
@@ -400,7 +396,43 @@ const char *mgs_set_cache(cmd_parms * parms, void *dummy,
 		sc->cache_type = mgs_cache_dbm;
 	} else if (strcasecmp("gdbm", type) == 0) {
 		sc->cache_type = mgs_cache_gdbm;
+	} else if (strcasecmp("sdbm", type) == 0) {
+		sc->cache_type = mgs_cache_sdbm;
+	} else if (strcasecmp("shm", type) == 0) {
+		sc->cache_type = mgs_cache_shm;
+		sc->cache_config = NULL;
+		sc->cache_size = MGS_SHM_CACHE_DEFAULT_SIZE;
+		if (arg == NULL)
+			return NULL;
+		argint = atoi(arg);
+		if (argint < MGS_SHM_CACHE_MIN_SIZE)
+			return apr_psprintf(parms->pool, "GnuTLSCache shm: "
+					    "The size must be at least %d "
+					    "bytes", MGS_SHM_CACHE_MIN_SIZE);
+		sc->cache_size = argint;
+		return NULL;
+	}
+#if HAVE_AP_SOCACHE
+	else if (strncasecmp("socache:", type, 8) == 0) {
+		/* as mod_ssl, the provider parses its own argument */
+		sc->cache_type = mgs_cache_socache;
+		sc->cache_config = arg;
+		sc->socache = ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP,
+						 type + 8,
+						 AP_SOCACHE_PROVIDER_VERSION);
+		if (sc->socache == NULL)
+			return apr_psprintf(parms->pool, "GnuTLSCache: Unknown "
+					    "socache provider '%s', load "
+					    "mod_socache_%s first", type + 8,
+					    type + 8);
+		err = sc->socache->create(&sc->socache_instance, arg,
+					  parms->temp_pool, parms->pool);
+		if (err != NULL)
+			return apr_psprintf(parms->pool, "GnuTLSCache: %s",
+					    err);
+		return NULL;
 	}
+#endif
 #if HAVE_APR_MEMCACHE
 	else if (strcasecmp("memcache", type) == 0) {
 		sc->cache_type = mgs_cache_memcache;
@@ -413,8 +445,7 @@ const char *mgs_set_cache(cmd_parms * parms, void *dummy,
 	if (arg == NULL)
 		return "Invalid argument 2 for GnuTLSCache!";
 
-	if (sc->cache_type == mgs_cache_dbm
-	    || sc->cache_type == mgs_cache_gdbm) {
+	if (MGS_CACHE_IS_DBM(sc->cache_type)) {
 		sc->cache_config =
 		    ap_server_root_relative(parms->pool, arg);
 	} else {
@@ -477,68 +508,48 @@ const char *mgs_set_client_verify(cmd_parms * parms, void *dummy,
 	return NULL;
 }
 
-#define INIT_CA_SIZE 128
-const char *mgs_set_client_ca_file(cmd_parms * parms, void *dummy,
+const char *mgs_set_client_ca_path(cmd_parms * parms, void *dummy,
 				   const char *arg)
 {
-	int rv;
-	const char *file;
-	apr_pool_t *spool;
-	gnutls_datum_t data;
-
 	mgs_srvconf_rec *sc =
 	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
 						     module_config,
 						     &gnutls_module);
-	apr_pool_create(&spool, parms->pool);
 
-	file = ap_server_root_relative(spool, arg);
+	/* nothing is read until a client needs one of the CAs */
+	sc->ca_path_dir = ap_server_root_relative(parms->pool, arg);
 
-	if (load_datum_from_file(spool, file, &data) != 0) {
-		return apr_psprintf(parms->pool, "GnuTLS: Error Reading "
-				    "Client CA File '%s'", file);
-	}
+	return NULL;
+}
 
-	sc->ca_list_size = INIT_CA_SIZE;
-	sc->ca_list = malloc(sc->ca_list_size * sizeof(*sc->ca_list));
-	if (sc->ca_list == NULL) {
-		return apr_psprintf(parms->pool,
-				    "mod_gnutls: Memory allocation error");
-	}
+const char *mgs_set_export_env_handlers(cmd_parms * parms, void *dummy,
+					const char *arg)
+{
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
 
-	rv = gnutls_x509_crt_list_import(sc->ca_list, &sc->ca_list_size,
-					 &data, GNUTLS_X509_FMT_PEM,
-					 GNUTLS_X509_CRT_LIST_IMPORT_FAIL_IF_EXCEED);
-	if (rv < 0 && rv != GNUTLS_E_SHORT_MEMORY_BUFFER) {
-		return apr_psprintf(parms->pool, "GnuTLS: Failed to load "
-				    "Client CA File '%s': (%d) %s", file,
-				    rv, gnutls_strerror(rv));
-	}
+	if (sc->export_env_handlers == NULL)
+		sc->export_env_handlers =
+		    apr_array_make(parms->pool, 4, sizeof(const char *));
+	APR_ARRAY_PUSH(sc->export_env_handlers, const char *) = arg;
 
-	if (INIT_CA_SIZE < sc->ca_list_size) {
-		sc->ca_list =
-		    realloc(sc->ca_list,
-			    sc->ca_list_size * sizeof(*sc->ca_list));
-		if (sc->ca_list == NULL) {
-			return apr_psprintf(parms->pool,
-					    "mod_gnutls: Memory allocation error");
-		}
+	return NULL;
+}
 
-		/* re-read */
-		rv = gnutls_x509_crt_list_import(sc->ca_list,
-						 &sc->ca_list_size, &data,
-						 GNUTLS_X509_FMT_PEM, 0);
+const char *mgs_set_client_ca_file(cmd_parms * parms, void *dummy,
+				   const char *arg)
+{
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
 
-		if (rv < 0) {
-			return apr_psprintf(parms->pool,
-					    "GnuTLS: Failed to load "
-					    "Client CA File '%s': (%d) %s",
-					    file, rv, gnutls_strerror(rv));
-		}
-	}
+	/* parsed with the files of all hosts at post config */
+	sc->x509_ca_file = ap_server_root_relative(parms->pool, arg);
 
-	apr_pool_destroy(spool);
-	return NULL;
+	return mgs_test_cred_file(parms, MGS_CRED_X509_CA, sc->x509_ca_file);
 }
 
 const char *mgs_set_keyring_file(cmd_parms * parms, void *dummy,
@@ -641,6 +652,563 @@ const char *mgs_set_priorities(cmd_parms * parms, void *dummy,
 		return "Error setting priorities";
 	}
 
+	sc->priorities_str = apr_pstrdup(parms->pool, arg);
+
+	return NULL;
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+/* The curve names accepted by GnuTLSECDHCurves and the priority
+ * string keywords they map to.
+ */
+static const struct {
+	const char *name;
+	const char *priority;
+} ecdh_curves[] = {
+#if GNUTLS_VERSION_NUMBER >= 0x030500
+	{"X25519", "CURVE-X25519"},
+#endif
+	{"P-256", "CURVE-SECP256R1"},
+	{"SECP256R1", "CURVE-SECP256R1"},
+	{"P-384", "CURVE-SECP384R1"},
+	{"SECP384R1", "CURVE-SECP384R1"},
+	{"P-521", "CURVE-SECP521R1"},
+	{"SECP521R1", "CURVE-SECP521R1"},
+	{NULL, NULL}
+};
+#endif
+
+const char *mgs_set_ecdh_curves(cmd_parms * parms, void *dummy,
+				const char *arg)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+	int i;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	for (i = 0; ecdh_curves[i].name != NULL; i++) {
+		if (strcasecmp(ecdh_curves[i].name, arg) == 0)
+			break;
+	}
+
+	if (ecdh_curves[i].name == NULL) {
+		return apr_psprintf(parms->pool,
+				    "GnuTLSECDHCurves: Unknown curve '%s'",
+				    arg);
+	}
+
+	/* The curves listed replace the defaults of GnuTLSPriorities, in
+	 * the order given.
+	 */
+	if (sc->ecdh_curves == NULL)
+		sc->ecdh_curves = ":-CURVE-ALL";
+
+	sc->ecdh_curves = apr_pstrcat(parms->pool, sc->ecdh_curves, ":+",
+				      ecdh_curves[i].priority, NULL);
+
+	return NULL;
+#else
+	return "GnuTLSECDHCurves requires GnuTLS 3.0 or later";
+#endif
+}
+
+const char *mgs_set_adaptive_cipher_order(cmd_parms * parms, void *dummy,
+					  const char *arg)
+{
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+	if (!strcasecmp(arg, "On")) {
+#if GNUTLS_VERSION_NUMBER >= 0x030500
+		sc->adaptive_cipher_order = GNUTLS_ENABLED_TRUE;
+#else
+		return "GnuTLSAdaptiveCipherOrder requires GnuTLS 3.5 or later";
+#endif
+	} else if (!strcasecmp(arg, "Off")) {
+		sc->adaptive_cipher_order = GNUTLS_ENABLED_FALSE;
+	} else {
+		return
+		    "GnuTLSAdaptiveCipherOrder must be set to 'On' or 'Off'";
+	}
+
+	return NULL;
+}
+
+const char *mgs_set_ocsp_stapling(cmd_parms * parms, void *dummy,
+				  const char *arg)
+{
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+	if (!strcasecmp(arg, "On")) {
+#if GNUTLS_VERSION_NUMBER >= 0x030103
+		sc->ocsp_staple = GNUTLS_ENABLED_TRUE;
+#else
+		return "GnuTLSOCSPStapling requires GnuTLS 3.1.3 or later";
+#endif
+	} else if (!strcasecmp(arg, "Off")) {
+		sc->ocsp_staple = GNUTLS_ENABLED_FALSE;
+	} else {
+		return "GnuTLSOCSPStapling must be set to 'On' or 'Off'";
+	}
+
+	return NULL;
+}
+
+const char *mgs_set_ocsp_responder(cmd_parms * parms, void *dummy,
+				   const char *arg)
+{
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	if (strncasecmp(arg, "http://", 7) != 0)
+		return "GnuTLSOCSPResponder: Only http:// URIs are supported";
+
+	sc->ocsp_responder = apr_pstrdup(parms->pool, arg);
+
+	return NULL;
+}
+
+const char *mgs_set_ocsp_check_interval(cmd_parms * parms, void *dummy,
+					const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint <= 0)
+		return "GnuTLSOCSPCheckInterval: Invalid argument";
+
+	sc->ocsp_check_interval = apr_time_from_sec(argint);
+
+	return NULL;
+}
+
+const char *mgs_set_max_full_handshakes(cmd_parms * parms, void *dummy,
+					const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 0)
+		return "GnuTLSMaxFullHandshakes: Invalid argument";
+
+	sc->max_full_handshakes = argint;
+
+	return NULL;
+}
+
+const char *mgs_set_full_handshake_queue_timeout(cmd_parms * parms,
+						 void *dummy,
+						 const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 0)
+		return "GnuTLSFullHandshakeQueueTimeout: Invalid argument";
+
+	sc->full_handshake_queue_timeout = apr_time_from_msec(argint);
+
+	return NULL;
+}
+
+const char *mgs_set_full_handshake_rate(cmd_parms * parms, void *dummy,
+					const char *rate, const char *burst)
+{
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	sc->full_handshake_rate = atof(rate);
+	if (sc->full_handshake_rate < 0)
+		return "GnuTLSFullHandshakeRate: Invalid rate";
+
+	if (burst != NULL) {
+		sc->full_handshake_burst = atof(burst);
+		if (sc->full_handshake_burst < 1)
+			return "GnuTLSFullHandshakeRate: The burst must be "
+			    "at least 1";
+	} else {
+		/* one second worth of handshakes */
+		sc->full_handshake_burst = sc->full_handshake_rate < 1 ?
+		    1 : sc->full_handshake_rate;
+	}
+
+	return NULL;
+}
+
+const char *mgs_set_full_handshake_rate_v6_prefix(cmd_parms * parms,
+						  void *dummy,
+						  const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 1 || argint > 128)
+		return "GnuTLSFullHandshakeRateIPv6Prefix: Invalid argument";
+
+	sc->full_handshake_rate_v6_prefix = argint;
+
+	return NULL;
+}
+
+const char *mgs_set_full_handshake_rate_table_size(cmd_parms * parms,
+						   void *dummy,
+						   const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 1)
+		return "GnuTLSFullHandshakeRateTableSize: Invalid argument";
+
+	sc->full_handshake_rate_table_size = argint;
+
+	return NULL;
+}
+
+const char *mgs_set_verify_cache_size(cmd_parms * parms, void *dummy,
+				      const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 0)
+		return "GnuTLSVerifyCacheSize: Invalid argument";
+
+	sc->verify_cache_size = argint;
+
+	return NULL;
+}
+
+const char *mgs_set_verify_cache_timeout(cmd_parms * parms, void *dummy,
+					 const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 1)
+		return "GnuTLSVerifyCacheTimeout: Invalid argument";
+
+	sc->verify_cache_timeout = apr_time_from_sec(argint);
+
+	return NULL;
+}
+
+const char *mgs_set_crl_file(cmd_parms * parms, void *dummy,
+			     const char *arg)
+{
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	/* indexed at post config, once the CA list is known */
+	sc->crl_file = ap_server_root_relative(parms->pool, arg);
+
+	return NULL;
+}
+
+const char *mgs_set_crl_check_interval(cmd_parms * parms, void *dummy,
+				       const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 1)
+		return "GnuTLSCRLCheckInterval: Invalid argument";
+
+	sc->crl_check_interval = apr_time_from_sec(argint);
+
+	return NULL;
+}
+
+const char *mgs_set_crl_index_dir(cmd_parms * parms, void *dummy,
+				  const char *arg)
+{
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	sc->crl_index_dir = ap_server_root_relative(parms->pool, arg);
+
+	return NULL;
+}
+
+const char *mgs_set_config_threads(cmd_parms * parms, void *dummy,
+				   const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 1)
+		return "GnuTLSConfigThreads: Invalid argument";
+
+	sc->config_threads = argint;
+
+	return NULL;
+}
+
+const char *mgs_set_reload_interval(cmd_parms * parms, void *dummy,
+				    const char *arg)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030000 && APR_HAS_THREADS
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 0)
+		return "GnuTLSReloadInterval: Invalid argument";
+
+	sc->reload_interval = apr_time_from_sec(argint);
+
+	return NULL;
+#else
+	return "GnuTLSReloadInterval requires GnuTLS 3.0 or later and a "
+	    "threaded APR";
+#endif
+}
+
+const char *mgs_set_credential_cache_size(cmd_parms * parms, void *dummy,
+					  const char *arg)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 0)
+		return "GnuTLSCredentialCacheSize: Invalid argument";
+
+	sc->credential_cache_size = argint;
+
+	return NULL;
+#else
+	return "GnuTLSCredentialCacheSize requires GnuTLS 3.0 or later";
+#endif
+}
+
+const char *mgs_set_credential_snapshot(cmd_parms * parms, void *dummy,
+					const char *arg)
+{
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	sc->credential_snapshot = ap_server_root_relative(parms->pool, arg);
+
+	return NULL;
+}
+
+const char *mgs_set_dbm_shards(cmd_parms * parms, void *dummy,
+			       const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 1 || argint > 256)
+		return "GnuTLSDBMShards: Invalid argument, must be between "
+		    "1 and 256";
+
+	sc->dbm_shards = argint;
+
+	return NULL;
+}
+
+const char *mgs_set_cache_max_entries(cmd_parms * parms, void *dummy,
+				      const char *arg)
+{
+	int argint;
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	argint = atoi(arg);
+	if (argint < 0 || argint > MGS_CACHE_MAX_ENTRIES_LIMIT)
+		return apr_psprintf(parms->pool, "GnuTLSCacheMaxEntries: "
+				    "Invalid argument, must be between 0 "
+				    "and %d", MGS_CACHE_MAX_ENTRIES_LIMIT);
+
+	sc->cache_max_entries = argint;
+
+	return NULL;
+}
+
+const char *mgs_set_cache_admission(cmd_parms * parms, void *dummy,
+				    const char *arg)
+{
+	const char *err;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	err = ap_check_cmd_context(parms, GLOBAL_ONLY);
+	if (err != NULL)
+		return err;
+
+	if (!strcasecmp(arg, "On")) {
+		sc->cache_admission = GNUTLS_ENABLED_TRUE;
+	} else if (!strcasecmp(arg, "Off")) {
+		sc->cache_admission = GNUTLS_ENABLED_FALSE;
+	} else {
+		return "GnuTLSCacheAdmission must be set to 'On' or 'Off'";
+	}
+
+	return NULL;
+}
+
+const char *mgs_set_cache_quota(cmd_parms * parms, void *dummy,
+				const char *arg)
+{
+	int argint;
+	mgs_srvconf_rec *sc =
+	    (mgs_srvconf_rec *) ap_get_module_config(parms->server->
+						     module_config,
+						     &gnutls_module);
+
+	argint = atoi(arg);
+	if (argint < 0)
+		return "GnuTLSCacheQuota: Invalid argument";
+
+	sc->cache_quota = argint;
+
 	return NULL;
 }
 
@@ -678,13 +1246,43 @@ void *mgs_config_server_create(apr_pool_t * p, server_rec * s)
 	sc->srp_passwd_query = NULL;
 #endif
 
+	sc->x509_cert_file = NULL;
+	sc->x509_key_file = NULL;
+	sc->x509_ca_file = NULL;
+	sc->config_threads = 4;
+	sc->reload_interval = 0;
+	sc->credential_cache_size = 0;
+	sc->cred_lazy = 0;
+	sc->credential_snapshot = NULL;
 	sc->privkey_x509 = NULL;
-	memset(sc->certs_x509, 0, sizeof(sc->certs_x509));
+	sc->certs_x509 = NULL;
 	sc->certs_x509_num = 0;
 	sc->cache_timeout = apr_time_from_sec(300);
 	sc->cache_type = mgs_cache_none;
 	sc->cache_config = ap_server_root_relative(p, "conf/gnutls_cache");
+	sc->cache_size = 0;
+	sc->dbm_shards = 1;
+	sc->cache_max_entries = 0;
+	sc->cache_admission = GNUTLS_ENABLED_FALSE;
+	sc->cache_quota = 0;
+	sc->cache_owner = 0;
 	sc->tickets = 1;	/* by default enable session tickets */
+	sc->key_server = NULL;
+	sc->key_server_timeout = apr_time_from_sec(5);
+	sc->ocsp_staple = GNUTLS_ENABLED_FALSE;
+	sc->ocsp_slot = -1;
+	sc->ocsp_check_interval = apr_time_from_sec(60);
+	sc->max_full_handshakes = 0;
+	sc->full_handshake_queue_timeout = apr_time_from_msec(100);
+	sc->full_handshake_rate = 0;
+	sc->full_handshake_burst = 1;
+	sc->full_handshake_rate_v6_prefix = 64;
+	sc->full_handshake_rate_table_size = 16384;
+	sc->verify_cache_size = 0;
+	sc->verify_cache_timeout = apr_time_from_sec(300);
+	sc->crl_file = NULL;
+	sc->crl_check_interval = apr_time_from_sec(60);
+	sc->crl_index_dir = NULL;
 
 	sc->client_verify_mode = GNUTLS_CERT_IGNORE;
 
@@ -0,0 +1,1673 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "mod_gnutls.h"
+
+#include "apr_hash.h"
+#include "apr_atomic.h"
+#include "apr_allocator.h"
+#include "apr_user.h"
+#if APR_HAS_THREADS
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#endif
+#include <gnutls/crypto.h>
+
+/**
+ * Credential files
+ *
+ * GnuTLSX509CertificateFile, GnuTLSX509KeyFile and GnuTLSX509CAFile only
+ * record the file names. mgs_credentials_post_config() parses the files
+ * of all hosts at once before the hosts are set up:
+ *
+ * - every file is taken once per path, modification time and size, and
+ *   per kind, as a combined PEM file may be the certificate and the key;
+ * - GnuTLSConfigThreads threads read and hash all files, then parse
+ *   them, each thread into pools of its own (with GnuTLS 3 only, older
+ *   versions need locking callbacks that are only installed for
+ *   threaded MPMs);
+ * - only the first file with given contents is parsed, the others are
+ *   folded into it by their SHA-256 before parsing, so thousands of
+ *   hosts with a copy of the same wildcard certificate parse it once
+ *   and share one chain;
+ * - the results are handed to the hosts in configuration order, and the
+ *   first host with a bad file is reported the way the directive used to
+ *   report it.
+ *
+ * With GnuTLSCredentialSnapshot the certificates and keys parsed are
+ * also written in DER to a file only the owner can read, by kind and
+ * SHA-256 of the file they came from, with the name mgs_read_crt_cn() finds
+ * in a certificate. The snapshot also maps the stamp of every file, its
+ * path, modification and change times, size and inode, to the SHA-256
+ * of its contents. On the next start a file with the same stamp is
+ * neither read nor hashed, and its certificates or key are imported
+ * from the DER instead of decoding the PEM again; a file with another
+ * stamp is read and hashed, and still imported from the DER if its
+ * contents are known. The snapshot is written again whenever its
+ * records differ from the files in use, and ignored with a warning if
+ * it is damaged, or if it or its directory could have been changed by
+ * another user.
+ */
+
+/**
+ * Reloading
+ *
+ * With GnuTLS 3 a host hands out its chain and key through sc->cred, a
+ * reference counted mgs_cred_t. Every connection takes a reference in
+ * the certificate callback and drops it when it ends.
+ *
+ * With GnuTLSReloadInterval each process checks the modification time
+ * and size of the certificate and key files of its hosts in a thread.
+ * When they change, the files are parsed into a new mgs_cred_t with a
+ * pool of its own, which replaces sc->cred under cred_lock once the key
+ * is found to match the certificate. Handshakes in progress finish with
+ * the one they got, which goes away with the last connection using it.
+ * A half written pair (the certificate renewed before the key) is left
+ * alone and tried again when the files change next.
+ *
+ * Hosts with GnuTLSKeyServer or GnuTLSOCSPStapling are not reloaded: the
+ * key server is looked up by the key of the startup certificate and the
+ * stapled responses are for it. The names matched against SNI stay the
+ * ones of the startup certificate.
+ */
+
+/**
+ * Loading on demand
+ *
+ * With GnuTLSCredentialCacheSize the chain and key of a host are not
+ * parsed at startup but in the certificate callback, once SNI picked the
+ * host, and kept in a per process cache of that many hosts. The least
+ * recently used host is dropped when a new one does not fit; connections
+ * using it keep their reference. Such hosts are matched against SNI by
+ * their ServerName and ServerAlias as their certificate is not known.
+ * A host whose files fail to load is not tried again for
+ * MGS_CRED_CACHE_RETRY, the handshakes asking for it fail meanwhile.
+ *
+ * Hosts with GnuTLSKeyServer, GnuTLSOCSPStapling or an OpenPGP
+ * certificate are always loaded at startup, and the reload thread does
+ * not watch the hosts loaded on demand: they are read again when they
+ * come back into the cache.
+ */
+
+#define MGS_CRED_DIGEST_SIZE 32
+
+/* The snapshot: the magic, then records, and the SHA-256 of all of it
+ * at the end. Per contents the kind (1 byte), the digest, the number of
+ * DER blobs and the blobs, each with its length, then the name of the
+ * certificate with its length, 0 if there is none. Per file
+ * MGS_CRED_SNAP_STAMP (1 byte), the digest and the stamp with its
+ * length. Lengths are 32 bits in network byte order.
+ */
+#define MGS_CRED_SNAP_MAGIC "MGSCRED2"
+#define MGS_CRED_SNAP_MAGIC_LEN 8
+#define MGS_CRED_SNAP_STAMP 0x80
+
+typedef struct mgs_cred_file mgs_cred_file_t;
+
+/* A file in the snapshot, its certificates or key in DER */
+typedef struct {
+	unsigned int n;
+	gnutls_datum_t *ders;
+	/* the name of a certificate, NULL if none was found */
+	const char *cn;
+} mgs_cred_snap_t;
+
+struct mgs_cred_file {
+	mgs_cred_kind_e kind;
+	const char *path;
+	/* the kind, path, times, size and inode, NULL if unknown */
+	const char *stamp;
+	/* whether the digest came from the snapshot by the stamp */
+	int stamped;
+	/* the pool of the thread that parsed the file */
+	apr_pool_t *pool;
+	/* set while parsing; error is the message for the host */
+	const char *error;
+	/* the contents, from the file is read until it is parsed */
+	gnutls_datum_t data;
+	unsigned char digest[MGS_CRED_DIGEST_SIZE];
+	gnutls_x509_crt_t *crts;
+	unsigned int ncrts;
+	gnutls_x509_privkey_t key;
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+	gnutls_x509_trust_list_t trust;
+#endif
+	/* the file with the same contents parsed first, maybe this one */
+	mgs_cred_file_t *same;
+	/* the snapshot record it was imported from, if any */
+	const mgs_cred_snap_t *snap;
+	/* the name of the certificate, if the snapshot had it */
+	char *cn;
+};
+
+typedef struct {
+	server_rec *s;
+	mgs_cred_file_t *cert;
+	mgs_cred_file_t *key;
+	mgs_cred_file_t *ca;
+} mgs_cred_host_t;
+
+typedef struct {
+	apr_pool_t *pool;
+	/* the contents of the files read, until they are all parsed */
+	apr_pool_t *data_pool;
+	apr_array_header_t *files;
+	/* whether to read and hash the files or to parse them */
+	int parse;
+	/* the index of the next file, shared by all threads */
+	volatile apr_uint32_t *next;
+} mgs_cred_worker_t;
+
+/* The records of the snapshot by kind and digest, only set while
+ * mgs_credentials_post_config() parses the files; the threads only read
+ * it
+ */
+static apr_hash_t *cred_snapshot;
+/* the digests of the snapshot by stamp, set along with cred_snapshot */
+static apr_hash_t *cred_snapshot_stamps;
+
+static apr_status_t cred_file_cleanup(void *data)
+{
+	mgs_cred_file_t *f = data;
+	unsigned int i;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+	if (f->trust != NULL)
+		gnutls_x509_trust_list_deinit(f->trust, 0);
+	f->trust = NULL;
+#endif
+	for (i = 0; i < f->ncrts; i++)
+		gnutls_x509_crt_deinit(f->crts[i]);
+	f->ncrts = 0;
+	if (f->key != NULL)
+		gnutls_x509_privkey_deinit(f->key);
+	f->key = NULL;
+	return APR_SUCCESS;
+}
+
+static apr_status_t cred_read(apr_pool_t * p, const char *file,
+			      gnutls_datum_t * data)
+{
+	apr_file_t *fp;
+	apr_finfo_t finfo;
+	apr_status_t rv;
+	apr_size_t br = 0;
+
+	rv = apr_file_open(&fp, file, APR_READ | APR_BINARY, APR_OS_DEFAULT,
+			   p);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, fp);
+	if (rv == APR_SUCCESS) {
+		data->data = apr_palloc(p, finfo.size + 1);
+		rv = apr_file_read_full(fp, data->data, finfo.size, &br);
+	}
+	apr_file_close(fp);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	data->data[br] = '\0';
+	data->size = br;
+	return APR_SUCCESS;
+}
+
+/* Import all certificates of a PEM file. Guess the length of the list
+ * and retry with the number of certificates GnuTLS reports if the guess
+ * was too small.
+ */
+static int cred_import_crts(apr_pool_t * p, const gnutls_datum_t * data,
+			    gnutls_x509_crt_t ** crts, unsigned int *ncrts)
+{
+	unsigned int i, max = 4;
+	int ret;
+
+	do {
+		*crts = apr_pcalloc(p, max * sizeof(gnutls_x509_crt_t));
+		*ncrts = max;
+		ret = gnutls_x509_crt_list_import(*crts, ncrts, data,
+						  GNUTLS_X509_FMT_PEM,
+						  GNUTLS_X509_CRT_LIST_IMPORT_FAIL_IF_EXCEED);
+		if (ret == GNUTLS_E_SHORT_MEMORY_BUFFER) {
+			for (i = 0; i < max; i++)
+				if ((*crts)[i] != NULL)
+					gnutls_x509_crt_deinit((*crts)[i]);
+			max = *ncrts > max ? *ncrts : max * 2;
+		}
+	} while (ret == GNUTLS_E_SHORT_MEMORY_BUFFER);
+
+	if (ret < 0)
+		*ncrts = 0;
+	return ret;
+}
+
+static void cred_parse_x509_cert(apr_pool_t * p, mgs_cred_file_t * f,
+				 const gnutls_datum_t * data)
+{
+	int ret;
+
+	ret = cred_import_crts(p, data, &f->crts, &f->ncrts);
+	if (ret < 0)
+		f->error = apr_psprintf(p, "Failed to Import Certificate "
+					"'%s': (%d) %s", f->path, ret,
+					gnutls_strerror(ret));
+}
+
+static void cred_parse_x509_key(apr_pool_t * p, mgs_cred_file_t * f,
+				const gnutls_datum_t * data)
+{
+	int ret;
+
+	ret = gnutls_x509_privkey_init(&f->key);
+	if (ret < 0) {
+		f->key = NULL;
+		f->error = apr_psprintf(p, "Failed to initialize: (%d) %s",
+					ret, gnutls_strerror(ret));
+		return;
+	}
+
+	ret = gnutls_x509_privkey_import(f->key, data, GNUTLS_X509_FMT_PEM);
+	if (ret < 0)
+		ret = gnutls_x509_privkey_import_pkcs8(f->key, data,
+						       GNUTLS_X509_FMT_PEM,
+						       NULL,
+						       GNUTLS_PKCS_PLAIN);
+	if (ret < 0)
+		f->error = apr_psprintf(p, "Failed to Import Private Key "
+					"'%s': (%d) %s", f->path, ret,
+					gnutls_strerror(ret));
+}
+
+/* Build the trust list of the CAs of f */
+static int cred_index_ca(mgs_cred_file_t * f)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+	int ret;
+
+	/* The trust list finds the issuer by a hash of its DN instead of
+	 * trying every CA. It refers to the certificates of the list.
+	 */
+	ret = gnutls_x509_trust_list_init(&f->trust, f->ncrts);
+	if (ret < 0) {
+		f->trust = NULL;
+		return ret;
+	}
+	return gnutls_x509_trust_list_add_cas(f->trust, f->crts, f->ncrts,
+					      0);
+#else
+	return 0;
+#endif
+}
+
+static void cred_parse_x509_ca(apr_pool_t * p, mgs_cred_file_t * f,
+			       const gnutls_datum_t * data)
+{
+	int ret;
+
+	ret = cred_import_crts(p, data, &f->crts, &f->ncrts);
+	if (ret < 0) {
+		f->error = apr_psprintf(p, "Failed to load Client CA File "
+					"'%s': (%d) %s", f->path, ret,
+					gnutls_strerror(ret));
+		return;
+	}
+
+	ret = cred_index_ca(f);
+	if (ret < 0)
+		f->error = apr_psprintf(p, "Failed to index Client CA File "
+					"'%s': (%d) %s", f->path, ret,
+					gnutls_strerror(ret));
+}
+
+/* Import f from the DER of its snapshot record, undoing everything if
+ * that fails
+ */
+static int cred_import_snap(apr_pool_t * p, mgs_cred_file_t * f,
+			    const mgs_cred_snap_t * snap)
+{
+	unsigned int i;
+	int ret = 0;
+
+	if (f->kind == MGS_CRED_X509_KEY) {
+		if (snap->n != 1)
+			return GNUTLS_E_ASN1_DER_ERROR;
+		ret = gnutls_x509_privkey_init(&f->key);
+		if (ret < 0) {
+			f->key = NULL;
+			return ret;
+		}
+		ret = gnutls_x509_privkey_import(f->key, &snap->ders[0],
+						 GNUTLS_X509_FMT_DER);
+	} else {
+		f->crts = apr_pcalloc(p, (snap->n + 1) *
+				      sizeof(gnutls_x509_crt_t));
+		for (i = 0; ret == 0 && i < snap->n; i++) {
+			ret = gnutls_x509_crt_init(&f->crts[i]);
+			if (ret < 0)
+				break;
+			f->ncrts = i + 1;
+			ret = gnutls_x509_crt_import(f->crts[i],
+						     &snap->ders[i],
+						     GNUTLS_X509_FMT_DER);
+		}
+		if (ret == 0 && f->kind == MGS_CRED_X509_CA)
+			ret = cred_index_ca(f);
+	}
+
+	if (ret < 0)
+		cred_file_cleanup(f);
+	return ret;
+}
+
+/* The snapshot record with the contents of f, once it is hashed */
+static const mgs_cred_snap_t *cred_snap_get(const mgs_cred_file_t * f)
+{
+	unsigned char key[1 + MGS_CRED_DIGEST_SIZE];
+
+	if (cred_snapshot == NULL)
+		return NULL;
+
+	key[0] = f->kind;
+	memcpy(key + 1, f->digest, MGS_CRED_DIGEST_SIZE);
+	return apr_hash_get(cred_snapshot, key, sizeof(key));
+}
+
+/* Read f into dp and hash it; an error goes into p */
+static void cred_read_hash(apr_pool_t * p, apr_pool_t * dp,
+			   mgs_cred_file_t * f)
+{
+	static const char *const what[] = {
+		"Certificate", "Private Key", "Client CA File"
+	};
+
+	if (cred_read(dp, f->path, &f->data) != APR_SUCCESS) {
+		f->data.data = NULL;
+		f->error = apr_psprintf(p, "Error Reading %s '%s'",
+					what[f->kind], f->path);
+	} else if (gnutls_hash_fast(GNUTLS_DIG_SHA256, f->data.data,
+				    f->data.size, f->digest) < 0) {
+		f->error = apr_psprintf(p, "Failed to hash %s '%s'",
+					what[f->kind], f->path);
+	}
+}
+
+/* Take the digest of f from the snapshot if the file has the stamp it
+ * had when the snapshot was written. Returns 1 if it did.
+ */
+static int cred_snap_stamped(mgs_cred_file_t * f)
+{
+	const unsigned char *digest;
+
+	if (f->stamp == NULL || cred_snapshot_stamps == NULL)
+		return 0;
+	digest = apr_hash_get(cred_snapshot_stamps, f->stamp,
+			      APR_HASH_KEY_STRING);
+	if (digest == NULL)
+		return 0;
+
+	memcpy(f->digest, digest, MGS_CRED_DIGEST_SIZE);
+	f->stamped = cred_snap_get(f) != NULL;
+	return f->stamped;
+}
+
+/* Parse f once loaded into p, dropping its contents */
+static void cred_decode(apr_pool_t * p, mgs_cred_file_t * f)
+{
+	const mgs_cred_snap_t *snap;
+	apr_pool_t *dp = NULL;
+
+	f->pool = p;
+	apr_pool_cleanup_register(p, f, cred_file_cleanup,
+				  apr_pool_cleanup_null);
+
+	if (f->error == NULL && (snap = cred_snap_get(f)) != NULL
+	    && cred_import_snap(p, f, snap) == 0) {
+		f->snap = snap;
+		if (snap->cn != NULL)
+			f->cn = apr_pstrdup(p, snap->cn);
+		return;
+	}
+
+	/* taken by its stamp, but the record does not import */
+	if (f->error == NULL && f->data.data == NULL) {
+		f->stamped = 0;
+		apr_pool_create(&dp, p);
+		cred_read_hash(p, dp, f);
+	}
+
+	if (f->error != NULL) {
+		/* not loaded */
+	} else if (f->kind == MGS_CRED_X509_CERT) {
+		cred_parse_x509_cert(p, f, &f->data);
+	} else if (f->kind == MGS_CRED_X509_KEY) {
+		cred_parse_x509_key(p, f, &f->data);
+	} else {
+		cred_parse_x509_ca(p, f, &f->data);
+	}
+
+	/* do not leave a copy of a private key behind */
+	if (f->data.data != NULL)
+		memset(f->data.data, 0, f->data.size);
+	f->data.data = NULL;
+	f->data.size = 0;
+	if (dp != NULL)
+		apr_pool_destroy(dp);
+}
+
+static void cred_parse(apr_pool_t * p, mgs_cred_file_t * f)
+{
+	apr_pool_t *spool;
+
+	apr_pool_create(&spool, p);
+	cred_read_hash(p, spool, f);
+	cred_decode(p, f);
+	apr_pool_destroy(spool);
+}
+
+static void cred_work(mgs_cred_worker_t * w)
+{
+	mgs_cred_file_t *f;
+	apr_uint32_t i;
+
+	while ((i = apr_atomic_inc32(w->next)) < (apr_uint32_t)
+	       w->files->nelts) {
+		f = APR_ARRAY_IDX(w->files, i, mgs_cred_file_t *);
+		if (!w->parse) {
+			if (!cred_snap_stamped(f))
+				cred_read_hash(w->pool, w->data_pool, f);
+		}
+		else if (f->same == f)
+			cred_decode(w->pool, f);
+	}
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030000 && APR_HAS_THREADS
+static void *APR_THREAD_FUNC cred_parse_thread_main(apr_thread_t * thread,
+						    void *data)
+{
+	cred_work(data);
+	apr_thread_exit(thread, APR_SUCCESS);
+	return NULL;
+}
+#endif
+
+const char *mgs_credentials_test(apr_pool_t * p, mgs_cred_kind_e kind,
+				 const char *path)
+{
+	apr_pool_t *tp;
+	mgs_cred_file_t *f;
+	const char *error = NULL;
+
+	apr_pool_create(&tp, p);
+	f = apr_pcalloc(tp, sizeof(*f));
+	f->kind = kind;
+	f->path = path;
+	f->same = f;
+	cred_parse(tp, f);
+	if (f->error != NULL)
+		error = apr_pstrdup(p, f->error);
+	apr_pool_destroy(tp);
+	return error;
+}
+
+/* Find or add the file of kind named by path */
+static mgs_cred_file_t *cred_file(apr_pool_t * p, apr_hash_t * seen,
+				  apr_array_header_t * files,
+				  mgs_cred_kind_e kind, const char *path)
+{
+	apr_finfo_t finfo;
+	const char *id, *stamp = NULL;
+	mgs_cred_file_t *f;
+
+	if (apr_stat(&finfo, path, APR_FINFO_MTIME | APR_FINFO_CTIME
+		     | APR_FINFO_SIZE | APR_FINFO_INODE, p) == APR_SUCCESS) {
+		stamp = apr_psprintf(p, "%d %s %" APR_TIME_T_FMT " %"
+				     APR_TIME_T_FMT " %" APR_OFF_T_FMT " %"
+				     APR_UINT64_T_FMT, kind, path,
+				     finfo.mtime, finfo.ctime, finfo.size,
+				     (apr_uint64_t) finfo.inode);
+		id = stamp;
+	} else
+		id = apr_psprintf(p, "%d %s", kind, path);
+
+	f = apr_hash_get(seen, id, APR_HASH_KEY_STRING);
+	if (f != NULL)
+		return f;
+
+	f = apr_pcalloc(p, sizeof(*f));
+	f->kind = kind;
+	f->path = path;
+	f->stamp = stamp;
+	f->same = f;
+	apr_hash_set(seen, id, APR_HASH_KEY_STRING, f);
+	APR_ARRAY_PUSH(files, mgs_cred_file_t *) = f;
+	return f;
+}
+
+/* Run cred_work() on the workers, each on a thread of its own but the
+ * first, which is this one
+ */
+static void cred_run(server_rec * s, mgs_cred_worker_t * workers,
+		     unsigned int nthreads)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030000 && APR_HAS_THREADS
+	unsigned int i;
+	apr_thread_t **threads;
+	apr_status_t rv, trv;
+
+	threads = apr_pcalloc(workers[0].pool, nthreads * sizeof(*threads));
+	for (i = 1; i < nthreads; i++) {
+		rv = apr_thread_create(&threads[i], NULL, cred_parse_thread_main,
+				       &workers[i], workers[i].pool);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+				     "GnuTLS: Failed to start a thread to "
+				     "parse the credential files");
+			threads[i] = NULL;
+		}
+	}
+#endif
+
+	cred_work(&workers[0]);
+
+#if GNUTLS_VERSION_NUMBER >= 0x030000 && APR_HAS_THREADS
+	for (i = 1; i < nthreads; i++)
+		if (threads[i] != NULL)
+			apr_thread_join(&trv, threads[i]);
+#endif
+}
+
+/* Mark the files with the same contents as an earlier one, which is the
+ * only one parsed
+ */
+static void cred_fold(apr_pool_t * p, apr_array_header_t * files)
+{
+	apr_hash_t *loaded = apr_hash_make(p);
+	unsigned char *key;
+	mgs_cred_file_t *f, *first;
+	int i;
+
+	for (i = 0; i < files->nelts; i++) {
+		f = APR_ARRAY_IDX(files, i, mgs_cred_file_t *);
+		if (f->error != NULL)
+			continue;
+
+		key = apr_palloc(p, 1 + MGS_CRED_DIGEST_SIZE);
+		key[0] = f->kind;
+		memcpy(key + 1, f->digest, MGS_CRED_DIGEST_SIZE);
+		first = apr_hash_get(loaded, key, 1 + MGS_CRED_DIGEST_SIZE);
+		if (first == NULL) {
+			apr_hash_set(loaded, key, 1 + MGS_CRED_DIGEST_SIZE, f);
+			continue;
+		}
+
+		f->same = first;
+		if (f->data.data != NULL)
+			memset(f->data.data, 0, f->data.size);
+		f->data.data = NULL;
+	}
+}
+
+/* Read and hash the files, then parse those with contents not seen
+ * before, on up to nthreads threads
+ */
+static apr_status_t cred_parse_all(apr_pool_t * p, server_rec * s,
+				   apr_array_header_t * files,
+				   unsigned int nthreads)
+{
+	volatile apr_uint32_t next = 0;
+	mgs_cred_worker_t *workers;
+	apr_allocator_t *allocator;
+	apr_status_t rv = APR_SUCCESS;
+	mgs_cred_file_t *f;
+	unsigned int i;
+	int j;
+
+#if !(GNUTLS_VERSION_NUMBER >= 0x030000 && APR_HAS_THREADS)
+	nthreads = 1;
+#endif
+	if (nthreads > (unsigned int) files->nelts)
+		nthreads = files->nelts;
+	if (nthreads == 0)
+		return APR_SUCCESS;
+
+	/* APR pools are not thread safe, every thread gets some with an
+	 * allocator of their own; the first ones live as long as the
+	 * configuration, those with the contents of the files until they
+	 * are parsed
+	 */
+	workers = apr_pcalloc(p, nthreads * sizeof(*workers));
+	for (i = 0; rv == APR_SUCCESS && i < nthreads * 2; i++) {
+		apr_pool_t **pool = i < nthreads ? &workers[i].pool :
+		    &workers[i - nthreads].data_pool;
+
+		rv = apr_allocator_create(&allocator);
+		if (rv != APR_SUCCESS)
+			break;
+		rv = apr_pool_create_ex(pool, p, NULL, allocator);
+		if (rv != APR_SUCCESS) {
+			apr_allocator_destroy(allocator);
+			break;
+		}
+		apr_allocator_owner_set(allocator, *pool);
+	}
+	for (i = 0; i < nthreads; i++) {
+		workers[i].files = files;
+		workers[i].next = &next;
+	}
+
+	if (rv == APR_SUCCESS) {
+		cred_run(s, workers, nthreads);
+		cred_fold(p, files);
+
+		next = 0;
+		for (i = 0; i < nthreads; i++)
+			workers[i].parse = 1;
+		cred_run(s, workers, nthreads);
+
+		/* copies fail the way the file they are a copy of did */
+		for (j = 0; j < files->nelts; j++) {
+			f = APR_ARRAY_IDX(files, j, mgs_cred_file_t *);
+			if (f->error == NULL)
+				f->error = f->same->error;
+		}
+	}
+
+	for (i = 0; i < nthreads; i++)
+		if (workers[i].data_pool != NULL)
+			apr_pool_destroy(workers[i].data_pool);
+	return rv;
+}
+
+static apr_uint32_t cred_get32(const unsigned char *buf)
+{
+	return ((apr_uint32_t) buf[0] << 24) | ((apr_uint32_t) buf[1] << 16)
+	    | ((apr_uint32_t) buf[2] << 8) | buf[3];
+}
+
+static void cred_put32(unsigned char *buf, apr_uint32_t n)
+{
+	buf[0] = n >> 24;
+	buf[1] = n >> 16;
+	buf[2] = n >> 8;
+	buf[3] = n;
+}
+
+/* Zero a buffer that held key material */
+static apr_status_t cred_wipe_cleanup(void *data)
+{
+	gnutls_datum_t *d = data;
+
+	memset(d->data, 0, d->size);
+	return APR_SUCCESS;
+}
+
+/* The records of the snapshot file, NULL if there is none or it cannot
+ * be used, with its digests by stamp in stamps
+ */
+static apr_hash_t *cred_snapshot_read(apr_pool_t * p, server_rec * s,
+				      const char *path, apr_hash_t ** stamps)
+{
+	apr_finfo_t finfo;
+	apr_hash_t *snaps;
+	gnutls_datum_t *data;
+	mgs_cred_snap_t *snap;
+	unsigned char md[MGS_CRED_DIGEST_SIZE];
+	unsigned char *pos, *end, *key;
+	apr_uint32_t size;
+	apr_uid_t uid;
+	apr_gid_t gid;
+	unsigned int i;
+
+	/* The checksum only finds damage, anyone who can replace the file
+	 * could put a CA of their own into it. Only take a file of our
+	 * own that nobody else can read or write, in a directory only we
+	 * or root can change.
+	 */
+	if (apr_stat(&finfo, path, APR_FINFO_LINK | APR_FINFO_TYPE
+		     | APR_FINFO_OWNER | APR_FINFO_PROT, p) != APR_SUCCESS)
+		return NULL;
+	if (apr_uid_current(&uid, &gid, p) != APR_SUCCESS)
+		return NULL;
+	if (finfo.filetype != APR_REG
+	    || apr_uid_compare(finfo.user, uid) != APR_SUCCESS
+	    || (finfo.protection & (APR_FPROT_GREAD | APR_FPROT_GWRITE
+				    | APR_FPROT_WREAD | APR_FPROT_WWRITE))) {
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+			     "GnuTLS: The credential snapshot '%s' is not a "
+			     "file of this user only, not using it", path);
+		return NULL;
+	}
+	if (apr_stat(&finfo, ap_make_dirstr_parent(p, path), APR_FINFO_TYPE
+		     | APR_FINFO_OWNER | APR_FINFO_PROT, p) != APR_SUCCESS
+	    || finfo.filetype != APR_DIR
+	    || (apr_uid_compare(finfo.user, uid) != APR_SUCCESS
+		&& finfo.user != 0)
+	    || (finfo.protection & (APR_FPROT_GWRITE | APR_FPROT_WWRITE))) {
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+			     "GnuTLS: The directory of the credential "
+			     "snapshot '%s' can be written by others, not "
+			     "using it", path);
+		return NULL;
+	}
+
+	data = apr_pcalloc(p, sizeof(*data));
+	if (cred_read(p, path, data) != APR_SUCCESS)
+		return NULL;
+	apr_pool_cleanup_register(p, data, cred_wipe_cleanup,
+				  apr_pool_cleanup_null);
+
+	if (data->size < MGS_CRED_SNAP_MAGIC_LEN + MGS_CRED_DIGEST_SIZE
+	    || memcmp(data->data, MGS_CRED_SNAP_MAGIC,
+		      MGS_CRED_SNAP_MAGIC_LEN) != 0
+	    || gnutls_hash_fast(GNUTLS_DIG_SHA256, data->data,
+				data->size - MGS_CRED_DIGEST_SIZE, md) < 0
+	    || memcmp(md, data->data + data->size - MGS_CRED_DIGEST_SIZE,
+		      MGS_CRED_DIGEST_SIZE) != 0)
+		goto damaged;
+
+	snaps = apr_hash_make(p);
+	*stamps = apr_hash_make(p);
+	pos = data->data + MGS_CRED_SNAP_MAGIC_LEN;
+	end = data->data + data->size - MGS_CRED_DIGEST_SIZE;
+	while (pos < end) {
+		if (end - pos < 1 + MGS_CRED_DIGEST_SIZE + 4)
+			goto damaged;
+		key = pos;
+		pos += 1 + MGS_CRED_DIGEST_SIZE;
+
+		if (key[0] == MGS_CRED_SNAP_STAMP) {
+			size = cred_get32(pos);
+			pos += 4;
+			if (size > (apr_uint32_t) (end - pos))
+				goto damaged;
+			apr_hash_set(*stamps, apr_pstrmemdup(p, (char *) pos,
+							     size),
+				     APR_HASH_KEY_STRING, key + 1);
+			pos += size;
+			continue;
+		}
+		snap = apr_palloc(p, sizeof(*snap));
+		snap->n = cred_get32(pos);
+		pos += 4;
+		if (snap->n > (apr_uint32_t) (end - pos) / 4)
+			goto damaged;
+		snap->ders = apr_palloc(p, (snap->n + 1) *
+					sizeof(gnutls_datum_t));
+		for (i = 0; i < snap->n; i++) {
+			if (end - pos < 4)
+				goto damaged;
+			size = cred_get32(pos);
+			pos += 4;
+			if (size > (apr_uint32_t) (end - pos))
+				goto damaged;
+			snap->ders[i].data = pos;
+			snap->ders[i].size = size;
+			pos += size;
+		}
+		if (end - pos < 4)
+			goto damaged;
+		size = cred_get32(pos);
+		pos += 4;
+		if (size > (apr_uint32_t) (end - pos))
+			goto damaged;
+		snap->cn = size > 0 ? apr_pstrmemdup(p, (char *) pos, size) :
+		    NULL;
+		pos += size;
+		apr_hash_set(snaps, key, 1 + MGS_CRED_DIGEST_SIZE, snap);
+	}
+
+	return snaps;
+
+      damaged:
+	ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+		     "GnuTLS: The credential snapshot '%s' is damaged, not "
+		     "using it", path);
+	*stamps = NULL;
+	return NULL;
+}
+
+/* The DER of the certificates or key of f, and the name of a
+ * certificate
+ */
+static const mgs_cred_snap_t *cred_snap_export(apr_pool_t * p,
+					       server_rec * s,
+					       mgs_cred_file_t * f)
+{
+	mgs_cred_snap_t *snap;
+	gnutls_datum_t *der;
+	size_t size;
+	unsigned int i;
+	char *cn;
+	int ret;
+
+	snap = apr_palloc(p, sizeof(*snap));
+	snap->cn = NULL;
+	if (f->kind == MGS_CRED_X509_KEY) {
+		snap->n = 1;
+		der = snap->ders = apr_pcalloc(p, sizeof(*der));
+		size = 0;
+		ret = gnutls_x509_privkey_export(f->key, GNUTLS_X509_FMT_DER,
+						 NULL, &size);
+		if (ret != GNUTLS_E_SHORT_MEMORY_BUFFER)
+			return NULL;
+		der->data = apr_palloc(p, size);
+		ret = gnutls_x509_privkey_export(f->key, GNUTLS_X509_FMT_DER,
+						 der->data, &size);
+		der->size = size;
+		apr_pool_cleanup_register(p, der, cred_wipe_cleanup,
+					  apr_pool_cleanup_null);
+		return ret < 0 ? NULL : snap;
+	}
+
+	snap->n = f->ncrts;
+	snap->ders = apr_pcalloc(p, (f->ncrts + 1) * sizeof(*der));
+	for (i = 0; i < f->ncrts; i++) {
+		der = &snap->ders[i];
+		size = 0;
+		ret = gnutls_x509_crt_export(f->crts[i], GNUTLS_X509_FMT_DER,
+					     NULL, &size);
+		if (ret != GNUTLS_E_SHORT_MEMORY_BUFFER)
+			return NULL;
+		der->data = apr_palloc(p, size);
+		ret = gnutls_x509_crt_export(f->crts[i], GNUTLS_X509_FMT_DER,
+					     der->data, &size);
+		if (ret < 0)
+			return NULL;
+		der->size = size;
+	}
+	if (f->kind == MGS_CRED_X509_CERT && f->ncrts > 0
+	    && mgs_read_crt_cn(s, p, f->crts[0], &cn) >= 0)
+		snap->cn = cn;
+	return snap;
+}
+
+static apr_status_t cred_snap_put(apr_file_t * fp, gnutls_hash_hd_t dig,
+				  const void *buf, apr_size_t n)
+{
+	gnutls_hash(dig, buf, n);
+	return apr_file_write_full(fp, buf, n, NULL);
+}
+
+/* Replace the snapshot file with the records of files, unless it has
+ * exactly these already
+ */
+static apr_status_t cred_snapshot_write(apr_pool_t * p, server_rec * s,
+					const char *path,
+					apr_array_header_t * files)
+{
+	apr_array_header_t *snaps, *stamped;
+	const mgs_cred_snap_t *snap;
+	mgs_cred_file_t *f;
+	gnutls_hash_hd_t dig;
+	apr_file_t *fp;
+	apr_status_t rv;
+	unsigned char md[MGS_CRED_DIGEST_SIZE];
+	unsigned char buf[4];
+	char *tmp;
+	int i, unchanged;
+	unsigned int j;
+	apr_size_t len;
+
+	snaps = apr_array_make(p, files->nelts, sizeof(mgs_cred_file_t *));
+	stamped = apr_array_make(p, files->nelts, sizeof(mgs_cred_file_t *));
+	unchanged = cred_snapshot != NULL;
+	for (i = 0; i < files->nelts; i++) {
+		f = APR_ARRAY_IDX(files, i, mgs_cred_file_t *);
+		if (f->error != NULL)
+			continue;
+		if (f->stamp != NULL) {
+			if (!f->stamped)
+				unchanged = 0;
+			APR_ARRAY_PUSH(stamped, mgs_cred_file_t *) = f;
+		}
+		if (f->same != f)
+			continue;
+		if (f->snap == NULL)
+			unchanged = 0;
+		APR_ARRAY_PUSH(snaps, mgs_cred_file_t *) = f;
+	}
+	if (unchanged
+	    && apr_hash_count(cred_snapshot) == (unsigned int) snaps->nelts
+	    && apr_hash_count(cred_snapshot_stamps) ==
+	    (unsigned int) stamped->nelts)
+		return APR_SUCCESS;
+
+	if (gnutls_hash_init(&dig, GNUTLS_DIG_SHA256) < 0)
+		return APR_EGENERAL;
+
+	tmp = apr_pstrcat(p, path, ".XXXXXX", NULL);
+	rv = apr_file_mktemp(&fp, tmp, APR_CREATE | APR_WRITE | APR_EXCL
+			     | APR_BINARY | APR_BUFFERED, p);
+	if (rv != APR_SUCCESS) {
+		gnutls_hash_deinit(dig, md);
+		return rv;
+	}
+
+	rv = cred_snap_put(fp, dig, MGS_CRED_SNAP_MAGIC,
+			   MGS_CRED_SNAP_MAGIC_LEN);
+	for (i = 0; rv == APR_SUCCESS && i < snaps->nelts; i++) {
+		f = APR_ARRAY_IDX(snaps, i, mgs_cred_file_t *);
+		snap = f->snap != NULL ? f->snap : cred_snap_export(p, s, f);
+		if (snap == NULL)
+			continue;
+
+		buf[0] = f->kind;
+		rv = cred_snap_put(fp, dig, buf, 1);
+		if (rv == APR_SUCCESS)
+			rv = cred_snap_put(fp, dig, f->digest,
+					   MGS_CRED_DIGEST_SIZE);
+		cred_put32(buf, snap->n);
+		if (rv == APR_SUCCESS)
+			rv = cred_snap_put(fp, dig, buf, 4);
+		for (j = 0; rv == APR_SUCCESS && j < snap->n; j++) {
+			cred_put32(buf, snap->ders[j].size);
+			rv = cred_snap_put(fp, dig, buf, 4);
+			if (rv == APR_SUCCESS)
+				rv = cred_snap_put(fp, dig,
+						   snap->ders[j].data,
+						   snap->ders[j].size);
+		}
+		len = snap->cn != NULL ? strlen(snap->cn) : 0;
+		cred_put32(buf, len);
+		if (rv == APR_SUCCESS)
+			rv = cred_snap_put(fp, dig, buf, 4);
+		if (rv == APR_SUCCESS && len > 0)
+			rv = cred_snap_put(fp, dig, snap->cn, len);
+	}
+	for (i = 0; rv == APR_SUCCESS && i < stamped->nelts; i++) {
+		f = APR_ARRAY_IDX(stamped, i, mgs_cred_file_t *);
+		buf[0] = MGS_CRED_SNAP_STAMP;
+		rv = cred_snap_put(fp, dig, buf, 1);
+		if (rv == APR_SUCCESS)
+			rv = cred_snap_put(fp, dig, f->digest,
+					   MGS_CRED_DIGEST_SIZE);
+		len = strlen(f->stamp);
+		cred_put32(buf, len);
+		if (rv == APR_SUCCESS)
+			rv = cred_snap_put(fp, dig, buf, 4);
+		if (rv == APR_SUCCESS)
+			rv = cred_snap_put(fp, dig, f->stamp, len);
+	}
+	gnutls_hash_deinit(dig, md);
+	if (rv == APR_SUCCESS)
+		rv = apr_file_write_full(fp, md, sizeof(md), NULL);
+	if (rv == APR_SUCCESS)
+		rv = apr_file_close(fp);
+	else
+		apr_file_close(fp);
+
+	/* it holds the private keys */
+	if (rv == APR_SUCCESS)
+		rv = apr_file_perms_set(tmp, APR_FPROT_UREAD |
+					APR_FPROT_UWRITE);
+	if (rv == APR_SUCCESS || rv == APR_ENOTIMPL)
+		rv = apr_file_rename(tmp, path, p);
+	if (rv != APR_SUCCESS)
+		apr_file_remove(tmp, p);
+	return rv;
+}
+
+/* Whether the chain and key of sc are only loaded when a client asks for
+ * the host by SNI, see mgs_credentials_acquire()
+ */
+static int cred_is_lazy(mgs_srvconf_rec * sc_base, mgs_srvconf_rec * sc)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+	return sc_base->credential_cache_size > 0
+	    && sc->enabled == GNUTLS_ENABLED_TRUE
+	    && sc->x509_cert_file != NULL && sc->x509_key_file != NULL
+	    && sc->key_server == NULL && sc->ocsp_staple != GNUTLS_ENABLED_TRUE
+	    && sc->cert_pgp == NULL;
+#else
+	return 0;
+#endif
+}
+
+int mgs_credentials_post_config(apr_pool_t * p, server_rec * base_server)
+{
+	apr_hash_t *seen = apr_hash_make(p);
+	apr_array_header_t *files, *hosts;
+	apr_finfo_t finfo;
+	apr_pool_t *spool;
+	apr_status_t rv, srv;
+	server_rec *s;
+	mgs_srvconf_rec *sc;
+	mgs_srvconf_rec *sc_base =
+	    ap_get_module_config(base_server->module_config,
+				 &gnutls_module);
+	mgs_cred_host_t *h;
+	mgs_cred_file_t *f;
+	int i;
+
+	files = apr_array_make(p, 16, sizeof(mgs_cred_file_t *));
+	hosts = apr_array_make(p, 16, sizeof(mgs_cred_host_t));
+
+	for (s = base_server; s; s = s->next) {
+		sc = ap_get_module_config(s->module_config, &gnutls_module);
+		sc->cred_lazy = cred_is_lazy(sc_base, sc);
+		if (sc->cred_lazy) {
+			/* only make sure the files are there */
+			if (apr_stat(&finfo, sc->x509_cert_file,
+				     APR_FINFO_SIZE, p) != APR_SUCCESS
+			    || apr_stat(&finfo, sc->x509_key_file,
+					APR_FINFO_SIZE, p) != APR_SUCCESS) {
+				ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+					     "GnuTLS: Host '%s:%d': Cannot "
+					     "find the certificate or key file",
+					     s->server_hostname, s->port);
+				return -1;
+			}
+		}
+		if ((sc->x509_cert_file == NULL || sc->cred_lazy)
+		    && (sc->x509_key_file == NULL || sc->cred_lazy)
+		    && sc->x509_ca_file == NULL)
+			continue;
+
+		h = apr_array_push(hosts);
+		h->s = s;
+		h->cert = h->key = h->ca = NULL;
+		if (sc->x509_cert_file != NULL && !sc->cred_lazy)
+			h->cert = cred_file(p, seen, files, MGS_CRED_X509_CERT,
+					    sc->x509_cert_file);
+		if (sc->x509_key_file != NULL && !sc->cred_lazy)
+			h->key = cred_file(p, seen, files, MGS_CRED_X509_KEY,
+					   sc->x509_key_file);
+		if (sc->x509_ca_file != NULL)
+			h->ca = cred_file(p, seen, files, MGS_CRED_X509_CA,
+					  sc->x509_ca_file);
+	}
+
+	spool = NULL;
+	if (sc_base->credential_snapshot != NULL) {
+		apr_pool_create(&spool, p);
+		cred_snapshot = cred_snapshot_read(spool, base_server,
+						   sc_base->
+						   credential_snapshot,
+						   &cred_snapshot_stamps);
+	}
+
+	rv = cred_parse_all(p, base_server, files, sc_base->config_threads);
+	if (rv == APR_SUCCESS) {
+		if (spool != NULL) {
+			srv = cred_snapshot_write(spool, base_server,
+						  sc_base->credential_snapshot,
+						  files);
+			if (srv != APR_SUCCESS)
+				ap_log_error(APLOG_MARK, APLOG_WARNING, srv,
+					     base_server,
+					     "GnuTLS: Cannot write the "
+					     "credential snapshot '%s'",
+					     sc_base->credential_snapshot);
+		}
+	}
+
+	/* the records point into the snapshot read */
+	cred_snapshot = NULL;
+	cred_snapshot_stamps = NULL;
+	for (i = 0; i < files->nelts; i++)
+		APR_ARRAY_IDX(files, i, mgs_cred_file_t *)->snap = NULL;
+	if (spool != NULL)
+		apr_pool_destroy(spool);
+
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Cannot set up the parsing of the "
+			     "credential files");
+		return rv;
+	}
+
+	for (i = 0; i < hosts->nelts; i++) {
+		h = &APR_ARRAY_IDX(hosts, i, mgs_cred_host_t);
+		sc = ap_get_module_config(h->s->module_config,
+					  &gnutls_module);
+
+		if (h->cert != NULL) {
+			f = h->cert;
+			if (f->error != NULL)
+				goto error;
+			sc->certs_x509 = f->same->crts;
+			sc->certs_x509_num = f->same->ncrts;
+			/* the name found before, if the snapshot had it */
+			sc->cert_cn = f->same->cn;
+		}
+		if (h->key != NULL) {
+			f = h->key;
+			if (f->error != NULL)
+				goto error;
+			sc->privkey_x509 = f->same->key;
+		}
+		if (h->ca != NULL) {
+			f = h->ca;
+			if (f->error != NULL)
+				goto error;
+			sc->ca_list = f->same->crts;
+			sc->ca_list_size = f->same->ncrts;
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+			sc->ca_trust = f->same->trust;
+#endif
+		}
+	}
+
+	return 0;
+
+      error:
+	ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, h->s,
+		     "GnuTLS: Host '%s:%d': %s", h->s->server_hostname,
+		     h->s->port, f->error);
+	return -1;
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+
+/* How long a host whose files could not be loaded on demand is not
+ * tried again
+ */
+#define MGS_CRED_CACHE_RETRY apr_time_from_sec(60)
+
+typedef struct mgs_cred_entry mgs_cred_entry_t;
+
+/* A host in the cache of the chains and keys loaded on demand */
+struct mgs_cred_entry {
+	mgs_srvconf_rec *sc;
+	/* NULL if the files could not be loaded */
+	mgs_cred_t *cred;
+	/* when to try loading the files again after a failure */
+	apr_time_t retry;
+	/* the list of entries, most recently used first */
+	mgs_cred_entry_t *prev;
+	mgs_cred_entry_t *next;
+};
+
+/* The entries by host and their list, guarded by cred_lock */
+static apr_pool_t *cred_cache_pool;
+static apr_hash_t *cred_cache;
+static mgs_cred_entry_t cred_lru;
+static unsigned int cred_cache_size;
+static unsigned int cred_cache_count;
+
+#if APR_HAS_THREADS
+/* guards sc->cred of all hosts and the cache, NULL when neither the
+ * reload nor the cache are used
+ */
+static apr_thread_mutex_t *cred_lock;
+static apr_thread_t *cred_reload_thread;
+static volatile int cred_reload_stop;
+#endif
+
+static void cred_lock_acquire(void)
+{
+#if APR_HAS_THREADS
+	if (cred_lock != NULL)
+		apr_thread_mutex_lock(cred_lock);
+#endif
+}
+
+static void cred_lock_release(void)
+{
+#if APR_HAS_THREADS
+	if (cred_lock != NULL)
+		apr_thread_mutex_unlock(cred_lock);
+#endif
+}
+
+/* The modification times and sizes of the certificate and key files */
+static const char *cred_stamp(apr_pool_t * p, mgs_srvconf_rec * sc)
+{
+	apr_finfo_t cert, key;
+
+	if (apr_stat(&cert, sc->x509_cert_file,
+		     APR_FINFO_MTIME | APR_FINFO_SIZE, p) != APR_SUCCESS
+	    || apr_stat(&key, sc->x509_key_file,
+			APR_FINFO_MTIME | APR_FINFO_SIZE, p) != APR_SUCCESS)
+		return NULL;
+
+	return apr_psprintf(p, "%" APR_TIME_T_FMT " %" APR_OFF_T_FMT
+			    " %" APR_TIME_T_FMT " %" APR_OFF_T_FMT,
+			    cert.mtime, cert.size, key.mtime, key.size);
+}
+
+void mgs_credentials_init(apr_pool_t * p, mgs_srvconf_rec * sc)
+{
+	mgs_cred_t *cred;
+
+	sc->cred = NULL;
+	if (sc->certs_pcert == NULL)
+		return;
+
+	cred = apr_pcalloc(p, sizeof(*cred));
+	cred->refs = 1;
+	cred->pool = NULL;
+	cred->certs_x509 = sc->certs_x509;
+	cred->certs_x509_num = sc->certs_x509_num;
+	cred->certs_pcert = sc->certs_pcert;
+	cred->privkey = sc->privkey;
+	cred->server_env = sc->server_env_x509;
+	if (sc->reload_interval > 0 && sc->x509_cert_file != NULL
+	    && sc->x509_key_file != NULL && sc->key_server == NULL
+	    && sc->ocsp_staple != GNUTLS_ENABLED_TRUE)
+		cred->stamp = cred_stamp(p, sc);
+
+	sc->cred = cred;
+}
+
+static apr_status_t cred_pcert_cleanup(void *data)
+{
+	mgs_cred_t *cred = data;
+	unsigned int i;
+
+	for (i = 0; i < cred->certs_x509_num; i++)
+		gnutls_pcert_deinit(&cred->certs_pcert[i]);
+	return APR_SUCCESS;
+}
+
+static apr_status_t cred_privkey_cleanup(void *data)
+{
+	gnutls_privkey_deinit(data);
+	return APR_SUCCESS;
+}
+
+/* Whether key is the private key of crt */
+static int cred_key_matches(gnutls_x509_crt_t crt, gnutls_x509_privkey_t key)
+{
+	unsigned char crt_id[20], key_id[20];
+	size_t crt_id_size = sizeof(crt_id), key_id_size = sizeof(key_id);
+
+	if (gnutls_x509_crt_get_key_id(crt, 0, crt_id, &crt_id_size) < 0
+	    || gnutls_x509_privkey_get_key_id(key, 0, key_id,
+					      &key_id_size) < 0)
+		return 0;
+	return crt_id_size == key_id_size
+	    && memcmp(crt_id, key_id, crt_id_size) == 0;
+}
+
+/* Parse the files of sc into a new mgs_cred_t. Returns NULL and sets
+ * error if they are unusable.
+ */
+static mgs_cred_t *cred_load(apr_pool_t * p, mgs_srvconf_rec * sc,
+			     const char *stamp, const char **error)
+{
+	apr_allocator_t *allocator;
+	apr_pool_t *pool;
+	mgs_cred_file_t *cert, *key;
+	mgs_cred_t *cred;
+	unsigned int i;
+	int ret;
+
+	/* destroyed by whichever thread drops the last reference */
+	if (apr_allocator_create(&allocator) != APR_SUCCESS) {
+		*error = "Out of memory";
+		return NULL;
+	}
+	if (apr_pool_create_ex(&pool, NULL, NULL, allocator) != APR_SUCCESS) {
+		apr_allocator_destroy(allocator);
+		*error = "Out of memory";
+		return NULL;
+	}
+	apr_allocator_owner_set(allocator, pool);
+
+	cert = apr_pcalloc(pool, sizeof(*cert));
+	cert->kind = MGS_CRED_X509_CERT;
+	cert->path = sc->x509_cert_file;
+	cred_parse(pool, cert);
+	key = apr_pcalloc(pool, sizeof(*key));
+	key->kind = MGS_CRED_X509_KEY;
+	key->path = sc->x509_key_file;
+	cred_parse(pool, key);
+
+	if (cert->error != NULL || key->error != NULL) {
+		*error = apr_pstrdup(p, cert->error != NULL ? cert->error :
+				     key->error);
+		goto error;
+	}
+	if (cert->ncrts == 0 || !cred_key_matches(cert->crts[0], key->key)) {
+		*error = "The private key does not match the certificate";
+		goto error;
+	}
+
+	cred = apr_pcalloc(pool, sizeof(*cred));
+	cred->pool = pool;
+	cred->refs = 1;
+	cred->certs_x509 = cert->crts;
+	cred->certs_x509_num = cert->ncrts;
+	cred->stamp = apr_pstrdup(pool, stamp);
+
+	cred->certs_pcert = apr_pcalloc(pool, cert->ncrts *
+					sizeof(gnutls_pcert_st));
+	for (i = 0; i < cert->ncrts; i++) {
+		ret = gnutls_pcert_import_x509(&cred->certs_pcert[i],
+					       cert->crts[i], 0);
+		if (ret < 0) {
+			cred->certs_x509_num = i;
+			apr_pool_cleanup_register(pool, cred,
+						  cred_pcert_cleanup,
+						  apr_pool_cleanup_null);
+			goto gnutls_error;
+		}
+	}
+	apr_pool_cleanup_register(pool, cred, cred_pcert_cleanup,
+				  apr_pool_cleanup_null);
+
+	ret = gnutls_privkey_init(&cred->privkey);
+	if (ret < 0)
+		goto gnutls_error;
+	apr_pool_cleanup_register(pool, cred->privkey, cred_privkey_cleanup,
+				  apr_pool_cleanup_null);
+	ret = gnutls_privkey_import_x509(cred->privkey, key->key, 0);
+	if (ret < 0)
+		goto gnutls_error;
+
+	cred->server_env = mgs_server_env_x509(pool, sc, cert->crts[0]);
+
+	return cred;
+
+      gnutls_error:
+	*error = apr_psprintf(p, "Failed to prepare the certificates: "
+			      "(%d) %s", ret, gnutls_strerror(ret));
+      error:
+	apr_pool_destroy(pool);
+	return NULL;
+}
+
+static void cred_lru_unlink(mgs_cred_entry_t * e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void cred_lru_push(mgs_cred_entry_t * e)
+{
+	e->prev = &cred_lru;
+	e->next = cred_lru.next;
+	cred_lru.next->prev = e;
+	cred_lru.next = e;
+}
+
+/* A new entry, taking over the least recently used one if the cache is
+ * full. The chain and key of that one are returned in evicted, to be
+ * released without the lock.
+ */
+static mgs_cred_entry_t *cred_cache_entry(mgs_cred_t ** evicted)
+{
+	mgs_cred_entry_t *e;
+
+	*evicted = NULL;
+	if (cred_cache_count < cred_cache_size) {
+		cred_cache_count++;
+		return apr_palloc(cred_cache_pool, sizeof(*e));
+	}
+
+	e = cred_lru.prev;
+	cred_lru_unlink(e);
+	apr_hash_set(cred_cache, &e->sc, sizeof(e->sc), NULL);
+	*evicted = e->cred;
+	return e;
+}
+
+static apr_status_t cred_cache_cleanup(void *data)
+{
+	mgs_cred_entry_t *e;
+
+	for (e = cred_lru.next; e != &cred_lru; e = e->next)
+		mgs_credentials_release(e->cred);
+	cred_lru.prev = cred_lru.next = &cred_lru;
+	cred_cache = NULL;
+	return APR_SUCCESS;
+}
+
+/* The chain and key of a host loaded on demand, read from its files if
+ * they are not in the cache
+ */
+static mgs_cred_t *cred_cache_acquire(mgs_srvconf_rec * sc)
+{
+	apr_pool_t *p;
+	mgs_cred_entry_t *e;
+	mgs_cred_t *cred, *loaded, *evicted = NULL;
+	const char *error = NULL;
+
+	if (cred_cache == NULL)
+		return NULL;
+
+	cred_lock_acquire();
+	e = apr_hash_get(cred_cache, &sc, sizeof(sc));
+	if (e != NULL && (e->cred != NULL || e->retry > apr_time_now())) {
+		cred_lru_unlink(e);
+		cred_lru_push(e);
+		cred = e->cred;
+		if (cred != NULL)
+			apr_atomic_inc32(&cred->refs);
+		cred_lock_release();
+		return cred;
+	}
+	cred_lock_release();
+
+	/* parse without holding the lock; another thread may load the same
+	 * host meanwhile, the first one to finish wins
+	 */
+	apr_pool_create(&p, NULL);
+	loaded = cred_load(p, sc, NULL, &error);
+	if (loaded == NULL)
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, sc->server,
+			     "GnuTLS: Host '%s:%d': Cannot load the "
+			     "certificate '%s': %s",
+			     sc->server->server_hostname, sc->server->port,
+			     sc->x509_cert_file, error);
+	apr_pool_destroy(p);
+
+	cred_lock_acquire();
+	e = apr_hash_get(cred_cache, &sc, sizeof(sc));
+	if (e == NULL) {
+		e = cred_cache_entry(&evicted);
+		e->sc = sc;
+		e->cred = NULL;
+		apr_hash_set(cred_cache, &e->sc, sizeof(e->sc), e);
+	} else {
+		cred_lru_unlink(e);
+	}
+	if (e->cred == NULL) {
+		e->cred = loaded;
+		e->retry = apr_time_now() + MGS_CRED_CACHE_RETRY;
+		loaded = NULL;
+	}
+	cred_lru_push(e);
+	cred = e->cred;
+	if (cred != NULL)
+		apr_atomic_inc32(&cred->refs);
+	cred_lock_release();
+
+	/* the loser of a race, and the least recently used host */
+	mgs_credentials_release(loaded);
+	mgs_credentials_release(evicted);
+
+	return cred;
+}
+
+mgs_cred_t *mgs_credentials_acquire(mgs_srvconf_rec * sc)
+{
+	mgs_cred_t *cred;
+
+	if (sc->cred_lazy)
+		return cred_cache_acquire(sc);
+
+	cred_lock_acquire();
+	cred = sc->cred;
+	if (cred != NULL)
+		apr_atomic_inc32(&cred->refs);
+	cred_lock_release();
+
+	return cred;
+}
+
+void mgs_credentials_release(mgs_cred_t * cred)
+{
+	/* the startup one is held by its host for good */
+	if (cred != NULL && apr_atomic_dec32(&cred->refs) == 0
+	    && cred->pool != NULL)
+		apr_pool_destroy(cred->pool);
+}
+
+#if APR_HAS_THREADS
+/* Reload the files of s if they changed since they were read or last
+ * tried
+ */
+static void cred_reload(apr_pool_t * p, server_rec * s,
+			mgs_srvconf_rec * sc, apr_hash_t * tried)
+{
+	const char *stamp, *last, *error;
+	mgs_cred_t *cred, *old;
+
+	/* only this thread replaces sc->cred */
+	if (sc->cred == NULL || sc->cred->stamp == NULL)
+		return;
+
+	stamp = cred_stamp(p, sc);
+	if (stamp == NULL || strcmp(stamp, sc->cred->stamp) == 0)
+		return;
+	last = apr_hash_get(tried, &sc, sizeof(sc));
+	if (last != NULL && strcmp(stamp, last) == 0)
+		return;
+	apr_hash_set(tried, apr_pmemdup(apr_hash_pool_get(tried), &sc,
+					sizeof(sc)), sizeof(sc),
+		     apr_pstrdup(apr_hash_pool_get(tried), stamp));
+
+	cred = cred_load(p, sc, stamp, &error);
+	if (cred == NULL) {
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+			     "GnuTLS: Host '%s:%d': Keeping the current "
+			     "certificate, cannot reload '%s': %s",
+			     s->server_hostname, s->port, sc->x509_cert_file,
+			     error);
+		return;
+	}
+
+	cred_lock_acquire();
+	old = sc->cred;
+	sc->cred = cred;
+	cred_lock_release();
+	mgs_credentials_release(old);
+
+	ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+		     "GnuTLS: Host '%s:%d': Reloaded the certificate '%s'",
+		     s->server_hostname, s->port, sc->x509_cert_file);
+}
+
+static void *APR_THREAD_FUNC cred_reload_thread_main(apr_thread_t * thread,
+						     void *data)
+{
+	server_rec *base_server = data;
+	server_rec *s;
+	mgs_srvconf_rec *sc;
+	mgs_srvconf_rec *sc_base =
+	    ap_get_module_config(base_server->module_config,
+				 &gnutls_module);
+	apr_pool_t *p, *tp;
+	apr_hash_t *tried;
+	apr_time_t next = apr_time_now() + sc_base->reload_interval;
+
+	apr_pool_create(&tp, apr_thread_pool_get(thread));
+	tried = apr_hash_make(tp);
+	apr_pool_create(&p, tp);
+
+	while (!cred_reload_stop) {
+		if (apr_time_now() >= next) {
+			for (s = base_server; s && !cred_reload_stop;
+			     s = s->next) {
+				sc = ap_get_module_config(s->module_config,
+							  &gnutls_module);
+				cred_reload(p, s, sc, tried);
+				apr_pool_clear(p);
+			}
+			next = apr_time_now() + sc_base->reload_interval;
+		}
+		/* wake up often enough to notice the child exiting */
+		apr_sleep(apr_time_from_sec(1));
+	}
+
+	apr_thread_exit(thread, APR_SUCCESS);
+	return NULL;
+}
+
+static apr_status_t cred_reload_thread_cleanup(void *data)
+{
+	apr_status_t rv;
+
+	cred_reload_stop = 1;
+	if (cred_reload_thread != NULL)
+		apr_thread_join(&rv, cred_reload_thread);
+	cred_reload_thread = NULL;
+	return APR_SUCCESS;
+}
+#endif
+
+void mgs_credentials_child_init(apr_pool_t * p, server_rec * base_server)
+{
+#if APR_HAS_THREADS
+	apr_status_t rv;
+#endif
+	mgs_srvconf_rec *sc_base =
+	    ap_get_module_config(base_server->module_config,
+				 &gnutls_module);
+
+	cred_cache = NULL;
+#if APR_HAS_THREADS
+	cred_lock = NULL;
+	cred_reload_thread = NULL;
+	if (sc_base->reload_interval == 0
+	    && sc_base->credential_cache_size == 0)
+		return;
+
+	rv = apr_thread_mutex_create(&cred_lock, APR_THREAD_MUTEX_DEFAULT, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_EMERG, rv, base_server,
+			     "GnuTLS: Failed to create the lock of the "
+			     "certificates");
+		cred_lock = NULL;
+		return;
+	}
+#endif
+
+	if (sc_base->credential_cache_size > 0) {
+		apr_pool_create(&cred_cache_pool, p);
+		cred_cache = apr_hash_make(cred_cache_pool);
+		cred_lru.prev = cred_lru.next = &cred_lru;
+		cred_cache_size = sc_base->credential_cache_size;
+		cred_cache_count = 0;
+		apr_pool_cleanup_register(cred_cache_pool, NULL,
+					  cred_cache_cleanup,
+					  apr_pool_cleanup_null);
+	}
+
+#if APR_HAS_THREADS
+	if (sc_base->reload_interval == 0)
+		return;
+
+	cred_reload_stop = 0;
+	rv = apr_thread_create(&cred_reload_thread, NULL,
+			       cred_reload_thread_main, base_server, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_EMERG, rv, base_server,
+			     "GnuTLS: Failed to start the certificate reload "
+			     "thread");
+		cred_reload_thread = NULL;
+		return;
+	}
+	/* join before the pools used by the thread go away */
+	apr_pool_pre_cleanup_register(p, NULL, cred_reload_thread_cleanup);
+#endif
+}
+
+#endif
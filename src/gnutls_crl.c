@@ -0,0 +1,782 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "mod_gnutls.h"
+
+#include "apr_mmap.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_rwlock.h"
+#include "apr_user.h"
+#include <gnutls/crypto.h>
+
+/**
+ * Certificate revocation lists
+ *
+ * The CRLs of GnuTLSX509CRLFile are not kept around. At startup the
+ * serial numbers they revoke are put into an open addressing hash table
+ * of 64 bit fingerprints of (issuer, serial), so checking a client
+ * certificate costs one hash no matter how many certificates are
+ * revoked. The table is built by the parent, so the children share its
+ * pages.
+ *
+ * With GnuTLSCRLIndexDir the parent also writes the table to a file
+ * there, and maps it from that file at the next start if it was built
+ * from a CRL file with the same SHA-256. Only files of the user that
+ * started httpd that nobody else can write are used, so the children
+ * cannot plant a table that revokes nothing.
+ *
+ * A thread in each child looks at the modification time of the CRL
+ * files every GnuTLSCRLCheckInterval and swaps in a new table when one
+ * has changed. The children never write the table file; each builds
+ * its own table unless the file already holds the right one.
+ */
+
+#define MGS_CRL_MAGIC "MGSCRL02"
+/* Tables are at most half full */
+#define MGS_CRL_MIN_SLOTS 16
+/* Longest serial number accepted, RFC 5280 allows 20 bytes */
+#define MGS_CRL_MAX_SERIAL 64
+
+/* The header of a table, followed by nslots fingerprints */
+typedef struct {
+	char magic[8];
+	apr_uint32_t nslots;
+	apr_uint32_t count;
+	/* the SHA-256 of the CRL file indexed */
+	unsigned char digest[32];
+	/* the earliest next update of the CRLs, 0 if none */
+	apr_time_t next_update;
+} mgs_crl_header_t;
+
+typedef struct {
+	/* the pool holding the table, NULL for the one built at startup */
+	apr_pool_t *pool;
+	const mgs_crl_header_t *hdr;
+	const apr_uint64_t *slots;
+} mgs_crl_index_t;
+
+struct mgs_crl {
+	const char *file;
+	/* the table file in GnuTLSCRLIndexDir, or NULL */
+	const char *index_file;
+	mgs_crl_index_t *index;
+	/* the modification time of the CRL file indexed */
+	apr_time_t mtime;
+	/* the modification time of a CRL file that failed to load */
+	apr_time_t failed_mtime;
+#if APR_HAS_THREADS
+	apr_thread_rwlock_t *lock;
+#endif
+};
+
+static int crl_hosts;
+/* the user owning the table files */
+static apr_uid_t crl_uid;
+
+#if APR_HAS_THREADS
+static apr_thread_t *crl_thread;
+static volatile int crl_thread_stop;
+#endif
+
+/* The fingerprint of a revoked certificate, 0 on error */
+static apr_uint64_t crl_fingerprint(const char *issuer, size_t issuer_len,
+				    const unsigned char *serial,
+				    size_t serial_size)
+{
+	gnutls_hash_hd_t dig;
+	unsigned char md[32];
+	apr_uint64_t fp = 0;
+	int i;
+
+	if (gnutls_hash_init(&dig, GNUTLS_DIG_SHA256) < 0)
+		return 0;
+	gnutls_hash(dig, issuer, issuer_len);
+	/* DN strings contain no NUL, it separates the fields */
+	gnutls_hash(dig, "", 1);
+	gnutls_hash(dig, serial, serial_size);
+	gnutls_hash_deinit(dig, md);
+
+	for (i = 0; i < 8; i++)
+		fp = (fp << 8) | md[i];
+
+	/* 0 marks a free slot */
+	return fp ? fp : 1;
+}
+
+static void crl_insert(apr_uint64_t * slots, apr_uint32_t nslots,
+		       apr_uint64_t fp)
+{
+	apr_uint32_t i = (apr_uint32_t) fp & (nslots - 1);
+
+	while (slots[i] != 0 && slots[i] != fp)
+		i = (i + 1) & (nslots - 1);
+	slots[i] = fp;
+}
+
+static int crl_lookup(const mgs_crl_index_t * index, apr_uint64_t fp)
+{
+	apr_uint32_t nslots = index->hdr->nslots;
+	apr_uint32_t i = (apr_uint32_t) fp & (nslots - 1);
+	apr_uint32_t n;
+
+	/* a table has free slots, but do not count on it */
+	for (n = 0; n < nslots && index->slots[i] != 0; n++) {
+		if (index->slots[i] == fp)
+			return 1;
+		i = (i + 1) & (nslots - 1);
+	}
+	return 0;
+}
+
+static char *crl_issuer_dn(apr_pool_t * p, gnutls_x509_crl_t crl,
+			   size_t * len)
+{
+	char *dn;
+
+	*len = 0;
+	if (gnutls_x509_crl_get_issuer_dn(crl, NULL, len) !=
+	    GNUTLS_E_SHORT_MEMORY_BUFFER)
+		return NULL;
+	dn = apr_palloc(p, *len);
+	if (gnutls_x509_crl_get_issuer_dn(crl, dn, len) < 0)
+		return NULL;
+	return dn;
+}
+
+static char *crt_issuer_dn(apr_pool_t * p, gnutls_x509_crt_t crt,
+			   size_t * len)
+{
+	char *dn;
+
+	*len = 0;
+	if (gnutls_x509_crt_get_issuer_dn(crt, NULL, len) !=
+	    GNUTLS_E_SHORT_MEMORY_BUFFER)
+		return NULL;
+	dn = apr_palloc(p, *len);
+	if (gnutls_x509_crt_get_issuer_dn(crt, dn, len) < 0)
+		return NULL;
+	return dn;
+}
+
+/* Add the serial numbers revoked by crl to the table */
+static int crl_add_serials(apr_pool_t * p, gnutls_x509_crl_t crl,
+			   apr_uint64_t * slots, apr_uint32_t nslots)
+{
+	unsigned char serial[MGS_CRL_MAX_SERIAL];
+	size_t serial_size;
+	time_t t;
+	char *dn;
+	size_t dn_len;
+	apr_uint64_t fp;
+	int ret;
+#if GNUTLS_VERSION_NUMBER >= 0x030400
+	gnutls_x509_crl_iter_t iter = NULL;
+#else
+	int i, count;
+#endif
+
+	dn = crl_issuer_dn(p, crl, &dn_len);
+	if (dn == NULL)
+		return GNUTLS_E_ASN1_DER_ERROR;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030400
+	/* fetching the entries by index is quadratic in the CRL size */
+	for (;;) {
+		serial_size = sizeof(serial);
+		ret = gnutls_x509_crl_iter_crt_serial(crl, &iter, serial,
+						      &serial_size, &t);
+		if (ret < 0)
+			break;
+#else
+	count = gnutls_x509_crl_get_crt_count(crl);
+	for (i = 0; i < count; i++) {
+		serial_size = sizeof(serial);
+		ret = gnutls_x509_crl_get_crt_serial(crl, i, serial,
+						     &serial_size, &t);
+		if (ret < 0)
+			break;
+#endif
+		fp = crl_fingerprint(dn, dn_len, serial, serial_size);
+		if (fp == 0) {
+			ret = GNUTLS_E_HASH_FAILED;
+			break;
+		}
+		crl_insert(slots, nslots, fp);
+	}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030400
+	gnutls_x509_crl_iter_deinit(iter);
+	if (ret == GNUTLS_E_REQUESTED_DATA_NOT_AVAILABLE)
+		ret = 0;
+#endif
+	return ret < 0 ? ret : 0;
+}
+
+/* Map the CRL file of sc and hash it */
+static int crl_read(apr_pool_t * p, server_rec * s, mgs_srvconf_rec * sc,
+		    apr_mmap_t ** mm, unsigned char *digest)
+{
+	apr_file_t *fp;
+	apr_finfo_t finfo;
+	apr_status_t rv;
+
+	rv = apr_file_open(&fp, sc->crl->file, APR_READ | APR_BINARY,
+			   APR_OS_DEFAULT, p);
+	if (rv == APR_SUCCESS)
+		rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, fp);
+	if (rv == APR_SUCCESS && finfo.size == 0)
+		rv = APR_EINVAL;
+	/* CRLs can be large, do not copy them */
+	if (rv == APR_SUCCESS)
+		rv = apr_mmap_create(mm, fp, 0, finfo.size, APR_MMAP_READ,
+				     p);
+	if (rv == APR_SUCCESS) {
+		/* the mapping stays valid after the file is closed */
+		apr_file_close(fp);
+		if (gnutls_hash_fast(GNUTLS_DIG_SHA256, (*mm)->mm,
+				     (*mm)->size, digest) < 0) {
+			apr_mmap_delete(*mm);
+			rv = APR_EGENERAL;
+		}
+	}
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+			     "GnuTLS: Error Reading CRL File '%s'",
+			     sc->crl->file);
+		return -1;
+	}
+	return 0;
+}
+
+/* Build the table of the CRL file of sc from its contents in data */
+static int crl_build(apr_pool_t * p, server_rec * s,
+		     mgs_srvconf_rec * sc, gnutls_datum_t * data,
+		     const unsigned char *digest, mgs_crl_index_t ** index)
+{
+	gnutls_x509_crl_t *crls = NULL;
+	unsigned int ncrls = 0, i, verify;
+	apr_uint32_t nslots, total = 0;
+	mgs_crl_header_t *hdr;
+	time_t next;
+	int ret = 0;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+	ret = gnutls_x509_crl_list_import2(&crls, &ncrls, data,
+					   data->data[0] == 0x30 ?
+					   GNUTLS_X509_FMT_DER :
+					   GNUTLS_X509_FMT_PEM, 0);
+#else
+	crls = gnutls_malloc(sizeof(*crls));
+	if (crls == NULL)
+		ret = GNUTLS_E_MEMORY_ERROR;
+	else
+		ret = gnutls_x509_crl_init(&crls[0]);
+	if (ret == 0) {
+		ncrls = 1;
+		ret = gnutls_x509_crl_import(crls[0], data,
+					     data->data[0] == 0x30 ?
+					     GNUTLS_X509_FMT_DER :
+					     GNUTLS_X509_FMT_PEM);
+	}
+#endif
+	if (ret < 0) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+			     "GnuTLS: Failed to load CRL File '%s': (%d) %s",
+			     sc->crl->file, ret, gnutls_strerror(ret));
+		goto exit;
+	}
+
+	*index = apr_pcalloc(p, sizeof(**index));
+	for (i = 0; i < ncrls; i++) {
+		/* an unsigned list could revoke anything */
+		ret = gnutls_x509_crl_verify(crls[i], sc->ca_list,
+					     sc->ca_list_size, 0, &verify);
+		if (ret < 0 || verify != 0) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+				     "GnuTLS: CRL %u of '%s' is not signed "
+				     "by a CA of GnuTLSX509CAFile", i + 1,
+				     sc->crl->file);
+			ret = -1;
+			goto exit;
+		}
+		ret = gnutls_x509_crl_get_crt_count(crls[i]);
+		if (ret > 0)
+			total += ret;
+	}
+
+	nslots = MGS_CRL_MIN_SLOTS;
+	while (nslots < 2 * total)
+		nslots <<= 1;
+
+	/* header and slots in one block, the way they are written out */
+	hdr = apr_pcalloc(p, sizeof(*hdr) + nslots * sizeof(apr_uint64_t));
+	memcpy(hdr->magic, MGS_CRL_MAGIC, sizeof(hdr->magic));
+	hdr->nslots = nslots;
+	hdr->count = total;
+	memcpy(hdr->digest, digest, sizeof(hdr->digest));
+	(*index)->hdr = hdr;
+	(*index)->slots = (apr_uint64_t *) (hdr + 1);
+
+	for (i = 0; i < ncrls; i++) {
+		ret = crl_add_serials(p, crls[i], (apr_uint64_t *) (hdr + 1),
+				      nslots);
+		if (ret < 0) {
+			ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+				     "GnuTLS: Failed to read CRL %u of '%s': "
+				     "(%d) %s", i + 1, sc->crl->file, ret,
+				     gnutls_strerror(ret));
+			goto exit;
+		}
+
+		next = gnutls_x509_crl_get_next_update(crls[i]);
+		if (next != (time_t) - 1) {
+			apr_time_t t;
+
+			apr_time_ansi_put(&t, next);
+			if (hdr->next_update == 0 || t < hdr->next_update)
+				hdr->next_update = t;
+		}
+	}
+
+      exit:
+	for (i = 0; i < ncrls; i++)
+		gnutls_x509_crl_deinit(crls[i]);
+	gnutls_free(crls);
+	return ret < 0 ? -1 : 0;
+}
+
+/* Map the table file of sc if it was built from a CRL file with this
+ * digest
+ */
+static int crl_map(apr_pool_t * p, server_rec * s, mgs_srvconf_rec * sc,
+		   const unsigned char *digest, mgs_crl_index_t ** index)
+{
+	apr_file_t *fp;
+	apr_finfo_t finfo;
+	apr_mmap_t *mm;
+	const mgs_crl_header_t *hdr;
+	const apr_uint64_t *slots;
+	apr_uint32_t i, used = 0;
+
+	/* a table that revokes nothing is easy to forge, only take one
+	 * written by the parent, in a directory the children cannot change
+	 */
+	if (apr_stat(&finfo, sc->crl->index_file, APR_FINFO_LINK
+		     | APR_FINFO_TYPE | APR_FINFO_OWNER | APR_FINFO_PROT,
+		     p) != APR_SUCCESS)
+		return -1;
+	if (finfo.filetype != APR_REG
+	    || apr_uid_compare(finfo.user, crl_uid) != APR_SUCCESS
+	    || (finfo.protection & (APR_FPROT_GWRITE | APR_FPROT_WWRITE))) {
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+			     "GnuTLS: The CRL index '%s' is not a file of "
+			     "the user starting httpd only, not using it",
+			     sc->crl->index_file);
+		return -1;
+	}
+	if (apr_stat(&finfo, ap_make_dirstr_parent(p, sc->crl->index_file),
+		     APR_FINFO_TYPE | APR_FINFO_OWNER | APR_FINFO_PROT,
+		     p) != APR_SUCCESS
+	    || finfo.filetype != APR_DIR
+	    || (apr_uid_compare(finfo.user, crl_uid) != APR_SUCCESS
+		&& finfo.user != 0)
+	    || (finfo.protection & (APR_FPROT_GWRITE | APR_FPROT_WWRITE))) {
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+			     "GnuTLS: The directory of the CRL index '%s' "
+			     "can be written by others, not using it",
+			     sc->crl->index_file);
+		return -1;
+	}
+
+	if (apr_file_open(&fp, sc->crl->index_file, APR_READ | APR_BINARY,
+			  APR_OS_DEFAULT, p) != APR_SUCCESS)
+		return -1;
+
+	if (apr_file_info_get(&finfo, APR_FINFO_SIZE, fp) != APR_SUCCESS
+	    || finfo.size < (apr_off_t) sizeof(*hdr)
+	    || apr_mmap_create(&mm, fp, 0, finfo.size, APR_MMAP_READ,
+			       p) != APR_SUCCESS) {
+		apr_file_close(fp);
+		return -1;
+	}
+	/* the mapping stays valid after the file is closed */
+	apr_file_close(fp);
+
+	/* the file may be truncated or left by another version, check
+	 * everything a lookup relies on: the size of the table, and that it
+	 * is at most half full the way crl_build() makes it
+	 */
+	hdr = mm->mm;
+	if (memcmp(hdr->magic, MGS_CRL_MAGIC, sizeof(hdr->magic)) != 0
+	    || memcmp(hdr->digest, digest, sizeof(hdr->digest)) != 0
+	    || hdr->nslots < MGS_CRL_MIN_SLOTS
+	    || (hdr->nslots & (hdr->nslots - 1)) != 0
+	    || (mm->size - sizeof(*hdr)) / sizeof(apr_uint64_t) !=
+	    hdr->nslots
+	    || (mm->size - sizeof(*hdr)) % sizeof(apr_uint64_t) != 0
+	    || hdr->count > hdr->nslots / 2) {
+		apr_mmap_delete(mm);
+		return -1;
+	}
+
+	slots = (const apr_uint64_t *) (hdr + 1);
+	for (i = 0; i < hdr->nslots; i++)
+		if (slots[i] != 0)
+			used++;
+	if (used > hdr->count) {
+		apr_mmap_delete(mm);
+		return -1;
+	}
+
+	*index = apr_pcalloc(p, sizeof(**index));
+	(*index)->hdr = hdr;
+	(*index)->slots = slots;
+	return 0;
+}
+
+/* Replace the table file of sc atomically */
+static apr_status_t crl_write(apr_pool_t * p, mgs_srvconf_rec * sc,
+			      const mgs_crl_index_t * index)
+{
+	apr_file_t *fp;
+	apr_status_t rv;
+	char *tmp = apr_pstrcat(p, sc->crl->index_file, ".XXXXXX", NULL);
+
+	rv = apr_file_mktemp(&fp, tmp, APR_CREATE | APR_WRITE | APR_EXCL
+			     | APR_BINARY, p);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	rv = apr_file_write_full(fp, index->hdr, sizeof(*index->hdr) +
+				 index->hdr->nslots *
+				 sizeof(apr_uint64_t), NULL);
+	apr_file_close(fp);
+	/* the children may run as another user, they only read it */
+	if (rv == APR_SUCCESS)
+		rv = apr_file_perms_set(tmp, APR_FPROT_UREAD |
+					APR_FPROT_UWRITE | APR_FPROT_GREAD
+					| APR_FPROT_WREAD);
+	if (rv == APR_SUCCESS || rv == APR_ENOTIMPL)
+		rv = apr_file_rename(tmp, sc->crl->index_file, p);
+	if (rv != APR_SUCCESS)
+		apr_file_remove(tmp, p);
+	return rv;
+}
+
+/* Get the table of the CRL file of sc, which is old if the file has
+ * the same contents, else mapped from the table file if there is an up
+ * to date one. Only the parent writes a new table file.
+ */
+static int crl_load(apr_pool_t * p, server_rec * s, mgs_srvconf_rec * sc,
+		    mgs_crl_index_t * old, int parent,
+		    mgs_crl_index_t ** index)
+{
+	apr_mmap_t *mm;
+	apr_status_t rv;
+	gnutls_datum_t data;
+	unsigned char digest[32];
+	int ret;
+
+	if (crl_read(p, s, sc, &mm, digest) != 0)
+		return -1;
+
+	if (old != NULL
+	    && memcmp(old->hdr->digest, digest, sizeof(digest)) == 0) {
+		apr_mmap_delete(mm);
+		*index = old;
+		return 0;
+	}
+	if (sc->crl->index_file != NULL
+	    && crl_map(p, s, sc, digest, index) == 0) {
+		apr_mmap_delete(mm);
+		return 0;
+	}
+
+	data.data = mm->mm;
+	data.size = mm->size;
+	ret = crl_build(p, s, sc, &data, digest, index);
+	apr_mmap_delete(mm);
+	if (ret != 0)
+		return -1;
+
+	if (parent && sc->crl->index_file != NULL) {
+		rv = crl_write(p, sc, *index);
+		if (rv != APR_SUCCESS)
+			ap_log_error(APLOG_MARK, APLOG_WARNING, rv, s,
+				     "GnuTLS: Cannot write the CRL index "
+				     "'%s'", sc->crl->index_file);
+	}
+
+	if ((*index)->hdr->next_update != 0
+	    && (*index)->hdr->next_update < apr_time_now())
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+			     "GnuTLS: CRL File '%s' is past its next "
+			     "update", sc->crl->file);
+
+	return 0;
+}
+
+int mgs_crl_check(apr_pool_t * p, mgs_srvconf_rec * sc,
+		  gnutls_x509_crt_t * chain, unsigned int n)
+{
+	unsigned char serial[MGS_CRL_MAX_SERIAL];
+	size_t serial_size;
+	char *dn;
+	size_t dn_len;
+	apr_uint64_t *fps;
+	unsigned int i;
+	int revoked = 0;
+
+	if (sc->crl == NULL)
+		return 0;
+
+	/* do the hashing before taking the lock */
+	fps = apr_palloc(p, n * sizeof(*fps));
+	for (i = 0; i < n; i++) {
+		serial_size = sizeof(serial);
+		dn = crt_issuer_dn(p, chain[i], &dn_len);
+		if (dn == NULL
+		    || gnutls_x509_crt_get_serial(chain[i], serial,
+						  &serial_size) < 0)
+			return -1;
+		fps[i] = crl_fingerprint(dn, dn_len, serial, serial_size);
+		if (fps[i] == 0)
+			return -1;
+	}
+
+#if APR_HAS_THREADS
+	if (sc->crl->lock != NULL)
+		apr_thread_rwlock_rdlock(sc->crl->lock);
+#endif
+	for (i = 0; i < n && !revoked; i++)
+		revoked = crl_lookup(sc->crl->index, fps[i]);
+#if APR_HAS_THREADS
+	if (sc->crl->lock != NULL)
+		apr_thread_rwlock_unlock(sc->crl->lock);
+#endif
+
+	return revoked;
+}
+
+#if APR_HAS_THREADS
+/* The new table is allocated from a subpool of p, tp is for scratch */
+static void crl_refresh(apr_pool_t * p, apr_pool_t * tp, server_rec * s,
+			mgs_srvconf_rec * sc)
+{
+	apr_finfo_t finfo;
+	apr_pool_t *ip;
+	mgs_crl_index_t *index, *old;
+	apr_status_t rv;
+
+	rv = apr_stat(&finfo, sc->crl->file, APR_FINFO_MTIME, tp);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+			     "GnuTLS: Cannot check CRL File '%s'",
+			     sc->crl->file);
+		return;
+	}
+	if (finfo.mtime == sc->crl->mtime
+	    || finfo.mtime == sc->crl->failed_mtime)
+		return;
+
+	apr_pool_create(&ip, p);
+	if (crl_load(ip, s, sc, sc->crl->index, 0, &index) != 0) {
+		/* keep the old list, and do not try again until the file
+		 * changes
+		 */
+		sc->crl->failed_mtime = finfo.mtime;
+		apr_pool_destroy(ip);
+		return;
+	}
+	sc->crl->mtime = finfo.mtime;
+	/* touched, but the same CRLs */
+	if (index == sc->crl->index) {
+		apr_pool_destroy(ip);
+		return;
+	}
+	index->pool = ip;
+
+	apr_thread_rwlock_wrlock(sc->crl->lock);
+	old = sc->crl->index;
+	sc->crl->index = index;
+	apr_thread_rwlock_unlock(sc->crl->lock);
+
+	if (old->pool != NULL)
+		apr_pool_destroy(old->pool);
+	/* the verification cache is shared, each child retires it when it
+	 * sees the new CRLs, so none keeps results cached before that
+	 */
+	mgs_verify_cache_invalidate();
+
+	ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+		     "GnuTLS: Loaded CRL File '%s' (%u revoked)",
+		     sc->crl->file, index->hdr->count);
+}
+
+static void *APR_THREAD_FUNC crl_thread_main(apr_thread_t * thread,
+					     void *data)
+{
+	server_rec *base_server = data;
+	server_rec *s;
+	mgs_srvconf_rec *sc;
+	mgs_srvconf_rec *sc_base =
+	    ap_get_module_config(base_server->module_config,
+				 &gnutls_module);
+	apr_pool_t *p, *tp;
+	apr_time_t next = apr_time_now() + sc_base->crl_check_interval;
+
+	/* the tables live in subpools of p, the scratch space in tp */
+	p = apr_thread_pool_get(thread);
+	apr_pool_create(&tp, p);
+
+	while (!crl_thread_stop) {
+		if (apr_time_now() >= next) {
+			for (s = base_server; s; s = s->next) {
+				sc = ap_get_module_config(s->module_config,
+							  &gnutls_module);
+				if (sc->crl != NULL)
+					crl_refresh(p, tp, s, sc);
+				apr_pool_clear(tp);
+			}
+			next = apr_time_now() + sc_base->crl_check_interval;
+		}
+		/* wake up often enough to notice the child exiting */
+		apr_sleep(apr_time_from_sec(1));
+	}
+
+	apr_pool_destroy(tp);
+	apr_thread_exit(thread, APR_SUCCESS);
+	return NULL;
+}
+
+static apr_status_t crl_thread_cleanup(void *data)
+{
+	apr_status_t rv;
+
+	crl_thread_stop = 1;
+	if (crl_thread != NULL)
+		apr_thread_join(&rv, crl_thread);
+	crl_thread = NULL;
+	return APR_SUCCESS;
+}
+#endif
+
+int mgs_crl_post_config(apr_pool_t * p, server_rec * base_server)
+{
+	apr_finfo_t finfo;
+	apr_status_t rv;
+	server_rec *s;
+	mgs_srvconf_rec *sc;
+	mgs_srvconf_rec *sc_base =
+	    ap_get_module_config(base_server->module_config,
+				 &gnutls_module);
+	unsigned char md[32];
+	apr_gid_t gid;
+
+	crl_hosts = 0;
+	if (sc_base->crl_index_dir != NULL
+	    && apr_uid_current(&crl_uid, &gid, p) != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, base_server,
+			     "GnuTLS: Cannot tell the user starting httpd, "
+			     "GnuTLSCRLIndexDir is not used");
+		sc_base->crl_index_dir = NULL;
+	}
+
+	for (s = base_server; s; s = s->next) {
+		sc = ap_get_module_config(s->module_config, &gnutls_module);
+		sc->crl = NULL;
+		if (sc->enabled != GNUTLS_ENABLED_TRUE
+		    || sc->crl_file == NULL)
+			continue;
+
+		if (sc->ca_list_size == 0) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+				     "GnuTLS: Host '%s:%d': "
+				     "GnuTLSX509CRLFile needs "
+				     "GnuTLSX509CAFile",
+				     s->server_hostname, s->port);
+			return -1;
+		}
+
+		sc->crl = apr_pcalloc(p, sizeof(*sc->crl));
+		sc->crl->file = sc->crl_file;
+		if (sc_base->crl_index_dir != NULL) {
+			/* one table file per CRL file */
+			gnutls_hash_fast(GNUTLS_DIG_SHA256, sc->crl_file,
+					 strlen(sc->crl_file), md);
+			sc->crl->index_file =
+			    apr_psprintf(p, "%s/%02x%02x%02x%02x%02x%02x"
+					 "%02x%02x.crlidx",
+					 sc_base->crl_index_dir, md[0],
+					 md[1], md[2], md[3], md[4], md[5],
+					 md[6], md[7]);
+		}
+
+		rv = apr_stat(&finfo, sc->crl_file, APR_FINFO_MTIME, p);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, s,
+				     "GnuTLS: Error Reading CRL File '%s'",
+				     sc->crl_file);
+			return -1;
+		}
+		sc->crl->mtime = finfo.mtime;
+		if (crl_load(p, s, sc, NULL, 1, &sc->crl->index) != 0)
+			return -1;
+
+		crl_hosts++;
+	}
+
+	return 0;
+}
+
+void mgs_crl_child_init(apr_pool_t * p, server_rec * base_server)
+{
+#if APR_HAS_THREADS
+	apr_status_t rv;
+	server_rec *s;
+	mgs_srvconf_rec *sc;
+
+	if (crl_hosts == 0)
+		return;
+
+	for (s = base_server; s; s = s->next) {
+		sc = ap_get_module_config(s->module_config, &gnutls_module);
+		if (sc->crl == NULL)
+			continue;
+		rv = apr_thread_rwlock_create(&sc->crl->lock, p);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s,
+				     "GnuTLS: Failed to create the CRL "
+				     "lock, CRL File '%s' is not reloaded",
+				     sc->crl->file);
+			return;
+		}
+	}
+
+	crl_thread_stop = 0;
+	rv = apr_thread_create(&crl_thread, NULL, crl_thread_main,
+			       base_server, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_EMERG, rv, base_server,
+			     "GnuTLS: Failed to start the CRL reload thread");
+		crl_thread = NULL;
+		return;
+	}
+	/* join before the pools used by the thread go away */
+	apr_pool_pre_cleanup_register(p, NULL, crl_thread_cleanup);
+#endif
+}
@@ -35,6 +35,15 @@ extern server_rec *ap_server_conf;
 #include "apr_base64.h"
 #endif
 
+#if GNUTLS_VERSION_NUMBER >= 0x030500
+# if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+# elif defined(__linux__) && defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+# endif
+#endif
+
 #if MOD_GNUTLS_DEBUG
 static apr_file_t *debug_log_fp;
 #endif
@@ -44,10 +53,11 @@ static gnutls_datum session_ticket_key = { NULL, 0 };
 
 static int mgs_cert_verify(request_rec * r, mgs_handle_t * ctxt);
 /* use side==0 for server and side==1 for client */
-static void mgs_add_common_cert_vars(request_rec * r,
+static void mgs_add_common_cert_vars(apr_table_t * env, apr_pool_t * pool,
 				     gnutls_x509_crt_t cert, int side,
 				     int export_certificates_enabled);
-static void mgs_add_common_pgpcert_vars(request_rec * r,
+static void mgs_add_common_pgpcert_vars(apr_table_t * env,
+					apr_pool_t * pool,
 					gnutls_openpgp_crt_t cert,
 					int side,
 					int export_certificates_enabled);
@@ -158,6 +168,16 @@ static int mgs_select_virtual_server_cb(gnutls_session_t session)
 	if (tsc != NULL)
 		ctxt->sc = tsc;
 
+#if GNUTLS_VERSION_NUMBER < 0x030400
+	/* without handshake hooks this is the last chance to refuse the
+	 * handshake before the private key is used, but resumptions with
+	 * session tickets are not known yet
+	 */
+	ret = mgs_limit_full_handshake(ctxt);
+	if (ret < 0)
+		return ret;
+#endif
+
 	gnutls_certificate_server_set_request(session,
 					      ctxt->
 					      sc->client_verify_mode);
@@ -184,7 +204,12 @@ static int mgs_select_virtual_server_cb(gnutls_session_t session)
 	 * enabled on this virtual server. Note that here we ignore the version
 	 * negotiation.
 	 */
-	ret = gnutls_priority_set(session, ctxt->sc->priorities);
+	if (ctxt->client_prefers_chacha
+	    && ctxt->sc->priorities_chacha != NULL)
+		ret = gnutls_priority_set(session,
+					  ctxt->sc->priorities_chacha);
+	else
+		ret = gnutls_priority_set(session, ctxt->sc->priorities);
 	/* actually it shouldn't fail since we have checked at startup */
 	if (ret < 0)
 		return ret;
@@ -192,12 +217,12 @@ static int mgs_select_virtual_server_cb(gnutls_session_t session)
 	/* If both certificate types are not present disallow them from
 	 * being negotiated.
 	 */
-	if (ctxt->sc->certs_x509[0] != NULL && ctxt->sc->cert_pgp == NULL) {
+	if (ctxt->sc->certs_x509_num > 0 && ctxt->sc->cert_pgp == NULL) {
 		cprio[0] = GNUTLS_CRT_X509;
 		cprio[1] = 0;
 		gnutls_certificate_type_set_priority(session, cprio);
 	} else if (ctxt->sc->cert_pgp != NULL
-		   && ctxt->sc->certs_x509[0] == NULL) {
+		   && ctxt->sc->certs_x509_num == 0) {
 		cprio[0] = GNUTLS_CRT_OPENPGP;
 		cprio[1] = 0;
 		gnutls_certificate_type_set_priority(session, cprio);
@@ -206,6 +231,190 @@ static int mgs_select_virtual_server_cb(gnutls_session_t session)
 	return 0;
 }
 
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+static int cert_retrieve_fn(gnutls_session_t session,
+			    const gnutls_datum_t * req_ca_rdn, int nreqs,
+			    const gnutls_pk_algorithm_t * pk_algos,
+			    int pk_algos_length, gnutls_pcert_st ** pcerts,
+			    unsigned int *pcert_length,
+			    gnutls_privkey_t * privkey)
+{
+	mgs_handle_t *ctxt;
+
+	_gnutls_log(debug_log_fp, "%s: %d\n", __func__, __LINE__);
+	ctxt = gnutls_transport_get_ptr(session);
+
+	if (ctxt == NULL)
+		return GNUTLS_E_INTERNAL_ERROR;
+
+	/* The chain and key were prepared in load_certificates(), GnuTLS
+	 * only copies the encoded certificates into the handshake. The
+	 * connection holds on to them, a reload may replace them in the
+	 * meantime.
+	 */
+	if (gnutls_certificate_type_get(session) == GNUTLS_CRT_X509
+	    && (ctxt->sc->certs_pcert != NULL || ctxt->sc->cred_lazy)) {
+		mgs_credentials_release(ctxt->cred);
+		ctxt->cred = mgs_credentials_acquire(ctxt->sc);
+		if (ctxt->cred == NULL)
+			return GNUTLS_E_INTERNAL_ERROR;
+
+		*pcerts = ctxt->cred->certs_pcert;
+		*pcert_length = ctxt->cred->certs_x509_num;
+		*privkey = ctxt->cred->privkey;
+
+		return 0;
+	} else if (gnutls_certificate_type_get(session) ==
+		   GNUTLS_CRT_OPENPGP && ctxt->sc->cert_pgp_pcert != NULL) {
+		*pcerts = ctxt->sc->cert_pgp_pcert;
+		*pcert_length = 1;
+		*privkey = ctxt->sc->privkey_pgp_abs;
+
+		return 0;
+	}
+
+	return GNUTLS_E_INTERNAL_ERROR;
+}
+
+static apr_status_t cleanup_certificates(void *data)
+{
+	mgs_srvconf_rec *sc = data;
+	unsigned int i;
+
+	if (sc->certs_pcert != NULL) {
+		for (i = 0; i < sc->certs_x509_num; i++)
+			gnutls_pcert_deinit(&sc->certs_pcert[i]);
+		sc->certs_pcert = NULL;
+	}
+	if (sc->privkey != NULL) {
+		gnutls_privkey_deinit(sc->privkey);
+		sc->privkey = NULL;
+	}
+	if (sc->cert_pgp_pcert != NULL) {
+		gnutls_pcert_deinit(sc->cert_pgp_pcert);
+		sc->cert_pgp_pcert = NULL;
+	}
+	if (sc->privkey_pgp_abs != NULL) {
+		gnutls_privkey_deinit(sc->privkey_pgp_abs);
+		sc->privkey_pgp_abs = NULL;
+	}
+
+	return APR_SUCCESS;
+}
+
+/* Runs before cleanup_certificates() of a host that uses the chain and
+ * key of another one, so they are only released once
+ */
+static apr_status_t cleanup_shared_certificates(void *data)
+{
+	mgs_srvconf_rec *sc = data;
+
+	sc->certs_pcert = NULL;
+	sc->privkey = NULL;
+	return APR_SUCCESS;
+}
+
+/* Encode the certificates of the host once and wrap its keys for the
+ * retrieve callback. The parsed certificates stay around for the
+ * environment variables and OCSP. Hosts that got the same parsed chain
+ * and key from the credential files share the result.
+ */
+static int load_certificates(server_rec * s, apr_pool_t * p,
+			     mgs_srvconf_rec * sc)
+{
+	apr_hash_t *loaded = NULL;
+	mgs_srvconf_rec *first;
+	unsigned int i;
+	int ret = 0;
+
+	apr_pool_cleanup_register(p, sc, cleanup_certificates,
+				  apr_pool_cleanup_null);
+
+	apr_pool_userdata_get((void **) &loaded, "mgs_loaded_certificates",
+			      p);
+	if (loaded == NULL) {
+		loaded = apr_hash_make(p);
+		apr_pool_userdata_set(loaded, "mgs_loaded_certificates",
+				      apr_pool_cleanup_null, p);
+	}
+
+	/* keyed by the first certificate, chains parsed separately never
+	 * have one in common
+	 */
+	first = NULL;
+	if (sc->certs_x509_num > 0 && sc->key_server == NULL)
+		first = apr_hash_get(loaded, sc->certs_x509,
+				     sizeof(gnutls_x509_crt_t));
+	if (first != NULL && first->certs_x509 == sc->certs_x509
+	    && first->privkey_x509 == sc->privkey_x509) {
+		sc->certs_pcert = first->certs_pcert;
+		sc->privkey = first->privkey;
+		apr_pool_cleanup_register(p, sc, cleanup_shared_certificates,
+					  apr_pool_cleanup_null);
+	} else if (sc->certs_x509_num > 0
+		   && (sc->privkey_x509 != NULL || sc->key_server != NULL)) {
+		sc->certs_pcert = apr_pcalloc(p, sc->certs_x509_num *
+					      sizeof(gnutls_pcert_st));
+		for (i = 0; i < sc->certs_x509_num; i++) {
+			ret = gnutls_pcert_import_x509(&sc->certs_pcert[i],
+						       sc->certs_x509[i],
+						       0);
+			if (ret < 0) {
+				while (i-- > 0)
+					gnutls_pcert_deinit(&sc->
+							    certs_pcert[i]);
+				sc->certs_pcert = NULL;
+				goto error;
+			}
+		}
+
+		if (sc->key_server != NULL) {
+			ret = mgs_keyless_import(p, s, sc, &sc->privkey);
+		} else {
+			ret = gnutls_privkey_init(&sc->privkey);
+			if (ret == 0)
+				ret = gnutls_privkey_import_x509(sc->privkey,
+								 sc->
+								 privkey_x509,
+								 0);
+		}
+		if (ret < 0)
+			goto error;
+
+		if (sc->key_server == NULL)
+			apr_hash_set(loaded, sc->certs_x509,
+				     sizeof(gnutls_x509_crt_t), sc);
+	}
+
+	if (sc->cert_pgp != NULL && sc->privkey_pgp != NULL) {
+		sc->cert_pgp_pcert = apr_pcalloc(p, sizeof(gnutls_pcert_st));
+		ret = gnutls_pcert_import_openpgp(sc->cert_pgp_pcert,
+						  sc->cert_pgp, 0);
+		if (ret < 0) {
+			sc->cert_pgp_pcert = NULL;
+			goto error;
+		}
+
+		ret = gnutls_privkey_init(&sc->privkey_pgp_abs);
+		if (ret == 0)
+			ret = gnutls_privkey_import_openpgp(sc->
+							    privkey_pgp_abs,
+							    sc->privkey_pgp,
+							    0);
+		if (ret < 0)
+			goto error;
+	}
+
+	return 0;
+
+      error:
+	ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+		     "GnuTLS: Host '%s:%d': Failed to prepare the "
+		     "certificates: (%d) %s", s->server_hostname, s->port,
+		     ret, gnutls_strerror(ret));
+	return -1;
+}
+#else
 static int cert_retrieve_fn(gnutls_session_t session, gnutls_retr_st * ret)
 {
 	mgs_handle_t *ctxt;
@@ -240,6 +449,7 @@ static int cert_retrieve_fn(gnutls_session_t session, gnutls_retr_st * ret)
 
 	return GNUTLS_E_INTERNAL_ERROR;
 }
+#endif
 
 /* 2048-bit group parameters from SRP specification */
 const char static_dh_params[] = "-----BEGIN DH PARAMETERS-----\n"
@@ -256,8 +466,8 @@ const char static_dh_params[] = "-----BEGIN DH PARAMETERS-----\n"
  *
  * Returns negative on error.
  */
-static int read_crt_cn(server_rec * s, apr_pool_t * p,
-		       gnutls_x509_crt_t cert, char **cert_cn)
+int mgs_read_crt_cn(server_rec * s, apr_pool_t * p,
+		    gnutls_x509_crt_t cert, char **cert_cn)
 {
 	int rv = 0, i;
 	size_t data_len;
@@ -310,6 +520,250 @@ static int read_crt_cn(server_rec * s, apr_pool_t * p,
 	return rv;
 }
 
+#if GNUTLS_VERSION_NUMBER >= 0x030500
+/* Set when the CPU of the server has AES instructions */
+static int cpu_has_aes;
+/* Set when any virtual host uses GnuTLSAdaptiveCipherOrder, so the
+ * ClientHello of each session has to be inspected
+ */
+static int client_hello_hook_needed;
+
+static const char *aes_gcm_ciphers[] = {
+	"AES-128-GCM", "AES-256-GCM", NULL
+};
+
+static const char *chacha_ciphers[] = {
+	"CHACHA20-POLY1305", NULL
+};
+
+static int detect_cpu_aes(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return 0;
+	return (ecx & bit_AES) != 0;
+#elif defined(__linux__) && defined(__aarch64__)
+	return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+#else
+	return 0;
+#endif
+}
+
+static int cipher_in_list(const char *name, const char **list)
+{
+	int i;
+
+	for (i = 0; list[i] != NULL; i++) {
+		if (strcasecmp(name, list[i]) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Build the priority string modifiers that move the ciphers in first
+ * ahead of the rest of the ciphers enabled in prio, keeping their
+ * relative order, and make the server order take precedence.
+ */
+static const char *cipher_order_str(apr_pool_t * p,
+				    gnutls_priority_t prio,
+				    const char **first)
+{
+	const unsigned int *list;
+	const char *name;
+	char *str = ":%SERVER_PRECEDENCE:-CIPHER-ALL";
+	int n, i, j;
+
+	n = gnutls_priority_cipher_list(prio, &list);
+	if (n < 0)
+		return NULL;
+
+	for (j = 0; first[j] != NULL; j++) {
+		for (i = 0; i < n; i++) {
+			name = gnutls_cipher_get_name(list[i]);
+			if (name != NULL && strcasecmp(name, first[j]) == 0)
+				str = apr_pstrcat(p, str, ":+", name, NULL);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		name = gnutls_cipher_get_name(list[i]);
+		if (name != NULL && !cipher_in_list(name, first))
+			str = apr_pstrcat(p, str, ":+", name, NULL);
+	}
+
+	return str;
+}
+
+/* Record whether the first cipher suite the client offers (ignoring
+ * GREASE values and signalling suites) is a ChaCha20-Poly1305 one,
+ * which clients without AES hardware do.
+ */
+static int mgs_client_hello_hook(gnutls_session_t session,
+				 unsigned int htype, unsigned when,
+				 unsigned int incoming,
+				 const gnutls_datum_t * msg)
+{
+	mgs_handle_t *ctxt = gnutls_transport_get_ptr(session);
+	const unsigned char *p = msg->data;
+	size_t pos, len, end;
+
+	if (ctxt == NULL || htype != GNUTLS_HANDSHAKE_CLIENT_HELLO
+	    || !incoming)
+		return 0;
+
+	ctxt->client_prefers_chacha = 0;
+
+	/* client_version, random, session_id */
+	pos = 2 + 32;
+	if (msg->size < pos + 1)
+		return 0;
+	pos += 1 + p[pos];
+
+	/* cipher_suites */
+	if (msg->size < pos + 2)
+		return 0;
+	len = (p[pos] << 8) | p[pos + 1];
+	pos += 2;
+	end = pos + len;
+	if (end > msg->size)
+		return 0;
+
+	for (; pos + 1 < end; pos += 2) {
+		/* GREASE */
+		if (p[pos] == p[pos + 1] && (p[pos] & 0x0f) == 0x0a)
+			continue;
+		/* TLS_EMPTY_RENEGOTIATION_INFO_SCSV, TLS_FALLBACK_SCSV */
+		if ((p[pos] == 0x00 && p[pos + 1] == 0xff)
+		    || (p[pos] == 0x56 && p[pos + 1] == 0x00))
+			continue;
+
+		ctxt->client_prefers_chacha =
+		    (p[pos] == 0xcc && p[pos + 1] >= 0xa8
+		     && p[pos + 1] <= 0xae)
+		    || (p[pos] == 0x13 && p[pos + 1] == 0x03);
+		break;
+	}
+
+	return 0;
+}
+#endif
+
+#if GNUTLS_VERSION_NUMBER >= 0x030400
+/* GnuTLS takes a single hook function per session. Full handshakes are
+ * admitted when the server hello goes out: by then GnuTLS has decided
+ * whether the session is resumed, which for session tickets and TLS 1.3
+ * PSKs is not known yet in the post client hello callback. Resumed
+ * handshakes are always admitted.
+ */
+static int mgs_handshake_hook(gnutls_session_t session,
+			      unsigned int htype, unsigned when,
+			      unsigned int incoming,
+			      const gnutls_datum_t * msg)
+{
+	mgs_handle_t *ctxt = gnutls_transport_get_ptr(session);
+
+	if (ctxt == NULL)
+		return 0;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030500
+	if (htype == GNUTLS_HANDSHAKE_CLIENT_HELLO && client_hello_hook_needed)
+		return mgs_client_hello_hook(session, htype, when, incoming,
+					     msg);
+#endif
+
+	if (htype == GNUTLS_HANDSHAKE_SERVER_HELLO && !incoming)
+		return mgs_limit_full_handshake(ctxt);
+
+	return 0;
+}
+#endif
+
+/* Rebuild the priority cache of a virtual host from its GnuTLSPriorities
+ * string, since the directives that modify it may appear in any order:
+ * the curve preference of GnuTLSECDHCurves is appended and, with
+ * GnuTLSAdaptiveCipherOrder, a server ordered cache is built for each of
+ * AES-GCM and ChaCha20-Poly1305 first.
+ *
+ * Returns negative on error.
+ */
+static int load_priorities(server_rec * s, apr_pool_t * p,
+			   mgs_srvconf_rec * sc)
+{
+	int rv;
+	const char *err;
+	const char *prio;
+
+	if (sc->priorities_str == NULL)
+		return 0;
+
+	if (sc->ecdh_curves != NULL) {
+		prio = apr_pstrcat(p, sc->priorities_str, sc->ecdh_curves,
+				   NULL);
+
+		gnutls_priority_deinit(sc->priorities);
+		sc->priorities = NULL;
+
+		rv = gnutls_priority_init(&sc->priorities, prio, &err);
+		if (rv < 0) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+				     "GnuTLS: Host '%s:%d' has invalid ECDHE "
+				     "curve priorities at '%s': (%d) %s",
+				     s->server_hostname, s->port, err, rv,
+				     gnutls_strerror(rv));
+			return rv;
+		}
+	} else {
+		prio = sc->priorities_str;
+	}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030500
+	if (sc->adaptive_cipher_order == GNUTLS_ENABLED_TRUE) {
+		const char *aes_prio, *chacha_prio;
+
+		aes_prio = cipher_order_str(p, sc->priorities,
+					    aes_gcm_ciphers);
+		chacha_prio = cipher_order_str(p, sc->priorities,
+					       chacha_ciphers);
+		if (aes_prio == NULL || chacha_prio == NULL) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+				     "GnuTLS: Host '%s:%d': Cannot list the "
+				     "ciphers of the priorities for "
+				     "GnuTLSAdaptiveCipherOrder",
+				     s->server_hostname, s->port);
+			return -1;
+		}
+
+		gnutls_priority_deinit(sc->priorities);
+		sc->priorities = NULL;
+
+		rv = gnutls_priority_init(&sc->priorities,
+					  apr_pstrcat(p, prio,
+						      cpu_has_aes ? aes_prio :
+						      chacha_prio, NULL),
+					  &err);
+		if (rv >= 0)
+			rv = gnutls_priority_init(&sc->priorities_chacha,
+						  apr_pstrcat(p, prio,
+							      chacha_prio,
+							      NULL), &err);
+		if (rv < 0) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+				     "GnuTLS: Host '%s:%d': Failed to order "
+				     "ciphers at '%s': (%d) %s",
+				     s->server_hostname, s->port, err, rv,
+				     gnutls_strerror(rv));
+			return rv;
+		}
+
+		client_hello_hook_needed = 1;
+	}
+#endif
+
+	return 0;
+}
+
 static int read_pgpcrt_cn(server_rec * s, apr_pool_t * p,
 			  gnutls_openpgp_crt_t cert, char **cert_cn)
 {
@@ -393,6 +847,11 @@ mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog,
 	/* else not an error but RSA-EXPORT ciphersuites are not available 
 	 */
 
+#if GNUTLS_VERSION_NUMBER >= 0x030500
+	cpu_has_aes = detect_cpu_aes();
+	client_hello_hook_needed = 0;
+#endif
+
 	rv = mgs_cache_post_config(p, s, sc_base);
 	if (rv != 0) {
 		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, s,
@@ -401,12 +860,21 @@ mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog,
 		exit(-1);
 	}
 
+	rv = mgs_credentials_post_config(p, base_server);
+	if (rv != 0) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Post Config for the credential files "
+			     "Failed. Shutting Down.");
+		exit(-1);
+	}
+
 	for (s = base_server; s; s = s->next) {
 		void *load = NULL;
 		sc = (mgs_srvconf_rec *)
 		    ap_get_module_config(s->module_config, &gnutls_module);
 		sc->cache_type = sc_base->cache_type;
 		sc->cache_config = sc_base->cache_config;
+		sc->reload_interval = sc_base->reload_interval;
 
 		/* Check if the priorities have been set */
 		if (sc->priorities == NULL
@@ -417,6 +885,26 @@ mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog,
 			exit(-1);
 		}
 
+		if (sc->enabled == GNUTLS_ENABLED_TRUE
+		    && load_priorities(s, p, sc) < 0) {
+			exit(-1);
+		}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030500
+		if (sc->enabled == GNUTLS_ENABLED_TRUE
+		    && sc->adaptive_cipher_order == GNUTLS_ENABLED_TRUE) {
+			ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+				     "GnuTLS: Host '%s:%d' prefers %s; "
+				     "ChaCha20-Poly1305 for clients that "
+				     "ask for it first",
+				     s->server_hostname, s->port,
+				     cpu_has_aes ? "AES-GCM (AES "
+				     "instructions available)" :
+				     "ChaCha20-Poly1305 (no AES "
+				     "instructions)");
+		}
+#endif
+
 		/* Check if DH or RSA params have been set per host */
 		if (sc->rsa_params != NULL)
 			load = sc->rsa_params;
@@ -440,8 +928,13 @@ mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog,
 							 load);
 		}
 
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+		gnutls_certificate_set_retrieve_function2(sc->certs,
+							  cert_retrieve_fn);
+#else
 		gnutls_certificate_server_set_retrieve_function(sc->certs,
 								cert_retrieve_fn);
+#endif
 
 #ifdef ENABLE_SRP
 		if (sc->srp_tpasswd_conf_file != NULL
@@ -464,8 +957,8 @@ mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog,
 		}
 #endif
 
-		if (sc->certs_x509[0] == NULL &&
-		    sc->cert_pgp == NULL &&
+		if (sc->certs_x509_num == 0 &&
+		    sc->cert_pgp == NULL && !sc->cred_lazy &&
 		    sc->enabled == GNUTLS_ENABLED_TRUE) {
 			ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
 				     "[GnuTLS] - Host '%s:%d' is missing a "
@@ -475,8 +968,9 @@ mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog,
 		}
 
 		if (sc->enabled == GNUTLS_ENABLED_TRUE &&
-		    ((sc->certs_x509[0] != NULL
-		      && sc->privkey_x509 == NULL) || (sc->cert_pgp != NULL
+		    ((sc->certs_x509_num > 0
+		      && sc->privkey_x509 == NULL
+		      && sc->key_server == NULL) || (sc->cert_pgp != NULL
 						       && sc->privkey_pgp
 						       == NULL))) {
 			ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
@@ -486,9 +980,23 @@ mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog,
 			exit(-1);
 		}
 
-		if (sc->enabled == GNUTLS_ENABLED_TRUE) {
-			rv = read_crt_cn(s, p, sc->certs_x509[0],
-					 &sc->cert_cn);
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+		if (sc->enabled == GNUTLS_ENABLED_TRUE
+		    && load_certificates(s, p, sc) < 0) {
+			exit(-1);
+		}
+#endif
+
+		/* the certificate of a host loaded on demand is not known
+		 * yet, SNI matches its ServerName and ServerAlias instead
+		 */
+		if (sc->enabled == GNUTLS_ENABLED_TRUE && !sc->cred_lazy) {
+			rv = -1;
+			if (sc->cert_cn != NULL)
+				rv = 0;
+			else if (sc->certs_x509_num > 0)
+				rv = mgs_read_crt_cn(s, p, sc->certs_x509[0],
+						     &sc->cert_cn);
 			if (rv < 0 && sc->cert_pgp != NULL)	/* try openpgp certificate */
 				rv = read_pgpcrt_cn(s, p, sc->cert_pgp,
 						    &sc->cert_cn);
@@ -501,9 +1009,67 @@ mgs_hook_post_config(apr_pool_t * p, apr_pool_t * plog,
 				sc->cert_cn = NULL;
 				continue;
 			}
+
+			/* the SSL_SERVER_* variables never change, unless
+			 * the certificate is reloaded
+			 */
+			if (sc->certs_x509_num > 0)
+				sc->server_env_x509 =
+				    mgs_server_env_x509(p, sc,
+							sc->certs_x509[0]);
+			if (sc->cert_pgp != NULL) {
+				sc->server_env_pgp = apr_table_make(p, 16);
+				mgs_add_common_pgpcert_vars(sc->
+							    server_env_pgp, p,
+							    sc->cert_pgp, 0,
+							    sc->
+							    export_certificates_enabled);
+			}
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+			mgs_credentials_init(p, sc);
+#endif
 		}
 	}
 
+	rv = mgs_limit_post_config(p, base_server);
+	if (rv != 0) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Post Config for GnuTLSMaxFullHandshakes "
+			     "Failed. Shutting Down.");
+		exit(-1);
+	}
+
+	rv = mgs_ocsp_post_config(p, base_server);
+	if (rv != 0) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Post Config for OCSP stapling Failed."
+			     " Shutting Down.");
+		exit(-1);
+	}
+
+	rv = mgs_ca_path_post_config(p, base_server);
+	if (rv != 0) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Post Config for GnuTLSClientCAPath "
+			     "Failed. Shutting Down.");
+		exit(-1);
+	}
+
+	rv = mgs_crl_post_config(p, base_server);
+	if (rv != 0) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Post Config for GnuTLSX509CRLFile "
+			     "Failed. Shutting Down.");
+		exit(-1);
+	}
+
+	rv = mgs_verify_cache_post_config(p, base_server);
+	if (rv != 0) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Post Config for GnuTLSVerifyCacheSize "
+			     "Failed. Shutting Down.");
+		exit(-1);
+	}
 
 	ap_add_version_component(p, "mod_gnutls/" MOD_GNUTLS_VERSION);
 
@@ -524,6 +1090,16 @@ void mgs_hook_child_init(apr_pool_t * p, server_rec * s)
 				     "[GnuTLS] - Failed to run Cache Init");
 		}
 	}
+
+	mgs_limit_child_init(p, s);
+	mgs_ocsp_child_init(p, s);
+	mgs_keyless_child_init(p, s);
+	mgs_verify_cache_child_init(p, s);
+	mgs_crl_child_init(p, s);
+	mgs_ca_path_child_init(p, s);
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+	mgs_credentials_child_init(p, s);
+#endif
 }
 
 const char *mgs_hook_http_scheme(const request_rec * r)
@@ -566,6 +1142,37 @@ apr_port_t mgs_hook_default_port(const request_rec * r)
 
 #define MAX_HOST_LEN 255
 
+/* Whether the host tsc of s is the one asked for by SNI */
+static int sni_matches(server_rec * s, mgs_srvconf_rec * tsc,
+		       const char *name)
+{
+	char **names;
+	int i;
+
+	/* The CN can contain a * -- this will match those too. */
+	if (tsc->cert_cn != NULL)
+		return ap_strcasecmp_match(name, tsc->cert_cn) == 0;
+	if (!tsc->cred_lazy)
+		return 0;
+
+	if (s->server_hostname != NULL
+	    && strcasecmp(name, s->server_hostname) == 0)
+		return 1;
+	if (s->names != NULL) {
+		names = (char **) s->names->elts;
+		for (i = 0; i < s->names->nelts; i++)
+			if (strcasecmp(name, names[i]) == 0)
+				return 1;
+	}
+	if (s->wild_names != NULL) {
+		names = (char **) s->wild_names->elts;
+		for (i = 0; i < s->wild_names->nelts; i++)
+			if (ap_strcasecmp_match(name, names[i]) == 0)
+				return 1;
+	}
+	return 0;
+}
+
 #if USING_2_1_RECENT
 typedef struct {
 	mgs_handle_t *ctxt;
@@ -582,12 +1189,11 @@ static int vhost_cb(void *baton, conn_rec * conn, server_rec * s)
 	tsc = (mgs_srvconf_rec *) ap_get_module_config(s->module_config,
 						       &gnutls_module);
 
-	if (tsc->enabled != GNUTLS_ENABLED_TRUE || tsc->cert_cn == NULL) {
+	if (tsc->enabled != GNUTLS_ENABLED_TRUE) {
 		return 0;
 	}
 
-	/* The CN can contain a * -- this will match those too. */
-	if (ap_strcasecmp_match(x->sni_name, tsc->cert_cn) == 0) {
+	if (sni_matches(s, tsc, x->sni_name)) {
 		/* found a match */
 #if MOD_GNUTLS_DEBUG
 		ap_log_error(APLOG_MARK, APLOG_DEBUG, 0,
@@ -684,8 +1290,7 @@ mgs_srvconf_rec *mgs_find_sni_server(gnutls_session_t session)
 			      (ctxt->sc->privkey_x509)), (unsigned int) s,
 			     (unsigned int) s->next, (unsigned int) tsc);
 #endif
-		/* The CN can contain a * -- this will match those too. */
-		if (ap_strcasecmp_match(sni_name, tsc->cert_cn) == 0) {
+		if (sni_matches(s, tsc, sni_name)) {
 #if MOD_GNUTLS_DEBUG
 			ap_log_error(APLOG_MARK, APLOG_DEBUG, 0,
 				     ctxt->c->base_server,
@@ -701,11 +1306,42 @@ mgs_srvconf_rec *mgs_find_sni_server(gnutls_session_t session)
 }
 
 
+const char *mgs_session_kx_group(gnutls_session_t session)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+	gnutls_group_t group = gnutls_group_get(session);
+
+	if (group == GNUTLS_GROUP_INVALID)
+		return NULL;
+	return gnutls_group_get_name(group);
+#elif GNUTLS_VERSION_NUMBER >= 0x030000
+	gnutls_ecc_curve_t curve = gnutls_ecc_curve_get(session);
+
+	if (curve == GNUTLS_ECC_CURVE_INVALID)
+		return NULL;
+	return gnutls_ecc_curve_get_name(curve);
+#else
+	return NULL;
+#endif
+}
+
+
 static const int protocol_priority[] = {
 	GNUTLS_TLS1_1, GNUTLS_TLS1_0, GNUTLS_SSL3, 0
 };
 
 
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+static apr_status_t mgs_cred_conn_cleanup(void *data)
+{
+	mgs_handle_t *ctxt = data;
+
+	mgs_credentials_release(ctxt->cred);
+	ctxt->cred = NULL;
+	return APR_SUCCESS;
+}
+#endif
+
 static mgs_handle_t *create_gnutls_handle(apr_pool_t * pool, conn_rec * c)
 {
 	mgs_handle_t *ctxt;
@@ -729,6 +1365,12 @@ static mgs_handle_t *create_gnutls_handle(apr_pool_t * pool, conn_rec * c)
 	ctxt->output_blen = 0;
 	ctxt->output_length = 0;
 
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+	ctxt->cred = NULL;
+	apr_pool_cleanup_register(c->pool, ctxt, mgs_cred_conn_cleanup,
+				  apr_pool_cleanup_null);
+#endif
+
 	gnutls_init(&ctxt->session, GNUTLS_SERVER);
 	if (session_ticket_key.data != NULL && ctxt->sc->tickets != 0)
 		gnutls_session_ticket_enable_server(ctxt->session,
@@ -743,6 +1385,13 @@ static mgs_handle_t *create_gnutls_handle(apr_pool_t * pool, conn_rec * c)
 	gnutls_handshake_set_post_client_hello_function(ctxt->session,
 							mgs_select_virtual_server_cb);
 
+#if GNUTLS_VERSION_NUMBER >= 0x030400
+	gnutls_handshake_set_hook_function(ctxt->session,
+					   GNUTLS_HANDSHAKE_ANY,
+					   GNUTLS_HOOK_PRE,
+					   mgs_handshake_hook);
+#endif
+
 	mgs_cache_session_init(ctxt);
 
 	return ctxt;
@@ -788,12 +1437,185 @@ int mgs_hook_pre_connection(conn_rec * c, void *csd)
 	return OK;
 }
 
-int mgs_hook_fixups(request_rec * r)
+/* The SSL_* variables of the session, computed on demand. NULL when a
+ * variable does not apply.
+ */
+typedef const char *(*mgs_var_fn) (apr_pool_t * p, mgs_handle_t * ctxt);
+
+static const char *mgs_var_version_library(apr_pool_t * p,
+					   mgs_handle_t * ctxt)
+{
+	return "GnuTLS/" LIBGNUTLS_VERSION;
+}
+
+static const char *mgs_var_version_interface(apr_pool_t * p,
+					     mgs_handle_t * ctxt)
+{
+	return "mod_gnutls/" MOD_GNUTLS_VERSION;
+}
+
+static const char *mgs_var_protocol(apr_pool_t * p, mgs_handle_t * ctxt)
+{
+	return gnutls_protocol_get_name(gnutls_protocol_get_version
+					(ctxt->session));
+}
+
+static const char *mgs_var_cipher(apr_pool_t * p, mgs_handle_t * ctxt)
+{
+	/* should have been called SSL_CIPHERSUITE instead */
+	return gnutls_cipher_suite_get_name(gnutls_kx_get(ctxt->session),
+					    gnutls_cipher_get(ctxt->session),
+					    gnutls_mac_get(ctxt->session));
+}
+
+static const char *mgs_var_key_exchange(apr_pool_t * p,
+					mgs_handle_t * ctxt)
+{
+	const char *tmp = gnutls_kx_get_name(gnutls_kx_get(ctxt->session));
+
+	return (tmp != NULL) ? tmp : "";
+}
+
+static const char *mgs_var_key_exchange_group(apr_pool_t * p,
+					      mgs_handle_t * ctxt)
+{
+	return mgs_session_kx_group(ctxt->session);
+}
+
+static const char *mgs_var_compress_method(apr_pool_t * p,
+					   mgs_handle_t * ctxt)
+{
+	return gnutls_compression_get_name(gnutls_compression_get
+					   (ctxt->session));
+}
+
+#ifdef ENABLE_SRP
+static const char *mgs_var_srp_user(apr_pool_t * p, mgs_handle_t * ctxt)
+{
+	const char *tmp = gnutls_srp_server_get_username(ctxt->session);
+
+	return (tmp != NULL) ? tmp : "";
+}
+#endif
+
+static const char *mgs_var_cipher_keysize(apr_pool_t * p,
+					  mgs_handle_t * ctxt)
+{
+	return apr_psprintf(p, "%u", 8 *
+			    (unsigned int)
+			    gnutls_cipher_get_key_size(gnutls_cipher_get
+						       (ctxt->session)));
+}
+
+static const char *mgs_var_cipher_export(apr_pool_t * p,
+					 mgs_handle_t * ctxt)
+{
+	return (8 * gnutls_cipher_get_key_size(gnutls_cipher_get
+					       (ctxt->session)) <= 40) ?
+	    "true" : "false";
+}
+
+static const char *mgs_var_session_id(apr_pool_t * p, mgs_handle_t * ctxt)
 {
 	unsigned char sbuf[GNUTLS_MAX_SESSION_ID];
-	char buf[AP_IOBUFSIZE];
+	char buf[GNUTLS_SESSION_ID_STRING_LEN];
+	size_t len = sizeof(sbuf);
+
+	gnutls_session_get_id(ctxt->session, sbuf, &len);
+	return apr_pstrdup(p, mgs_session_id2sz(sbuf, len, buf, sizeof(buf)));
+}
+
+static const struct {
+	const char *name;
+	mgs_var_fn fn;
+} mgs_session_vars[] = {
+	{"SSL_VERSION_LIBRARY", mgs_var_version_library},
+	{"SSL_VERSION_INTERFACE", mgs_var_version_interface},
+	{"SSL_PROTOCOL", mgs_var_protocol},
+	{"SSL_CIPHER", mgs_var_cipher},
+	{"SSL_KEY_EXCHANGE", mgs_var_key_exchange},
+	{"SSL_KEY_EXCHANGE_GROUP", mgs_var_key_exchange_group},
+	{"SSL_COMPRESS_METHOD", mgs_var_compress_method},
+#ifdef ENABLE_SRP
+	{"SSL_SRP_USER", mgs_var_srp_user},
+#endif
+	{"SSL_CIPHER_USEKEYSIZE", mgs_var_cipher_keysize},
+	{"SSL_CIPHER_ALGKEYSIZE", mgs_var_cipher_keysize},
+	{"SSL_CIPHER_EXPORT", mgs_var_cipher_export},
+	{"SSL_SESSION_ID", mgs_var_session_id},
+	{NULL, NULL}
+};
+
+/* The variables of mgs_session_vars for the current handshake */
+static apr_table_t *mgs_session_env(mgs_handle_t * ctxt)
+{
 	const char *tmp;
-	size_t len;
+	int i;
+
+	if (ctxt->session_env != NULL)
+		return ctxt->session_env;
+
+	ctxt->session_env = apr_table_make(ctxt->c->pool, 16);
+	for (i = 0; mgs_session_vars[i].name != NULL; i++) {
+		tmp = mgs_session_vars[i].fn(ctxt->c->pool, ctxt);
+		if (tmp != NULL)
+			apr_table_setn(ctxt->session_env,
+				       mgs_session_vars[i].name, tmp);
+	}
+	return ctxt->session_env;
+}
+
+/* SSL_CLIENT_V_REMAIN, the days the client certificate is still valid,
+ * or NULL. Formatted again only when the number changes.
+ */
+static const char *mgs_client_v_remain(mgs_handle_t * ctxt)
+{
+	unsigned long remain;
+
+	if (!ctxt->client_verified || ctxt->client_expiration == 0)
+		return NULL;
+
+	remain = (apr_time_sec(ctxt->client_expiration) -
+		  apr_time_sec(apr_time_now())) / 86400;
+	if (ctxt->client_remain_str == NULL
+	    || ctxt->client_remain != remain) {
+		ctxt->client_remain = remain;
+		ctxt->client_remain_str =
+		    apr_psprintf(ctxt->c->pool, "%lu", remain);
+	}
+	return ctxt->client_remain_str;
+}
+
+/* Whether the fixups export the SSL_* variables for the handler of r */
+static int mgs_export_env(request_rec * r, mgs_srvconf_rec * sc)
+{
+	const char **handlers;
+	int i;
+
+	if (sc->export_env_handlers == NULL)
+		return 1;
+	if (r->handler == NULL)
+		return 0;
+
+	handlers = (const char **) sc->export_env_handlers->elts;
+	for (i = 0; i < sc->export_env_handlers->nelts; i++)
+		if (strcasecmp(handlers[i], r->handler) == 0)
+			return 1;
+	return 0;
+}
+
+/* The SSL_SERVER_* variables of the X.509 chain sent to the client */
+static apr_table_t *server_env_x509(mgs_handle_t * ctxt)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+	if (ctxt->cred != NULL)
+		return ctxt->cred->server_env;
+#endif
+	return ctxt->sc->server_env_x509;
+}
+
+int mgs_hook_fixups(request_rec * r)
+{
 	mgs_handle_t *ctxt;
 	int rv = OK;
 
@@ -813,64 +1635,115 @@ int mgs_hook_fixups(request_rec * r)
 
 	apr_table_setn(env, "HTTPS", "on");
 
-	apr_table_setn(env, "SSL_VERSION_LIBRARY",
-		       "GnuTLS/" LIBGNUTLS_VERSION);
-	apr_table_setn(env, "SSL_VERSION_INTERFACE",
-		       "mod_gnutls/" MOD_GNUTLS_VERSION);
+	/* everybody else can ask ssl_var_lookup */
+	if (!mgs_export_env(r, ctxt->sc))
+		return rv;
 
-	apr_table_setn(env, "SSL_PROTOCOL",
-		       gnutls_protocol_get_name(gnutls_protocol_get_version
-						(ctxt->session)));
-
-	/* should have been called SSL_CIPHERSUITE instead */
-	apr_table_setn(env, "SSL_CIPHER",
-		       gnutls_cipher_suite_get_name(gnutls_kx_get
-						    (ctxt->session),
-						    gnutls_cipher_get
-						    (ctxt->session),
-						    gnutls_mac_get
-						    (ctxt->session)));
-
-	apr_table_setn(env, "SSL_COMPRESS_METHOD",
-		       gnutls_compression_get_name(gnutls_compression_get
-						   (ctxt->session)));
-
-#ifdef ENABLE_SRP
-	tmp = gnutls_srp_server_get_username(ctxt->session);
-	apr_table_setn(env, "SSL_SRP_USER", (tmp != NULL) ? tmp : "");
-#endif
+	/* formatted once per handshake, the strings are not copied */
+	apr_table_overlap(env, mgs_session_env(ctxt), APR_OVERLAP_TABLES_SET);
 
 	if (apr_table_get(env, "SSL_CLIENT_VERIFY") == NULL)
 		apr_table_setn(env, "SSL_CLIENT_VERIFY", "NONE");
 
-	unsigned int key_size =
-	    8 *
-	    gnutls_cipher_get_key_size(gnutls_cipher_get(ctxt->session));
-	tmp = apr_psprintf(r->pool, "%u", key_size);
+	/* computed at startup or reload, the strings are not copied */
+	if (gnutls_certificate_type_get(ctxt->session) == GNUTLS_CRT_X509
+	    && server_env_x509(ctxt) != NULL)
+		apr_table_overlap(env, server_env_x509(ctxt),
+				  APR_OVERLAP_TABLES_SET);
+	else if (gnutls_certificate_type_get(ctxt->session) ==
+		 GNUTLS_CRT_OPENPGP && ctxt->sc->server_env_pgp != NULL)
+		apr_table_overlap(env, ctxt->sc->server_env_pgp,
+				  APR_OVERLAP_TABLES_SET);
 
-	apr_table_setn(env, "SSL_CIPHER_USEKEYSIZE", tmp);
+	return rv;
+}
 
-	apr_table_setn(env, "SSL_CIPHER_ALGKEYSIZE", tmp);
+/* The functions of mod_ssl or another module registered under the same
+ * names before us, asked about the connections we do not handle
+ */
+static APR_OPTIONAL_FN_TYPE(ssl_is_https) * next_is_https = NULL;
+static APR_OPTIONAL_FN_TYPE(ssl_var_lookup) * next_var_lookup = NULL;
 
-	apr_table_setn(env, "SSL_CIPHER_EXPORT",
-		       (key_size <= 40) ? "true" : "false");
+void mgs_register_ssl_fns(void)
+{
+	APR_OPTIONAL_FN_TYPE(ssl_is_https) * is_https =
+		APR_RETRIEVE_OPTIONAL_FN(ssl_is_https);
+	APR_OPTIONAL_FN_TYPE(ssl_var_lookup) * var_lookup =
+		APR_RETRIEVE_OPTIONAL_FN(ssl_var_lookup);
+
+	if (is_https != mgs_is_https) {
+		next_is_https = is_https;
+		apr_dynamic_fn_register("ssl_is_https",
+					(apr_opt_fn_t *) mgs_is_https);
+	}
+	if (var_lookup != mgs_var_lookup) {
+		next_var_lookup = var_lookup;
+		apr_dynamic_fn_register("ssl_var_lookup",
+					(apr_opt_fn_t *) mgs_var_lookup);
+	}
+}
 
-	len = sizeof(sbuf);
-	gnutls_session_get_id(ctxt->session, sbuf, &len);
-	tmp = mgs_session_id2sz(sbuf, len, buf, sizeof(buf));
-	apr_table_setn(env, "SSL_SESSION_ID", apr_pstrdup(r->pool, tmp));
+/* Whether mod_gnutls handles TLS on the connection c */
+static int mgs_handles(conn_rec * c)
+{
+	mgs_handle_t *ctxt;
 
-	if (gnutls_certificate_type_get(ctxt->session) == GNUTLS_CRT_X509)
-		mgs_add_common_cert_vars(r, ctxt->sc->certs_x509[0], 0,
-					 ctxt->
-					 sc->export_certificates_enabled);
-	else if (gnutls_certificate_type_get(ctxt->session) ==
-		 GNUTLS_CRT_OPENPGP)
-		mgs_add_common_pgpcert_vars(r, ctxt->sc->cert_pgp, 0,
-					    ctxt->
-					    sc->export_certificates_enabled);
+	if (c == NULL)
+		return 0;
+	ctxt = ap_get_module_config(c->conn_config, &gnutls_module);
+	return ctxt != NULL && ctxt->session != NULL;
+}
 
-	return rv;
+int mgs_is_https(conn_rec * c)
+{
+	if (mgs_handles(c))
+		return 1;
+	if (next_is_https != NULL && c != NULL)
+		return next_is_https(c);
+	return 0;
+}
+
+char *mgs_var_lookup(apr_pool_t * p, server_rec * s, conn_rec * c,
+		     request_rec * r, char *var)
+{
+	mgs_handle_t *ctxt;
+	apr_table_t *server_env;
+	const char *val = NULL;
+
+	if (c == NULL && r != NULL)
+		c = r->connection;
+	if (c == NULL || var == NULL)
+		return "";
+
+	if (!mgs_handles(c) && next_var_lookup != NULL)
+		return next_var_lookup(p, s, c, r, var);
+	if (strcasecmp(var, "HTTPS") == 0)
+		return mgs_handles(c) ? "on" : "off";
+	if (!mgs_handles(c))
+		return "";
+
+	ctxt = ap_get_module_config(c->conn_config, &gnutls_module);
+
+	if (strncasecmp(var, "SSL_SERVER_", 11) == 0) {
+		if (gnutls_certificate_type_get(ctxt->session) ==
+		    GNUTLS_CRT_OPENPGP)
+			server_env = ctxt->sc->server_env_pgp;
+		else
+			server_env = server_env_x509(ctxt);
+		if (server_env != NULL)
+			val = apr_table_get(server_env, var);
+	} else if (strncasecmp(var, "SSL_CLIENT_", 11) == 0) {
+		/* these exist once mgs_cert_verify has run */
+		if (strcasecmp(var, "SSL_CLIENT_V_REMAIN") == 0)
+			val = mgs_client_v_remain(ctxt);
+		else if (ctxt->client_verified)
+			val = apr_table_get(ctxt->client_env, var);
+		if (val == NULL && strcasecmp(var, "SSL_CLIENT_VERIFY") == 0)
+			val = "NONE";
+	} else
+		val = apr_table_get(mgs_session_env(ctxt), var);
+
+	return val != NULL ? apr_pstrdup(p, val) : "";
 }
 
 int mgs_hook_authz(request_rec * r)
@@ -940,11 +1813,22 @@ int mgs_hook_authz(request_rec * r)
  * SSL_SERVER_CERT 	string 	PEM-encoded client certificate
  */
 
+apr_table_t *mgs_server_env_x509(apr_pool_t * p, mgs_srvconf_rec * sc,
+				 gnutls_x509_crt_t cert)
+{
+	apr_table_t *env = apr_table_make(p, 16);
+
+	mgs_add_common_cert_vars(env, p, cert, 0,
+				 sc->export_certificates_enabled);
+	return env;
+}
+
 /* side is either 0 for SERVER or 1 for CLIENT
  */
 #define MGS_SIDE ((side==0)?"SSL_SERVER":"SSL_CLIENT")
 static void
-mgs_add_common_cert_vars(request_rec * r, gnutls_x509_crt_t cert, int side,
+mgs_add_common_cert_vars(apr_table_t * env, apr_pool_t * pool,
+			 gnutls_x509_crt_t cert, int side,
 			 int export_certificates_enabled)
 {
 	unsigned char sbuf[64];	/* buffer to hold serials */
@@ -954,11 +1838,6 @@ mgs_add_common_cert_vars(request_rec * r, gnutls_x509_crt_t cert, int side,
 	size_t len;
 	int ret, i;
 
-	if (r == NULL)
-		return;
-
-	apr_table_t *env = r->subprocess_env;
-
 	_gnutls_log(debug_log_fp, "%s: %d\n", __func__, __LINE__);
 	if (export_certificates_enabled != 0) {
 		char cert_buf[10 * 1024];
@@ -967,58 +1846,58 @@ mgs_add_common_cert_vars(request_rec * r, gnutls_x509_crt_t cert, int side,
 		if (gnutls_x509_crt_export
 		    (cert, GNUTLS_X509_FMT_PEM, cert_buf, &len) >= 0)
 			apr_table_setn(env,
-				       apr_pstrcat(r->pool, MGS_SIDE,
+				       apr_pstrcat(pool, MGS_SIDE,
 						   "_CERT", NULL),
-				       apr_pstrmemdup(r->pool, cert_buf,
+				       apr_pstrmemdup(pool, cert_buf,
 						      len));
 
 	}
 
 	len = sizeof(buf);
 	gnutls_x509_crt_get_dn(cert, buf, &len);
-	apr_table_setn(env, apr_pstrcat(r->pool, MGS_SIDE, "_S_DN", NULL),
-		       apr_pstrmemdup(r->pool, buf, len));
+	apr_table_setn(env, apr_pstrcat(pool, MGS_SIDE, "_S_DN", NULL),
+		       apr_pstrmemdup(pool, buf, len));
 
 	len = sizeof(buf);
 	gnutls_x509_crt_get_issuer_dn(cert, buf, &len);
-	apr_table_setn(env, apr_pstrcat(r->pool, MGS_SIDE, "_I_DN", NULL),
-		       apr_pstrmemdup(r->pool, buf, len));
+	apr_table_setn(env, apr_pstrcat(pool, MGS_SIDE, "_I_DN", NULL),
+		       apr_pstrmemdup(pool, buf, len));
 
 	len = sizeof(sbuf);
 	gnutls_x509_crt_get_serial(cert, sbuf, &len);
 	tmp = mgs_session_id2sz(sbuf, len, buf, sizeof(buf));
 	apr_table_setn(env,
-		       apr_pstrcat(r->pool, MGS_SIDE, "_M_SERIAL", NULL),
-		       apr_pstrdup(r->pool, tmp));
+		       apr_pstrcat(pool, MGS_SIDE, "_M_SERIAL", NULL),
+		       apr_pstrdup(pool, tmp));
 
 	ret = gnutls_x509_crt_get_version(cert);
 	if (ret > 0)
 		apr_table_setn(env,
-			       apr_pstrcat(r->pool, MGS_SIDE, "_M_VERSION",
-					   NULL), apr_psprintf(r->pool,
+			       apr_pstrcat(pool, MGS_SIDE, "_M_VERSION",
+					   NULL), apr_psprintf(pool,
 							       "%u", ret));
 
 	apr_table_setn(env,
-		       apr_pstrcat(r->pool, MGS_SIDE, "_CERT_TYPE", NULL),
+		       apr_pstrcat(pool, MGS_SIDE, "_CERT_TYPE", NULL),
 		       "X.509");
 
 	tmp =
 	    mgs_time2sz(gnutls_x509_crt_get_expiration_time
 			(cert), buf, sizeof(buf));
-	apr_table_setn(env, apr_pstrcat(r->pool, MGS_SIDE, "_V_END", NULL),
-		       apr_pstrdup(r->pool, tmp));
+	apr_table_setn(env, apr_pstrcat(pool, MGS_SIDE, "_V_END", NULL),
+		       apr_pstrdup(pool, tmp));
 
 	tmp =
 	    mgs_time2sz(gnutls_x509_crt_get_activation_time
 			(cert), buf, sizeof(buf));
 	apr_table_setn(env,
-		       apr_pstrcat(r->pool, MGS_SIDE, "_V_START", NULL),
-		       apr_pstrdup(r->pool, tmp));
+		       apr_pstrcat(pool, MGS_SIDE, "_V_START", NULL),
+		       apr_pstrdup(pool, tmp));
 
 	ret = gnutls_x509_crt_get_signature_algorithm(cert);
 	if (ret >= 0) {
 		apr_table_setn(env,
-			       apr_pstrcat(r->pool, MGS_SIDE, "_A_SIG",
+			       apr_pstrcat(pool, MGS_SIDE, "_A_SIG",
 					   NULL),
 			       gnutls_sign_algorithm_get_name(ret));
 	}
@@ -1026,7 +1905,7 @@ mgs_add_common_cert_vars(request_rec * r, gnutls_x509_crt_t cert, int side,
 	ret = gnutls_x509_crt_get_pk_algorithm(cert, NULL);
 	if (ret >= 0) {
 		apr_table_setn(env,
-			       apr_pstrcat(r->pool, MGS_SIDE, "_A_KEY",
+			       apr_pstrcat(pool, MGS_SIDE, "_A_KEY",
 					   NULL),
 			       gnutls_pk_algorithm_get_name(ret));
 	}
@@ -1039,7 +1918,7 @@ mgs_add_common_cert_vars(request_rec * r, gnutls_x509_crt_t cert, int side,
 							   NULL);
 
 		if (ret == GNUTLS_E_SHORT_MEMORY_BUFFER && len > 1) {
-			tmp2 = apr_palloc(r->pool, len + 1);
+			tmp2 = apr_palloc(pool, len + 1);
 
 			ret =
 			    gnutls_x509_crt_get_subject_alt_name(cert, i,
@@ -1050,31 +1929,31 @@ mgs_add_common_cert_vars(request_rec * r, gnutls_x509_crt_t cert, int side,
 
 			if (ret == GNUTLS_SAN_DNSNAME) {
 				apr_table_setn(env,
-					       apr_psprintf(r->pool,
+					       apr_psprintf(pool,
 							    "%s_S_AN%u",
 							    MGS_SIDE, i),
-					       apr_psprintf(r->pool,
+					       apr_psprintf(pool,
 							    "DNSNAME:%s",
 							    tmp2));
 			} else if (ret == GNUTLS_SAN_RFC822NAME) {
 				apr_table_setn(env,
-					       apr_psprintf(r->pool,
+					       apr_psprintf(pool,
 							    "%s_S_AN%u",
 							    MGS_SIDE, i),
-					       apr_psprintf(r->pool,
+					       apr_psprintf(pool,
 							    "RFC822NAME:%s",
 							    tmp2));
 			} else if (ret == GNUTLS_SAN_URI) {
 				apr_table_setn(env,
-					       apr_psprintf(r->pool,
+					       apr_psprintf(pool,
 							    "%s_S_AN%u",
 							    MGS_SIDE, i),
-					       apr_psprintf(r->pool,
+					       apr_psprintf(pool,
 							    "URI:%s",
 							    tmp2));
 			} else {
 				apr_table_setn(env,
-					       apr_psprintf(r->pool,
+					       apr_psprintf(pool,
 							    "%s_S_AN%u",
 							    MGS_SIDE, i),
 					       "UNSUPPORTED");
@@ -1084,8 +1963,9 @@ mgs_add_common_cert_vars(request_rec * r, gnutls_x509_crt_t cert, int side,
 }
 
 static void
-mgs_add_common_pgpcert_vars(request_rec * r, gnutls_openpgp_crt_t cert,
-			    int side, int export_certificates_enabled)
+mgs_add_common_pgpcert_vars(apr_table_t * env, apr_pool_t * pool,
+			    gnutls_openpgp_crt_t cert, int side,
+			    int export_certificates_enabled)
 {
 	unsigned char sbuf[64];	/* buffer to hold serials */
 	char buf[AP_IOBUFSIZE];
@@ -1093,11 +1973,7 @@ mgs_add_common_pgpcert_vars(request_rec * r, gnutls_openpgp_crt_t cert,
 	size_t len;
 	int ret;
 
-	if (r == NULL)
-		return;
-
 	_gnutls_log(debug_log_fp, "%s: %d\n", __func__, __LINE__);
-	apr_table_t *env = r->subprocess_env;
 
 	if (export_certificates_enabled != 0) {
 		char cert_buf[10 * 1024];
@@ -1106,53 +1982,53 @@ mgs_add_common_pgpcert_vars(request_rec * r, gnutls_openpgp_crt_t cert,
 		if (gnutls_openpgp_crt_export
 		    (cert, GNUTLS_OPENPGP_FMT_BASE64, cert_buf, &len) >= 0)
 			apr_table_setn(env,
-				       apr_pstrcat(r->pool, MGS_SIDE,
+				       apr_pstrcat(pool, MGS_SIDE,
 						   "_CERT", NULL),
-				       apr_pstrmemdup(r->pool, cert_buf,
+				       apr_pstrmemdup(pool, cert_buf,
 						      len));
 
 	}
 
 	len = sizeof(buf);
 	gnutls_openpgp_crt_get_name(cert, 0, buf, &len);
-	apr_table_setn(env, apr_pstrcat(r->pool, MGS_SIDE, "_NAME", NULL),
-		       apr_pstrmemdup(r->pool, buf, len));
+	apr_table_setn(env, apr_pstrcat(pool, MGS_SIDE, "_NAME", NULL),
+		       apr_pstrmemdup(pool, buf, len));
 
 	len = sizeof(sbuf);
 	gnutls_openpgp_crt_get_fingerprint(cert, sbuf, &len);
 	tmp = mgs_session_id2sz(sbuf, len, buf, sizeof(buf));
 	apr_table_setn(env,
-		       apr_pstrcat(r->pool, MGS_SIDE, "_FINGERPRINT",
-				   NULL), apr_pstrdup(r->pool, tmp));
+		       apr_pstrcat(pool, MGS_SIDE, "_FINGERPRINT",
+				   NULL), apr_pstrdup(pool, tmp));
 
 	ret = gnutls_openpgp_crt_get_version(cert);
 	if (ret > 0)
 		apr_table_setn(env,
-			       apr_pstrcat(r->pool, MGS_SIDE, "_M_VERSION",
-					   NULL), apr_psprintf(r->pool,
+			       apr_pstrcat(pool, MGS_SIDE, "_M_VERSION",
+					   NULL), apr_psprintf(pool,
 							       "%u", ret));
 
 	apr_table_setn(env,
-		       apr_pstrcat(r->pool, MGS_SIDE, "_CERT_TYPE", NULL),
+		       apr_pstrcat(pool, MGS_SIDE, "_CERT_TYPE", NULL),
 		       "OPENPGP");
 
 	tmp =
 	    mgs_time2sz(gnutls_openpgp_crt_get_expiration_time
 			(cert), buf, sizeof(buf));
-	apr_table_setn(env, apr_pstrcat(r->pool, MGS_SIDE, "_V_END", NULL),
-		       apr_pstrdup(r->pool, tmp));
+	apr_table_setn(env, apr_pstrcat(pool, MGS_SIDE, "_V_END", NULL),
+		       apr_pstrdup(pool, tmp));
 
 	tmp =
 	    mgs_time2sz(gnutls_openpgp_crt_get_creation_time
 			(cert), buf, sizeof(buf));
 	apr_table_setn(env,
-		       apr_pstrcat(r->pool, MGS_SIDE, "_V_START", NULL),
-		       apr_pstrdup(r->pool, tmp));
+		       apr_pstrcat(pool, MGS_SIDE, "_V_START", NULL),
+		       apr_pstrdup(pool, tmp));
 
 	ret = gnutls_openpgp_crt_get_pk_algorithm(cert, NULL);
 	if (ret >= 0) {
 		apr_table_setn(env,
-			       apr_pstrcat(r->pool, MGS_SIDE, "_A_KEY",
+			       apr_pstrcat(pool, MGS_SIDE, "_A_KEY",
 					   NULL),
 			       gnutls_pk_algorithm_get_name(ret));
 	}
@@ -1160,20 +2036,20 @@ mgs_add_common_pgpcert_vars(request_rec * r, gnutls_openpgp_crt_t cert,
 }
 
 /* TODO: Allow client sending a X.509 certificate chain */
-static int mgs_cert_verify(request_rec * r, mgs_handle_t * ctxt)
+static int mgs_cert_verify_session(request_rec * r, mgs_handle_t * ctxt,
+				   apr_table_t * env)
 {
 	const gnutls_datum_t *cert_list;
 	unsigned int cert_list_size, status;
 	int rv = GNUTLS_E_NO_CERTIFICATE_FOUND, ret;
 	unsigned int ch_size = 0;
 	union {
-		gnutls_x509_crt_t x509[MAX_CHAIN_SIZE];
+		gnutls_x509_crt_t *x509;
 		gnutls_openpgp_crt_t pgp;
 	} cert;
-	apr_time_t expiration_time, cur_time;
-
-	if (r == NULL || ctxt == NULL || ctxt->session == NULL)
-		return HTTP_FORBIDDEN;
+	apr_time_t expiration_time;
+	unsigned char cache_key[MGS_VERIFY_CACHE_KEY_SIZE];
+	int cache_keyed = 0;
 
 	_gnutls_log(debug_log_fp, "%s: %d\n", __func__, __LINE__);
 	cert_list =
@@ -1197,6 +2073,8 @@ static int mgs_cert_verify(request_rec * r, mgs_handle_t * ctxt)
 			      "GnuTLS: A Chain of %d certificate(s) was provided for validation",
 			      cert_list_size);
 
+		cert.x509 = apr_pcalloc(r->pool, cert_list_size *
+					sizeof(gnutls_x509_crt_t));
 		for (ch_size = 0; ch_size < cert_list_size; ch_size++) {
 			gnutls_x509_crt_init(&cert.x509[ch_size]);
 			rv = gnutls_x509_crt_import(cert.x509[ch_size],
@@ -1248,13 +2126,59 @@ static int mgs_cert_verify(request_rec * r, mgs_handle_t * ctxt)
 				  gnutls_x509_crt_get_expiration_time
 				  (cert.x509[0]));
 
-		ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-			      "GnuTLS: Verifying list of  %d certificate(s)",
-			      ch_size);
-		rv = gnutls_x509_crt_list_verify(cert.x509, ch_size,
-						 ctxt->sc->ca_list,
-						 ctxt->sc->ca_list_size,
-						 NULL, 0, 0, &status);
+		cache_keyed = mgs_verify_cache_key(ctxt->sc, cert_list,
+						   ch_size, cache_key) == 0;
+		if (cache_keyed && mgs_verify_cache_get(cache_key, &status)) {
+			ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+				      "GnuTLS: Using the cached verification "
+				      "of %d certificate(s)", ch_size);
+			rv = 0;
+		} else {
+			ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+				      "GnuTLS: Verifying list of  %d certificate(s)",
+				      ch_size);
+			if (ctxt->sc->ca_path != NULL)
+				rv = mgs_ca_path_verify(r->pool, r->server,
+							ctxt->sc, cert.x509,
+							ch_size, &status);
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+			else if (ctxt->sc->ca_trust != NULL)
+				rv = gnutls_x509_trust_list_verify_crt
+				    (ctxt->sc->ca_trust, cert.x509, ch_size,
+				     0, &status, NULL);
+			else
+#endif
+				rv = gnutls_x509_crt_list_verify(cert.x509,
+								 ch_size,
+								 ctxt->sc->
+								 ca_list,
+								 ctxt->sc->
+								 ca_list_size,
+								 NULL, 0, 0,
+								 &status);
+			/* A status that depends on the current time is
+			 * only kept until the chain expires. A missing
+			 * issuer may still be added to GnuTLSClientCAPath.
+			 */
+			if (rv == 0 && cache_keyed
+			    && !(status & GNUTLS_CERT_NOT_ACTIVATED)
+			    && !(ctxt->sc->ca_path != NULL
+				 && (status & GNUTLS_CERT_SIGNER_NOT_FOUND))) {
+				apr_time_t expires = expiration_time;
+				apr_time_t t;
+				unsigned int i;
+
+				for (i = 1; i < ch_size; i++) {
+					apr_time_ansi_put(&t,
+							  gnutls_x509_crt_get_expiration_time
+							  (cert.x509[i]));
+					if (t < expires)
+						expires = t;
+				}
+				mgs_verify_cache_put(cache_key, status,
+						     expires);
+			}
+		}
 	} else {
 		apr_time_ansi_put(&expiration_time,
 				  gnutls_openpgp_crt_get_expiration_time
@@ -1276,12 +2200,10 @@ static int mgs_cert_verify(request_rec * r, mgs_handle_t * ctxt)
 		goto exit;
 	}
 
-	/* TODO: X509 CRL Verification. */
-	/* May add later if anyone needs it.
-	 */
-	/* ret = gnutls_x509_crt_check_revocation(crt, crl_list, crl_list_size); */
-
-	cur_time = apr_time_now();
+	/* Not part of the cached status, a reloaded CRL applies at once */
+	if (gnutls_certificate_type_get(ctxt->session) == GNUTLS_CRT_X509
+	    && mgs_crl_check(r->pool, ctxt->sc, cert.x509, ch_size) != 0)
+		status |= GNUTLS_CERT_REVOKED;
 
 	if (status & GNUTLS_CERT_SIGNER_NOT_FOUND) {
 		ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
@@ -1313,31 +2235,23 @@ static int mgs_cert_verify(request_rec * r, mgs_handle_t * ctxt)
 	}
 
 	if (gnutls_certificate_type_get(ctxt->session) == GNUTLS_CRT_X509)
-		mgs_add_common_cert_vars(r, cert.x509[0], 1,
+		mgs_add_common_cert_vars(env, ctxt->c->pool, cert.x509[0], 1,
 					 ctxt->
 					 sc->export_certificates_enabled);
 	else if (gnutls_certificate_type_get(ctxt->session) ==
 		 GNUTLS_CRT_OPENPGP)
-		mgs_add_common_pgpcert_vars(r, cert.pgp, 1,
+		mgs_add_common_pgpcert_vars(env, ctxt->c->pool, cert.pgp, 1,
 					    ctxt->
 					    sc->export_certificates_enabled);
 
-	{
-		/* days remaining */
-		unsigned long remain =
-		    (apr_time_sec(expiration_time) -
-		     apr_time_sec(cur_time)) / 86400;
-		apr_table_setn(r->subprocess_env, "SSL_CLIENT_V_REMAIN",
-			       apr_psprintf(r->pool, "%lu", remain));
-	}
+	/* SSL_CLIENT_V_REMAIN changes with time, mgs_cert_verify sets it */
+	ctxt->client_expiration = expiration_time;
 
 	if (status == 0) {
-		apr_table_setn(r->subprocess_env, "SSL_CLIENT_VERIFY",
-			       "SUCCESS");
+		apr_table_setn(env, "SSL_CLIENT_VERIFY", "SUCCESS");
 		ret = OK;
 	} else {
-		apr_table_setn(r->subprocess_env, "SSL_CLIENT_VERIFY",
-			       "FAILED");
+		apr_table_setn(env, "SSL_CLIENT_VERIFY", "FAILED");
 		if (ctxt->sc->client_verify_mode == GNUTLS_CERT_REQUEST)
 			ret = OK;
 		else
@@ -1358,6 +2272,34 @@ static int mgs_cert_verify(request_rec * r, mgs_handle_t * ctxt)
 
 }
 
+/* Verify the client certificate once per handshake. The outcome and the
+ * SSL_CLIENT_* variables are kept on the connection for the following
+ * requests, until the next handshake resets ctxt->client_verified.
+ */
+static int mgs_cert_verify(request_rec * r, mgs_handle_t * ctxt)
+{
+	if (r == NULL || ctxt == NULL || ctxt->session == NULL)
+		return HTTP_FORBIDDEN;
+
+	if (!ctxt->client_verified) {
+		ctxt->client_env = apr_table_make(ctxt->c->pool, 24);
+		ctxt->client_expiration = 0;
+		ctxt->client_remain_str = NULL;
+		ctxt->client_verify_rc =
+		    mgs_cert_verify_session(r, ctxt, ctxt->client_env);
+		ctxt->client_verified = 1;
+	}
+
+	apr_table_overlap(r->subprocess_env, ctxt->client_env,
+			  APR_OVERLAP_TABLES_SET);
+
+	if (ctxt->client_expiration != 0)
+		apr_table_setn(r->subprocess_env, "SSL_CLIENT_V_REMAIN",
+			       mgs_client_v_remain(ctxt));
+
+	return ctxt->client_verify_rc;
+}
+
 void mgs_hook_opt_retr(void) {
 #ifdef ENABLE_SRP
 	if (mgs_dbd_prepare_fn == NULL) {
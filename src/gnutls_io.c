@@ -374,6 +374,10 @@ static int gnutls_do_handshake(mgs_handle_t * ctxt)
 	} while ((ret == GNUTLS_E_INTERRUPTED || ret == GNUTLS_E_AGAIN)
 		 && maxtries > 0);
 
+	/* the expensive part is over, let the next full handshake in */
+	if (ret == 0 || gnutls_error_is_fatal(ret) || maxtries < 1)
+		mgs_limit_handshake_done(ctxt);
+
 	if (maxtries < 1) {
 		ctxt->status = -1;
 #if USING_2_1_RECENT
@@ -432,8 +436,16 @@ static int gnutls_do_handshake(mgs_handle_t * ctxt)
 		ctxt->session = NULL;
 		return ret;
 	} else {
+		const char *kx, *group;
+
 		/* all done with the handshake */
 		ctxt->status = 1;
+		/* a new handshake may have brought another client
+		 * certificate and cipher suite, verify and describe
+		 * them again
+		 */
+		ctxt->client_verified = 0;
+		ctxt->session_env = NULL;
 		/* If the session was resumed, we did not set the correct 
 		 * server_rec in ctxt->sc.  Go Find it. (ick!)
 		 */
@@ -444,6 +456,31 @@ static int gnutls_do_handshake(mgs_handle_t * ctxt)
 				ctxt->sc = sc;
 			}
 		}
+
+		kx = gnutls_kx_get_name(gnutls_kx_get(ctxt->session));
+		group = mgs_session_kx_group(ctxt->session);
+#if USING_2_1_RECENT
+		ap_log_cerror(APLOG_MARK, APLOG_DEBUG, 0, ctxt->c,
+			      "GnuTLS: Handshake completed (%s): %s, "
+			      "key exchange %s%s%s",
+			      gnutls_session_is_resumed(ctxt->session) ?
+			      "resumed" : "full",
+			      gnutls_protocol_get_name
+			      (gnutls_protocol_get_version(ctxt->session)),
+			      kx ? kx : "unknown", group ? " with " : "",
+			      group ? group : "");
+#else
+		ap_log_error(APLOG_MARK, APLOG_DEBUG, 0,
+			     ctxt->c->base_server,
+			     "GnuTLS: Handshake completed (%s): %s, "
+			     "key exchange %s%s%s",
+			     gnutls_session_is_resumed(ctxt->session) ?
+			     "resumed" : "full",
+			     gnutls_protocol_get_name
+			     (gnutls_protocol_get_version(ctxt->session)),
+			     kx ? kx : "unknown", group ? " with " : "",
+			     group ? group : "");
+#endif
 		return 0;
 	}
 }
@@ -0,0 +1,719 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "mod_gnutls.h"
+
+#include "apr_hash.h"
+#include "apr_network_io.h"
+#include "apr_portable.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+
+/**
+ * Keyless operation
+ *
+ * With GnuTLSKeyServer the private key of a virtual host is not loaded
+ * into httpd. Signatures and decryptions are sent to a key server on a
+ * Unix domain socket instead, see README for the protocol.
+ *
+ * Each child keeps one connection per key server, shared by all of its
+ * threads. Requests are tagged with an id so any number of them can be
+ * in flight; a reader thread matches the responses to the waiting
+ * handshakes, which give up after GnuTLSKeyServerTimeout.
+ *
+ * Writing frames and connecting happen under a send mutex of their
+ * own. The server mutex only guards the list of waiting requests and
+ * is never held while talking to the key server, so a stuck send does
+ * not keep the reader from delivering responses.
+ */
+
+#if GNUTLS_VERSION_NUMBER >= 0x030000 && APR_HAS_THREADS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MGS_KEYLESS_OP_SIGN     1
+#define MGS_KEYLESS_OP_DECRYPT  2
+/* sign naming the signature algorithm, for RSA-PSS and EdDSA */
+#define MGS_KEYLESS_OP_SIGN_ALGO 3
+
+#define MGS_KEYLESS_KEY_ID_SIZE 20
+/* length, id and op or status */
+#define MGS_KEYLESS_HEADER_SIZE 9
+#define MGS_KEYLESS_MAX_FRAME   (64 * 1024)
+
+typedef struct mgs_keyless_request_t mgs_keyless_request_t;
+
+struct mgs_keyless_request_t {
+	apr_uint32_t id;
+	int done;
+	int status;
+	gnutls_datum_t result;
+	mgs_keyless_request_t *next;
+};
+
+typedef struct {
+	const char *path;
+	server_rec *s;
+	apr_pool_t *pool;
+	/* guards sock, next_id and pending */
+	apr_thread_mutex_t *mutex;
+	/* held while connecting or writing a frame */
+	apr_thread_mutex_t *send_mutex;
+	/* signalled when responses arrive or the connection changes */
+	apr_thread_cond_t *cond;
+	/* the connection, or NULL when not connected */
+	apr_socket_t *sock;
+	/* holds the last connection, which is only closed under the send
+	 * mutex as a sender may still be writing to it
+	 */
+	apr_pool_t *sock_pool;
+	apr_uint32_t next_id;
+	/* the requests waiting for a response */
+	mgs_keyless_request_t *pending;
+	apr_thread_t *reader;
+	volatile int stop;
+} mgs_keyless_server_t;
+
+typedef struct {
+	server_rec *s;
+	mgs_keyless_server_t *server;
+	apr_interval_time_t timeout;
+	unsigned char key_id[MGS_KEYLESS_KEY_ID_SIZE];
+	/* the public key algorithm and size of the certificate */
+	gnutls_pk_algorithm_t pk;
+	unsigned int bits;
+} mgs_keyless_key_t;
+
+/* The key servers by socket path, built in post_config */
+static apr_hash_t *keyless_servers;
+
+static void put_uint32(unsigned char *buf, apr_uint32_t v)
+{
+	buf[0] = (v >> 24) & 0xff;
+	buf[1] = (v >> 16) & 0xff;
+	buf[2] = (v >> 8) & 0xff;
+	buf[3] = v & 0xff;
+}
+
+static apr_uint32_t get_uint32(const unsigned char *buf)
+{
+	return ((apr_uint32_t) buf[0] << 24) | ((apr_uint32_t) buf[1] << 16)
+	    | ((apr_uint32_t) buf[2] << 8) | (apr_uint32_t) buf[3];
+}
+
+/* Connect fd to sun by the deadline */
+static apr_status_t keyless_connect_by(apr_os_sock_t fd,
+				       const struct sockaddr_un *sun,
+				       apr_time_t deadline)
+{
+	struct pollfd pfd;
+	apr_interval_time_t left;
+	socklen_t len;
+	apr_status_t rv;
+	int flags, err, n;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return errno;
+
+	rv = connect(fd, (const struct sockaddr *) sun, sizeof(*sun)) < 0 ?
+	    errno : APR_SUCCESS;
+	/* Unix sockets refuse instead of queueing when the key server is
+	 * behind on accepting
+	 */
+	while (rv == EAGAIN && apr_time_now() < deadline) {
+		apr_sleep(apr_time_from_msec(10));
+		rv = connect(fd, (const struct sockaddr *) sun,
+			     sizeof(*sun)) < 0 ? errno : APR_SUCCESS;
+	}
+	if (rv == EINPROGRESS) {
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		left = deadline - apr_time_now();
+		do {
+			n = left > 0 ?
+			    poll(&pfd, 1, apr_time_as_msec(left) + 1) : 0;
+		} while (n < 0 && errno == EINTR);
+		len = sizeof(err);
+		if (n < 0)
+			rv = errno;
+		else if (n == 0)
+			rv = APR_TIMEUP;
+		else if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+			rv = errno;
+		else
+			rv = err;
+	}
+	if (rv == EAGAIN)
+		rv = APR_TIMEUP;
+
+	/* APR expects a blocking socket and does its own timeouts */
+	if (rv == APR_SUCCESS && fcntl(fd, F_SETFL, flags) < 0)
+		rv = errno;
+	return rv;
+}
+
+/* Replace the connection the reader gave up on, giving up at the
+ * deadline; called with the send mutex held
+ */
+static apr_status_t keyless_connect(mgs_keyless_server_t * ks,
+				    apr_interval_time_t timeout,
+				    apr_time_t deadline,
+				    apr_socket_t ** sock)
+{
+	struct sockaddr_un sun;
+	apr_status_t rv;
+	apr_os_sock_t fd;
+
+	/* nobody uses the old connection any more */
+	if (ks->sock_pool != NULL) {
+		apr_pool_destroy(ks->sock_pool);
+		ks->sock_pool = NULL;
+	}
+
+	if (strlen(ks->path) >= sizeof(sun.sun_path))
+		return APR_ENAMETOOLONG;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, ks->path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return errno;
+	rv = keyless_connect_by(fd, &sun, deadline);
+	if (rv != APR_SUCCESS) {
+		close(fd);
+		return rv;
+	}
+
+	apr_pool_create(&ks->sock_pool, ks->pool);
+	*sock = NULL;
+	rv = apr_os_sock_put(sock, &fd, ks->sock_pool);
+	if (rv != APR_SUCCESS) {
+		close(fd);
+		apr_pool_destroy(ks->sock_pool);
+		ks->sock_pool = NULL;
+		return rv;
+	}
+	apr_socket_timeout_set(*sock, timeout);
+
+	/* hand it to the reader */
+	apr_thread_mutex_lock(ks->mutex);
+	ks->sock = *sock;
+	apr_thread_cond_broadcast(ks->cond);
+	apr_thread_mutex_unlock(ks->mutex);
+	return APR_SUCCESS;
+}
+
+static apr_status_t keyless_send(apr_socket_t * sock, const char *buf,
+				 apr_size_t len)
+{
+	apr_status_t rv;
+	apr_size_t n;
+
+	while (len > 0) {
+		n = len;
+		rv = apr_socket_send(sock, buf, &n);
+		if (rv != APR_SUCCESS)
+			return rv;
+		buf += n;
+		len -= n;
+	}
+	return APR_SUCCESS;
+}
+
+/* Read exactly len bytes. Timeouts only matter when the child is
+ * exiting, the key server is allowed to stay quiet.
+ */
+static apr_status_t keyless_recv(mgs_keyless_server_t * ks,
+				 apr_socket_t * sock, char *buf,
+				 apr_size_t len)
+{
+	apr_status_t rv;
+	apr_size_t n;
+
+	while (len > 0) {
+		if (ks->stop)
+			return APR_EOF;
+		n = len;
+		rv = apr_socket_recv(sock, buf, &n);
+		buf += n;
+		len -= n;
+		if (rv != APR_SUCCESS && !APR_STATUS_IS_TIMEUP(rv)
+		    && !(rv == APR_EOF && len == 0))
+			return rv;
+	}
+	return APR_SUCCESS;
+}
+
+/* Fail all requests sent on the current connection and give it up.
+ * Only the reader does this; called with the server mutex held. The
+ * socket is shut down to wake up a sender stuck on it, the next
+ * connect closes it.
+ */
+static void keyless_disconnect(mgs_keyless_server_t * ks)
+{
+	mgs_keyless_request_t *req;
+
+	for (req = ks->pending; req != NULL; req = req->next) {
+		req->done = 1;
+		req->status = GNUTLS_E_PUSH_ERROR;
+	}
+	ks->pending = NULL;
+
+	if (ks->sock != NULL) {
+		apr_socket_shutdown(ks->sock, APR_SHUTDOWN_READWRITE);
+		ks->sock = NULL;
+	}
+	apr_thread_cond_broadcast(ks->cond);
+}
+
+/* Take req off the list of waiting requests if it is still there;
+ * called with the server mutex held
+ */
+static void keyless_forget(mgs_keyless_server_t * ks,
+			   mgs_keyless_request_t * req)
+{
+	mgs_keyless_request_t **prev;
+
+	for (prev = &ks->pending; *prev != NULL; prev = &(*prev)->next) {
+		if (*prev == req) {
+			*prev = req->next;
+			break;
+		}
+	}
+}
+
+static void *APR_THREAD_FUNC keyless_reader(apr_thread_t * thread,
+					    void *data)
+{
+	mgs_keyless_server_t *ks = data;
+	mgs_keyless_request_t **prev, *req;
+	unsigned char hdr[MGS_KEYLESS_HEADER_SIZE];
+	apr_socket_t *sock;
+	apr_uint32_t len, id;
+	unsigned char *body;
+	apr_status_t rv;
+
+	while (!ks->stop) {
+		apr_thread_mutex_lock(ks->mutex);
+		while (ks->sock == NULL && !ks->stop)
+			apr_thread_cond_timedwait(ks->cond, ks->mutex,
+						  apr_time_from_sec(1));
+		sock = ks->sock;
+		apr_thread_mutex_unlock(ks->mutex);
+		if (sock == NULL)
+			break;
+
+		for (;;) {
+			rv = keyless_recv(ks, sock, (char *) hdr,
+					  sizeof(hdr));
+			if (rv != APR_SUCCESS)
+				break;
+
+			len = get_uint32(hdr);
+			id = get_uint32(hdr + 4);
+			if (len < 5 || len > MGS_KEYLESS_MAX_FRAME) {
+				rv = APR_EGENERAL;
+				break;
+			}
+
+			len -= 5;
+			body = gnutls_malloc(len > 0 ? len : 1);
+			if (body == NULL) {
+				rv = APR_ENOMEM;
+				break;
+			}
+			rv = keyless_recv(ks, sock, (char *) body, len);
+			if (rv != APR_SUCCESS) {
+				gnutls_free(body);
+				break;
+			}
+
+			apr_thread_mutex_lock(ks->mutex);
+			for (prev = &ks->pending; (req = *prev) != NULL;
+			     prev = &req->next) {
+				if (req->id == id)
+					break;
+			}
+			if (req != NULL) {
+				*prev = req->next;
+				req->done = 1;
+				req->status = hdr[8];
+				req->result.data = body;
+				req->result.size = len;
+				body = NULL;
+				apr_thread_cond_broadcast(ks->cond);
+			}
+			apr_thread_mutex_unlock(ks->mutex);
+
+			/* the request timed out before the response came */
+			if (body != NULL)
+				gnutls_free(body);
+		}
+
+		if (!ks->stop)
+			ap_log_error(APLOG_MARK, APLOG_ERR, rv, ks->s,
+				     "GnuTLS: Lost connection to key server "
+				     "'%s'", ks->path);
+
+		apr_thread_mutex_lock(ks->mutex);
+		if (ks->sock == sock)
+			keyless_disconnect(ks);
+		apr_thread_mutex_unlock(ks->mutex);
+	}
+
+	apr_thread_exit(thread, APR_SUCCESS);
+	return NULL;
+}
+
+/* Send op with in to the key server and wait for the result; algo is
+ * the name of the signature algorithm for MGS_KEYLESS_OP_SIGN_ALGO
+ */
+static int keyless_op(mgs_keyless_key_t * key, unsigned char op,
+		      const char *algo, const gnutls_datum_t * in,
+		      gnutls_datum_t * out)
+{
+	mgs_keyless_server_t *ks = key->server;
+	mgs_keyless_request_t req;
+	apr_socket_t *sock;
+	unsigned char *frame, *pos;
+	apr_size_t frame_len, algo_len;
+	apr_time_t deadline;
+	apr_status_t rv;
+
+	algo_len = algo != NULL ? strlen(algo) : 0;
+	frame_len = MGS_KEYLESS_HEADER_SIZE + MGS_KEYLESS_KEY_ID_SIZE +
+	    (algo != NULL ? 1 + algo_len : 0) + in->size;
+	if (frame_len > MGS_KEYLESS_MAX_FRAME || algo_len > 255
+	    || ks->reader == NULL)
+		return GNUTLS_E_INTERNAL_ERROR;
+
+	frame = malloc(frame_len);
+	if (frame == NULL)
+		return GNUTLS_E_MEMORY_ERROR;
+
+	memset(&req, 0, sizeof(req));
+	deadline = apr_time_now() + key->timeout;
+
+	put_uint32(frame, frame_len - 4);
+	frame[8] = op;
+	pos = frame + MGS_KEYLESS_HEADER_SIZE;
+	memcpy(pos, key->key_id, MGS_KEYLESS_KEY_ID_SIZE);
+	pos += MGS_KEYLESS_KEY_ID_SIZE;
+	if (algo != NULL) {
+		*pos++ = algo_len;
+		memcpy(pos, algo, algo_len);
+		pos += algo_len;
+	}
+	memcpy(pos, in->data, in->size);
+
+	/* Frames are written whole under the send mutex so they do not
+	 * interleave; the reader and the waits for responses go on
+	 * meanwhile.
+	 */
+	apr_thread_mutex_lock(ks->send_mutex);
+
+	apr_thread_mutex_lock(ks->mutex);
+	sock = ks->sock;
+	apr_thread_mutex_unlock(ks->mutex);
+	if (sock == NULL) {
+		rv = keyless_connect(ks, key->timeout, deadline, &sock);
+		if (rv != APR_SUCCESS) {
+			apr_thread_mutex_unlock(ks->send_mutex);
+			free(frame);
+			ap_log_error(APLOG_MARK, APLOG_ERR, rv, key->s,
+				     "GnuTLS: Cannot connect to key server "
+				     "'%s'", ks->path);
+			return GNUTLS_E_PUSH_ERROR;
+		}
+	}
+
+	/* wait for the response before it can arrive */
+	apr_thread_mutex_lock(ks->mutex);
+	if (ks->sock == sock) {
+		req.id = ks->next_id++;
+		req.next = ks->pending;
+		ks->pending = &req;
+		rv = APR_SUCCESS;
+	} else
+		/* the reader gave up on it already */
+		rv = APR_ECONNRESET;
+	apr_thread_mutex_unlock(ks->mutex);
+
+	if (rv == APR_SUCCESS) {
+		put_uint32(frame + 4, req.id);
+		rv = keyless_send(sock, (const char *) frame, frame_len);
+		/* the reader fails the requests still waiting on it */
+		if (rv != APR_SUCCESS)
+			apr_socket_shutdown(sock, APR_SHUTDOWN_READWRITE);
+	}
+	apr_thread_mutex_unlock(ks->send_mutex);
+	free(frame);
+
+	apr_thread_mutex_lock(ks->mutex);
+	if (rv != APR_SUCCESS) {
+		keyless_forget(ks, &req);
+		apr_thread_mutex_unlock(ks->mutex);
+		if (req.done)
+			gnutls_free(req.result.data);
+		ap_log_error(APLOG_MARK, APLOG_ERR, rv, key->s,
+			     "GnuTLS: Cannot send to key server '%s'",
+			     ks->path);
+		return GNUTLS_E_PUSH_ERROR;
+	}
+
+	while (!req.done) {
+		apr_time_t now = apr_time_now();
+		if (now >= deadline)
+			break;
+		apr_thread_cond_timedwait(ks->cond, ks->mutex,
+					  deadline - now);
+	}
+
+	if (!req.done) {
+		keyless_forget(ks, &req);
+		apr_thread_mutex_unlock(ks->mutex);
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, key->s,
+			     "GnuTLS: Key server '%s' did not answer in "
+			     "time", ks->path);
+		return GNUTLS_E_TIMEDOUT;
+	}
+	apr_thread_mutex_unlock(ks->mutex);
+
+	if (req.status != 0) {
+		gnutls_free(req.result.data);
+		if (req.status < 0)
+			return req.status;
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, key->s,
+			     "GnuTLS: Key server '%s' failed with status %d",
+			     ks->path, req.status);
+		return op == MGS_KEYLESS_OP_DECRYPT ?
+		    GNUTLS_E_DECRYPTION_FAILED : GNUTLS_E_PK_SIGN_FAILED;
+	}
+
+	*out = req.result;
+	return 0;
+}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+/* For PKCS #1 v1.5 GnuTLS passes the DigestInfo (or the MD5+SHA1 of TLS
+ * 1.0) and for (EC)DSA the hash, just as with gnutls_privkey_import_ext(),
+ * so only RSA-PSS needs the algorithm named.
+ */
+static int keyless_sign_hash(gnutls_privkey_t pkey,
+			     gnutls_sign_algorithm_t algo, void *userdata,
+			     unsigned int flags, const gnutls_datum_t * hash,
+			     gnutls_datum_t * signature)
+{
+	const char *name;
+
+	if (gnutls_sign_get_pk_algorithm(algo) != GNUTLS_PK_RSA_PSS)
+		return keyless_op(userdata, MGS_KEYLESS_OP_SIGN, NULL, hash,
+				  signature);
+
+	name = gnutls_sign_get_name(algo);
+	if (name == NULL)
+		return GNUTLS_E_UNSUPPORTED_SIGNATURE_ALGORITHM;
+	return keyless_op(userdata, MGS_KEYLESS_OP_SIGN_ALGO, name, hash,
+			  signature);
+}
+
+/* EdDSA signs the data itself */
+static int keyless_sign_data(gnutls_privkey_t pkey,
+			     gnutls_sign_algorithm_t algo, void *userdata,
+			     unsigned int flags, const gnutls_datum_t * data,
+			     gnutls_datum_t * signature)
+{
+	const char *name = gnutls_sign_get_name(algo);
+
+	if (name == NULL)
+		return GNUTLS_E_UNSUPPORTED_SIGNATURE_ALGORITHM;
+	return keyless_op(userdata, MGS_KEYLESS_OP_SIGN_ALGO, name, data,
+			  signature);
+}
+
+/* Tells GnuTLS which signature algorithms the key can do, without that
+ * RSA keys are not offered for RSA-PSS and so not for TLS 1.3
+ */
+static int keyless_info(gnutls_privkey_t pkey, unsigned int flags,
+			void *userdata)
+{
+	mgs_keyless_key_t *key = userdata;
+
+	if (flags & GNUTLS_PRIVKEY_INFO_PK_ALGO)
+		return key->pk;
+	if (flags & GNUTLS_PRIVKEY_INFO_PK_ALGO_BITS)
+		return key->bits;
+	if (flags & GNUTLS_PRIVKEY_INFO_HAVE_SIGN_ALGO)
+		return gnutls_sign_supports_pk_algorithm
+		    (GNUTLS_FLAGS_TO_SIGN_ALGO(flags), key->pk);
+	return GNUTLS_E_INVALID_REQUEST;
+}
+#else
+static int keyless_sign(gnutls_privkey_t pkey, void *userdata,
+			const gnutls_datum_t * raw_data,
+			gnutls_datum_t * signature)
+{
+	return keyless_op(userdata, MGS_KEYLESS_OP_SIGN, NULL, raw_data,
+			  signature);
+}
+#endif
+
+static int keyless_decrypt(gnutls_privkey_t pkey, void *userdata,
+			   const gnutls_datum_t * ciphertext,
+			   gnutls_datum_t * plaintext)
+{
+	return keyless_op(userdata, MGS_KEYLESS_OP_DECRYPT, NULL, ciphertext,
+			  plaintext);
+}
+
+static apr_status_t keyless_servers_cleanup(void *data)
+{
+	keyless_servers = NULL;
+	return APR_SUCCESS;
+}
+
+int mgs_keyless_import(apr_pool_t * p, server_rec * s,
+		       mgs_srvconf_rec * sc, gnutls_privkey_t * privkey)
+{
+	mgs_keyless_key_t *key;
+	mgs_keyless_server_t *ks;
+	size_t key_id_size = MGS_KEYLESS_KEY_ID_SIZE;
+	int ret;
+
+	if (keyless_servers == NULL) {
+		keyless_servers = apr_hash_make(p);
+		apr_pool_cleanup_register(p, NULL, keyless_servers_cleanup,
+					  apr_pool_cleanup_null);
+	}
+
+	ks = apr_hash_get(keyless_servers, sc->key_server,
+			  APR_HASH_KEY_STRING);
+	if (ks == NULL) {
+		ks = apr_pcalloc(p, sizeof(*ks));
+		ks->path = sc->key_server;
+		ks->s = s;
+		apr_hash_set(keyless_servers, ks->path, APR_HASH_KEY_STRING,
+			     ks);
+	}
+
+	key = apr_pcalloc(p, sizeof(*key));
+	key->s = s;
+	key->server = ks;
+	key->timeout = sc->key_server_timeout;
+
+	/* the key server finds the key by the ID of its public key */
+	ret = gnutls_x509_crt_get_key_id(sc->certs_x509[0], 0, key->key_id,
+					 &key_id_size);
+	if (ret < 0)
+		return ret;
+
+	ret = gnutls_x509_crt_get_pk_algorithm(sc->certs_x509[0],
+					       &key->bits);
+	if (ret < 0)
+		return ret;
+	key->pk = ret;
+
+	ret = gnutls_privkey_init(privkey);
+	if (ret < 0)
+		return ret;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+	ret = gnutls_privkey_import_ext4(*privkey, key, keyless_sign_data,
+					 keyless_sign_hash, keyless_decrypt,
+					 NULL, keyless_info, 0);
+#else
+	ret = gnutls_privkey_import_ext(*privkey, key->pk, key,
+				       keyless_sign, keyless_decrypt, 0);
+#endif
+	if (ret < 0) {
+		gnutls_privkey_deinit(*privkey);
+		*privkey = NULL;
+	}
+
+	return ret;
+}
+
+static apr_status_t keyless_child_cleanup(void *data)
+{
+	mgs_keyless_server_t *ks = data;
+	apr_status_t rv;
+
+	ks->stop = 1;
+	apr_thread_mutex_lock(ks->mutex);
+	apr_thread_cond_broadcast(ks->cond);
+	apr_thread_mutex_unlock(ks->mutex);
+	apr_thread_join(&rv, ks->reader);
+	ks->reader = NULL;
+
+	return APR_SUCCESS;
+}
+
+void mgs_keyless_child_init(apr_pool_t * p, server_rec * s)
+{
+	apr_hash_index_t *hi;
+	mgs_keyless_server_t *ks;
+	apr_status_t rv;
+
+	if (keyless_servers == NULL)
+		return;
+
+	for (hi = apr_hash_first(p, keyless_servers); hi;
+	     hi = apr_hash_next(hi)) {
+		apr_hash_this(hi, NULL, NULL, (void **) &ks);
+
+		ks->pool = p;
+		ks->stop = 0;
+		rv = apr_thread_mutex_create(&ks->mutex,
+					     APR_THREAD_MUTEX_DEFAULT, p);
+		if (rv == APR_SUCCESS)
+			rv = apr_thread_mutex_create(&ks->send_mutex,
+						     APR_THREAD_MUTEX_DEFAULT,
+						     p);
+		if (rv == APR_SUCCESS)
+			rv = apr_thread_cond_create(&ks->cond, p);
+		if (rv == APR_SUCCESS)
+			rv = apr_thread_create(&ks->reader, NULL,
+					       keyless_reader, ks, p);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s,
+				     "GnuTLS: Failed to set up the "
+				     "connection to key server '%s'",
+				     ks->path);
+			ks->reader = NULL;
+			continue;
+		}
+		/* join before the pools used by the thread go away */
+		apr_pool_pre_cleanup_register(p, ks, keyless_child_cleanup);
+	}
+}
+
+#else				/* no keyless support */
+
+void mgs_keyless_child_init(apr_pool_t * p, server_rec * s)
+{
+}
+
+#endif
@@ -0,0 +1,559 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "mod_gnutls.h"
+
+#include "apr_atomic.h"
+#include "apr_network_io.h"
+#include "apr_file_io.h"
+#include "apr_poll.h"
+#include "mod_status.h"
+#include "ap_mpm.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+/**
+ * Handshake admission control
+ *
+ * A full handshake costs a private key operation, a resumed one does
+ * not. Two limits apply to full handshakes only, resumed handshakes are
+ * never counted:
+ *
+ * GnuTLSFullHandshakeRate gives every client address a token bucket in
+ * shared memory. IPv6 addresses are grouped by their prefix, since a
+ * single client usually owns a whole /64. A client out of tokens is
+ * refused at once.
+ *
+ * GnuTLSMaxFullHandshakes caps the number of full handshakes in
+ * progress across all children so that a burst of new clients cannot
+ * starve the resumptions of existing ones. A full handshake over the
+ * limit waits up to GnuTLSFullHandshakeQueueTimeout for a slot and is
+ * then refused. Waiting handshakes sleep on a pipe shared by all
+ * children, a handshake that gives its slot back writes a byte to it
+ * when any are waiting to wake one of them. A client refused there gets
+ * its token back.
+ *
+ * Every child also counts the slots it holds in an entry of its own in
+ * the shared memory. A child that dies in the middle of a handshake
+ * cannot give its slots back; once its process is gone another child
+ * returns them and frees the entry, when it starts or at most every
+ * second while handshakes are refused. Entries are freed that way after
+ * a normal exit too, the connections of the child may give their slots
+ * back after any cleanup of its own.
+ *
+ * Refused handshakes fail with an alert. The counters are shown by
+ * mod_status.
+ */
+
+/* Entries compared per lookup in the rate table; the least recently
+ * used one is replaced when the address is not among them
+ */
+#define MGS_LIMIT_WAYS 4
+/* the pid of a child entry while its slots are returned */
+#define MGS_LIMIT_RECLAIMING 0xffffffffU
+
+typedef struct {
+	/* full handshakes in progress */
+	apr_uint32_t active;
+	/* full handshakes waiting for a slot */
+	apr_uint32_t waiting;
+	/* full handshakes admitted, had to wait, refused over the limit */
+	apr_uint32_t admitted;
+	apr_uint32_t queued;
+	apr_uint32_t rejected;
+	/* full handshakes refused by the rate limit */
+	apr_uint32_t rate_limited;
+	/* entries of the rate table taken over by another address */
+	apr_uint32_t rate_evictions;
+	/* the second of the next search for dead children */
+	apr_uint32_t next_reclaim;
+} mgs_limit_stats_t;
+
+typedef struct {
+	/* the process, 0 if the entry is free */
+	apr_uint32_t pid;
+	/* the full handshakes it has in progress */
+	apr_uint32_t held;
+} mgs_limit_child_t;
+
+typedef struct {
+	/* IPv4 addresses are stored mapped to IPv6 */
+	unsigned char addr[16];
+	double tokens;
+	apr_time_t last;
+} mgs_limit_bucket_t;
+
+static apr_shm_t *limit_shm;
+static mgs_limit_stats_t *limit_stats;
+static mgs_limit_child_t *limit_children;
+static unsigned int limit_nchildren;
+/* the entry of this process, NULL if there was none free */
+static mgs_limit_child_t *limit_child;
+static mgs_limit_bucket_t *limit_buckets;
+static apr_global_mutex_t *limit_mutex;
+/* the ends of the pipe waiting handshakes sleep on */
+static apr_file_t *limit_wake_in;
+static apr_file_t *limit_wake_out;
+
+static apr_uint32_t max_full_handshakes;
+static apr_interval_time_t queue_timeout;
+static double rate;
+static double burst;
+static unsigned int v6_prefix;
+static unsigned int nsets;
+
+int mgs_limit_post_config(apr_pool_t * p, server_rec * s)
+{
+	apr_status_t rv;
+	apr_size_t size;
+	mgs_srvconf_rec *sc = ap_get_module_config(s->module_config,
+						   &gnutls_module);
+
+	limit_stats = NULL;
+	limit_children = NULL;
+	limit_nchildren = 0;
+	limit_child = NULL;
+	limit_buckets = NULL;
+	limit_mutex = NULL;
+	limit_wake_in = NULL;
+	limit_wake_out = NULL;
+	max_full_handshakes = sc->max_full_handshakes;
+	queue_timeout = sc->full_handshake_queue_timeout;
+	rate = sc->full_handshake_rate;
+	burst = sc->full_handshake_burst;
+	v6_prefix = sc->full_handshake_rate_v6_prefix;
+	nsets = 0;
+
+	if (max_full_handshakes == 0 && rate <= 0)
+		return 0;
+
+	size = sizeof(mgs_limit_stats_t);
+	if (max_full_handshakes > 0) {
+		int limit = 0;
+
+		/* the children of older generations are in the scoreboard
+		 * too, so there are never more at once
+		 */
+		ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &limit);
+		limit_nchildren = limit > 0 ? limit : 1;
+		size += limit_nchildren * sizeof(mgs_limit_child_t);
+	}
+	if (rate > 0) {
+		nsets = (sc->full_handshake_rate_table_size +
+			 MGS_LIMIT_WAYS - 1) / MGS_LIMIT_WAYS;
+		size += nsets * MGS_LIMIT_WAYS * sizeof(mgs_limit_bucket_t);
+	}
+
+	rv = mgs_shm_create(&limit_shm, size,
+			    ap_server_root_relative(p,
+						    "logs/gnutls_limit.shm"),
+			    p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, s,
+			     "GnuTLS: Cannot create the shared memory for "
+			     "the handshake limits");
+		return rv;
+	}
+	limit_stats = apr_shm_baseaddr_get(limit_shm);
+	if (limit_nchildren > 0)
+		limit_children = (mgs_limit_child_t *) (limit_stats + 1);
+
+	/* created before the children are forked, which share it */
+	if (max_full_handshakes > 0 && queue_timeout > 0) {
+		rv = apr_file_pipe_create_ex(&limit_wake_in, &limit_wake_out,
+					     APR_FULL_NONBLOCK, p);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, s,
+				     "GnuTLS: Cannot create the pipe for "
+				     "GnuTLSFullHandshakeQueueTimeout");
+			return rv;
+		}
+	}
+
+	if (rate > 0) {
+		limit_buckets = (mgs_limit_bucket_t *)
+		    ((unsigned char *) (limit_stats + 1) +
+		     limit_nchildren * sizeof(mgs_limit_child_t));
+
+		rv = mgs_mutex_create(&limit_mutex, s, p);
+		if (rv != APR_SUCCESS) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, s,
+				     "GnuTLS: Cannot create the mutex for "
+				     "GnuTLSFullHandshakeRate");
+			return rv;
+		}
+	}
+
+	return 0;
+}
+
+/* Return the slots of the children that are gone, and of an entry of
+ * the pid self if set, left by a dead child whose pid was reused
+ */
+static void limit_reclaim(apr_uint32_t self)
+{
+	apr_uint32_t pid, held;
+	unsigned int i;
+
+	for (i = 0; i < limit_nchildren; i++) {
+		pid = apr_atomic_read32(&limit_children[i].pid);
+		if (pid == 0 || pid == MGS_LIMIT_RECLAIMING
+		    || (pid != self && (kill((pid_t) pid, 0) == 0
+					|| errno != ESRCH)))
+			continue;
+		/* only one process returns them */
+		if (apr_atomic_cas32(&limit_children[i].pid,
+				     MGS_LIMIT_RECLAIMING, pid) != pid)
+			continue;
+		held = apr_atomic_xchg32(&limit_children[i].held, 0);
+		if (held > 0)
+			apr_atomic_sub32(&limit_stats->active, held);
+		apr_atomic_set32(&limit_children[i].pid, 0);
+	}
+}
+
+void mgs_limit_child_init(apr_pool_t * p, server_rec * s)
+{
+	apr_status_t rv;
+	apr_uint32_t pid = getpid();
+	unsigned int i;
+
+	rv = mgs_mutex_child_init(&limit_mutex, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s,
+			     "GnuTLS: Failed to reopen the mutex for "
+			     "GnuTLSFullHandshakeRate");
+		limit_mutex = NULL;
+	}
+
+	if (limit_children == NULL)
+		return;
+
+	/* this child may replace one that died */
+	limit_reclaim(pid);
+	for (i = 0; i < limit_nchildren; i++)
+		if (apr_atomic_cas32(&limit_children[i].pid, pid, 0) == 0) {
+			limit_child = &limit_children[i];
+			apr_atomic_set32(&limit_child->held, 0);
+			break;
+		}
+	if (limit_child == NULL)
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+			     "GnuTLS: No entry left for the full handshakes "
+			     "of this child, they are not returned if it "
+			     "dies");
+}
+
+/* The key of the client address in the rate table */
+static int limit_client_key(conn_rec * c, unsigned char *key)
+{
+	apr_sockaddr_t *sa = MGS_CLIENT_ADDR(c);
+	unsigned int i;
+
+	memset(key, 0, 16);
+
+	if (sa->family == APR_INET) {
+		key[10] = key[11] = 0xff;
+		memcpy(key + 12, &sa->sa.sin.sin_addr, 4);
+		return 0;
+	}
+#if APR_HAVE_IPV6
+	if (sa->family == APR_INET6) {
+		memcpy(key, &sa->sa.sin6.sin6_addr, 16);
+		/* IPv4 clients on a dual stack socket */
+		if (memcmp(key, "\0\0\0\0\0\0\0\0\0\0\xff\xff", 12) == 0)
+			return 0;
+
+		for (i = v6_prefix; i < 128; i++)
+			key[i / 8] &= ~(0x80 >> (i % 8));
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+/* Take a token from the bucket of the client, or with give put one
+ * back. Returns 0 when the client has none left.
+ */
+static int limit_rate_take(conn_rec * c, int give)
+{
+	unsigned char key[16];
+	mgs_limit_bucket_t *set, *b, *oldest;
+	apr_uint32_t hash = 2166136261U;
+	apr_time_t now;
+	unsigned int i;
+	int allowed;
+
+	if (limit_client_key(c, key) < 0)
+		return 1;
+
+	/* FNV-1a */
+	for (i = 0; i < 16; i++)
+		hash = (hash ^ key[i]) * 16777619U;
+	set = &limit_buckets[(hash % nsets) * MGS_LIMIT_WAYS];
+
+	/* the table is only a cache, admit the client if it is busy */
+	if (apr_global_mutex_lock(limit_mutex) != APR_SUCCESS)
+		return 1;
+
+	now = apr_time_now();
+	b = NULL;
+	oldest = set;
+	for (i = 0; i < MGS_LIMIT_WAYS; i++) {
+		if (set[i].last != 0 && memcmp(set[i].addr, key, 16) == 0) {
+			b = &set[i];
+			break;
+		}
+		if (set[i].last < oldest->last)
+			oldest = &set[i];
+	}
+
+	if (give) {
+		/* an evicted client starts with a full bucket anyway */
+		if (b != NULL && b->tokens + 1 <= burst)
+			b->tokens += 1;
+		apr_global_mutex_unlock(limit_mutex);
+		return 1;
+	}
+
+	if (b == NULL) {
+		b = oldest;
+		if (b->last != 0)
+			apr_atomic_inc32(&limit_stats->rate_evictions);
+		memcpy(b->addr, key, 16);
+		b->tokens = burst;
+	} else {
+		b->tokens += rate * (now - b->last) / APR_USEC_PER_SEC;
+		if (b->tokens > burst)
+			b->tokens = burst;
+	}
+	b->last = now;
+
+	allowed = b->tokens >= 1;
+	if (allowed)
+		b->tokens -= 1;
+
+	apr_global_mutex_unlock(limit_mutex);
+
+	return allowed;
+}
+
+static apr_status_t limit_conn_cleanup(void *data)
+{
+	mgs_limit_handshake_done(data);
+	return APR_SUCCESS;
+}
+
+static int limit_try_acquire(void)
+{
+	apr_uint32_t cur;
+
+	for (;;) {
+		cur = apr_atomic_read32(&limit_stats->active);
+		if (cur >= max_full_handshakes)
+			return 0;
+		if (apr_atomic_cas32(&limit_stats->active, cur + 1, cur) ==
+		    cur)
+			break;
+	}
+	/* counted here after the total, and given back before it, so a
+	 * child killed in between leaks a slot rather than freeing one
+	 * twice
+	 */
+	if (limit_child != NULL)
+		apr_atomic_inc32(&limit_child->held);
+	return 1;
+}
+
+/* Look for slots of dead children at most once a second */
+static int limit_try_reclaim(void)
+{
+	apr_uint32_t sec = apr_time_sec(apr_time_now()), next;
+
+	next = apr_atomic_read32(&limit_stats->next_reclaim);
+	if (sec < next || apr_atomic_cas32(&limit_stats->next_reclaim,
+					   sec + 1, next) != next)
+		return 0;
+	limit_reclaim(0);
+	return limit_try_acquire();
+}
+
+/* Sleep until a slot may have been given back or for at most timeout */
+static void limit_wait(apr_interval_time_t timeout)
+{
+	apr_pollfd_t pfd;
+	apr_int32_t n;
+	char ch;
+
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.desc_type = APR_POLL_FILE;
+	pfd.reqevents = APR_POLLIN;
+	pfd.desc.f = limit_wake_in;
+
+	if (apr_poll(&pfd, 1, &n, timeout) == APR_SUCCESS && n > 0)
+		/* another waiter may have taken the byte, that is fine */
+		apr_file_getc(&ch, limit_wake_in);
+}
+
+/* Wait up to queue_timeout for a slot */
+static int limit_queue(void)
+{
+	apr_time_t deadline = apr_time_now() + queue_timeout;
+	apr_interval_time_t left;
+	int admitted;
+
+	apr_atomic_inc32(&limit_stats->queued);
+	/* counted as waiting before trying again, so a slot given back
+	 * in between either is taken here or wakes someone up
+	 */
+	apr_atomic_inc32(&limit_stats->waiting);
+	for (;;) {
+		admitted = limit_try_acquire();
+		left = deadline - apr_time_now();
+		if (admitted || left <= 0)
+			break;
+		limit_wait(left);
+	}
+	apr_atomic_dec32(&limit_stats->waiting);
+
+	return admitted;
+}
+
+int mgs_limit_full_handshake(mgs_handle_t * ctxt)
+{
+	int admitted;
+	int took_token = 0;
+
+	if (limit_stats == NULL || ctxt->full_handshake
+	    || gnutls_session_is_resumed(ctxt->session))
+		return 0;
+
+	if (limit_buckets != NULL && limit_mutex != NULL) {
+		if (!limit_rate_take(ctxt->c, 0)) {
+			apr_atomic_inc32(&limit_stats->rate_limited);
+#if USING_2_1_RECENT
+			ap_log_cerror(APLOG_MARK, APLOG_INFO, 0, ctxt->c,
+				      "GnuTLS: Refusing full handshake, client "
+				      "over GnuTLSFullHandshakeRate");
+#else
+			ap_log_error(APLOG_MARK, APLOG_INFO, 0,
+				     ctxt->c->base_server,
+				     "GnuTLS: Refusing full handshake, client "
+				     "over GnuTLSFullHandshakeRate");
+#endif
+			return GNUTLS_E_INTERNAL_ERROR;
+		}
+		took_token = 1;
+	}
+
+	if (max_full_handshakes == 0)
+		return 0;
+
+	admitted = limit_try_acquire();
+	if (!admitted)
+		admitted = limit_try_reclaim();
+	if (!admitted && limit_wake_in != NULL)
+		admitted = limit_queue();
+
+	if (!admitted) {
+		/* the handshake costs nothing, neither should the client */
+		if (took_token)
+			limit_rate_take(ctxt->c, 1);
+		apr_atomic_inc32(&limit_stats->rejected);
+#if USING_2_1_RECENT
+		ap_log_cerror(APLOG_MARK, APLOG_INFO, 0, ctxt->c,
+			      "GnuTLS: Refusing full handshake, %u in "
+			      "progress (GnuTLSMaxFullHandshakes)",
+			      max_full_handshakes);
+#else
+		ap_log_error(APLOG_MARK, APLOG_INFO, 0,
+			     ctxt->c->base_server,
+			     "GnuTLS: Refusing full handshake, %u in "
+			     "progress (GnuTLSMaxFullHandshakes)",
+			     max_full_handshakes);
+#endif
+		return GNUTLS_E_INTERNAL_ERROR;
+	}
+
+	apr_atomic_inc32(&limit_stats->admitted);
+	ctxt->full_handshake = 1;
+	/* give the slot back even if the connection goes away without
+	 * finishing the handshake
+	 */
+	apr_pool_cleanup_register(ctxt->c->pool, ctxt, limit_conn_cleanup,
+				  apr_pool_cleanup_null);
+	return 0;
+}
+
+void mgs_limit_handshake_done(mgs_handle_t * ctxt)
+{
+	if (!ctxt->full_handshake)
+		return;
+
+	ctxt->full_handshake = 0;
+	if (limit_child != NULL)
+		apr_atomic_dec32(&limit_child->held);
+	apr_atomic_dec32(&limit_stats->active);
+	/* a full pipe already has enough wake ups in it */
+	if (limit_wake_out != NULL
+	    && apr_atomic_read32(&limit_stats->waiting) > 0)
+		apr_file_putc(0, limit_wake_out);
+}
+
+int mgs_limit_status_hook(request_rec * r, int flags)
+{
+	if (limit_stats == NULL)
+		return OK;
+
+	if (flags & AP_STATUS_SHORT) {
+		ap_rprintf(r, "GnuTLSFullHandshakesActive: %u\n",
+			   apr_atomic_read32(&limit_stats->active));
+		ap_rprintf(r, "GnuTLSFullHandshakesAdmitted: %u\n",
+			   apr_atomic_read32(&limit_stats->admitted));
+		ap_rprintf(r, "GnuTLSFullHandshakesQueued: %u\n",
+			   apr_atomic_read32(&limit_stats->queued));
+		ap_rprintf(r, "GnuTLSFullHandshakesRejected: %u\n",
+			   apr_atomic_read32(&limit_stats->rejected));
+		ap_rprintf(r, "GnuTLSFullHandshakesRateLimited: %u\n",
+			   apr_atomic_read32(&limit_stats->rate_limited));
+		ap_rprintf(r, "GnuTLSFullHandshakeRateEvictions: %u\n",
+			   apr_atomic_read32(&limit_stats->rate_evictions));
+		return OK;
+	}
+
+	ap_rputs("<hr>\n<h2>GnuTLS full handshakes</h2>\n<dl>\n", r);
+	ap_rprintf(r, "<dt>In progress: <b>%u</b>",
+		   apr_atomic_read32(&limit_stats->active));
+	if (max_full_handshakes > 0)
+		ap_rprintf(r, " of at most %u", max_full_handshakes);
+	ap_rputs("</dt>\n", r);
+	ap_rprintf(r, "<dt>Admitted: <b>%u</b>, had to wait: <b>%u</b>, "
+		   "refused over the limit: <b>%u</b></dt>\n",
+		   apr_atomic_read32(&limit_stats->admitted),
+		   apr_atomic_read32(&limit_stats->queued),
+		   apr_atomic_read32(&limit_stats->rejected));
+	if (limit_buckets != NULL)
+		ap_rprintf(r, "<dt>Refused by the rate limit: <b>%u</b>, "
+			   "rate table evictions: <b>%u</b></dt>\n",
+			   apr_atomic_read32(&limit_stats->rate_limited),
+			   apr_atomic_read32(&limit_stats->rate_evictions));
+	ap_rputs("</dl>\n", r);
+
+	return OK;
+}
@@ -0,0 +1,605 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "mod_gnutls.h"
+
+#include "apr_atomic.h"
+#include "apr_network_io.h"
+#include "apr_thread_proc.h"
+#include "apr_uri.h"
+
+/**
+ * OCSP stapling
+ *
+ * The OCSP responses of all virtual hosts with GnuTLSOCSPStapling on are
+ * kept in a shared memory segment with one slot per host. A thread in
+ * each child wakes up every GnuTLSOCSPCheckInterval and refreshes the
+ * responses that are past half of their lifetime; the first child to
+ * notice does the fetch while the others keep serving the old response.
+ *
+ * The handshake only ever copies the cached response. Slots are written
+ * under a sequence counter (odd while an update is in progress), so
+ * readers never wait for the mutex that serializes the writers.
+ */
+
+#if GNUTLS_VERSION_NUMBER >= 0x030103
+
+#include <gnutls/ocsp.h>
+
+/* The largest OCSP response that can be stapled */
+#define MGS_OCSP_MAX_RESPONSE (10 * 1024)
+/* The largest HTTP reply accepted from an OCSP responder */
+#define MGS_OCSP_MAX_REPLY (64 * 1024)
+/* Lifetime of responses that do not specify a next update */
+#define MGS_OCSP_DEFAULT_LIFETIME apr_time_from_sec(3600)
+/* Time allowed for a single fetch from the responder */
+#define MGS_OCSP_FETCH_TIMEOUT apr_time_from_sec(10)
+
+typedef struct {
+	/* even when the slot is consistent */
+	apr_uint32_t seq;
+	apr_size_t len;
+	/* the response must not be used after this time */
+	apr_time_t expiry;
+	/* a new response should be fetched after this time */
+	apr_time_t refresh;
+	/* a process is fetching a response until this time */
+	apr_time_t fetching;
+	unsigned char der[MGS_OCSP_MAX_RESPONSE];
+} mgs_ocsp_slot_t;
+
+static apr_shm_t *ocsp_shm;
+static mgs_ocsp_slot_t *ocsp_slots;
+static apr_global_mutex_t *ocsp_mutex;
+
+#if APR_HAS_THREADS
+static apr_thread_t *ocsp_thread;
+static volatile int ocsp_thread_stop;
+#endif
+
+/* apr_atomic_add32() is a full memory barrier, use it to read the
+ * sequence counter.
+ */
+#define SLOT_SEQ(slot) apr_atomic_add32(&(slot)->seq, 0)
+
+static int mgs_ocsp_staple_cb(gnutls_session_t session, void *ptr,
+			      gnutls_datum_t * ocsp_response)
+{
+	mgs_srvconf_rec *sc = ptr;
+	mgs_ocsp_slot_t *slot;
+	apr_uint32_t seq;
+	apr_size_t len;
+	apr_time_t expiry;
+	int tries;
+
+	if (ocsp_slots == NULL || sc->ocsp_slot < 0)
+		return GNUTLS_E_NO_CERTIFICATE_STATUS;
+
+	slot = &ocsp_slots[sc->ocsp_slot];
+
+	for (tries = 0; tries < 3; tries++) {
+		seq = SLOT_SEQ(slot);
+		if (seq & 1)
+			continue;
+
+		len = slot->len;
+		expiry = slot->expiry;
+		if (len == 0 || len > MGS_OCSP_MAX_RESPONSE
+		    || expiry <= apr_time_now())
+			return GNUTLS_E_NO_CERTIFICATE_STATUS;
+
+		ocsp_response->data = gnutls_malloc(len);
+		if (ocsp_response->data == NULL)
+			return GNUTLS_E_MEMORY_ERROR;
+		memcpy(ocsp_response->data, slot->der, len);
+		ocsp_response->size = len;
+
+		if (SLOT_SEQ(slot) == seq)
+			return 0;
+
+		/* the slot was updated while we copied it */
+		gnutls_free(ocsp_response->data);
+		ocsp_response->data = NULL;
+		ocsp_response->size = 0;
+	}
+
+	return GNUTLS_E_NO_CERTIFICATE_STATUS;
+}
+
+/* Returns the OCSP responder URI from the Authority Information Access
+ * extension of cert, or NULL if it has none.
+ */
+static const char *ocsp_uri_from_crt(apr_pool_t * p,
+				     gnutls_x509_crt_t cert)
+{
+	gnutls_datum_t data;
+	const char *uri;
+	unsigned int seq;
+	int rv;
+
+	for (seq = 0;; seq++) {
+		rv = gnutls_x509_crt_get_authority_info_access(cert, seq,
+							       GNUTLS_IA_OCSP_URI,
+							       &data, NULL);
+		if (rv == GNUTLS_E_UNKNOWN_ALGORITHM)
+			continue;
+		if (rv < 0)
+			return NULL;
+
+		uri = apr_pstrmemdup(p, (const char *) data.data,
+				     data.size);
+		gnutls_free(data.data);
+		return uri;
+	}
+}
+
+/* Send all of buf, apr_socket_send() may send only a part */
+static apr_status_t ocsp_send_all(apr_socket_t * sock, const char *buf,
+				  apr_size_t size)
+{
+	apr_status_t rv;
+	apr_size_t len;
+
+	while (size > 0) {
+		len = size;
+		rv = apr_socket_send(sock, buf, &len);
+		if (rv != APR_SUCCESS)
+			return rv;
+		buf += len;
+		size -= len;
+	}
+	return APR_SUCCESS;
+}
+
+/* POST the DER encoded request to the responder at uri and store the
+ * body of its reply in response, allocated from p.
+ */
+static apr_status_t ocsp_http_post(apr_pool_t * p, server_rec * s,
+				   const char *uri,
+				   const gnutls_datum_t * request,
+				   gnutls_datum_t * response)
+{
+	apr_status_t rv;
+	apr_uri_t parsed;
+	apr_sockaddr_t *sa;
+	apr_socket_t *sock;
+	const char *hdr;
+	char *buf, *body;
+	apr_size_t len, total;
+
+	rv = apr_uri_parse(p, uri, &parsed);
+	if (rv != APR_SUCCESS || parsed.hostname == NULL
+	    || parsed.scheme == NULL || strcasecmp(parsed.scheme, "http")) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+			     "GnuTLS: Unsupported OCSP responder URI '%s'",
+			     uri);
+		return rv != APR_SUCCESS ? rv : APR_EGENERAL;
+	}
+	if (parsed.port == 0)
+		parsed.port = 80;
+
+	rv = apr_sockaddr_info_get(&sa, parsed.hostname, APR_UNSPEC,
+				   parsed.port, 0, p);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	rv = apr_socket_create(&sock, sa->family, SOCK_STREAM,
+			       APR_PROTO_TCP, p);
+	if (rv != APR_SUCCESS)
+		return rv;
+
+	apr_socket_timeout_set(sock, MGS_OCSP_FETCH_TIMEOUT);
+
+	rv = apr_socket_connect(sock, sa);
+	if (rv != APR_SUCCESS)
+		goto exit;
+
+	hdr = apr_psprintf(p, "POST %s HTTP/1.0\r\n"
+			   "Host: %s:%d\r\n"
+			   "Content-Type: application/ocsp-request\r\n"
+			   "Content-Length: %u\r\n"
+			   "Connection: close\r\n\r\n",
+			   parsed.path ? parsed.path : "/",
+			   parsed.hostname, parsed.port, request->size);
+
+	rv = ocsp_send_all(sock, hdr, strlen(hdr));
+	if (rv == APR_SUCCESS)
+		rv = ocsp_send_all(sock, (const char *) request->data,
+				   request->size);
+	if (rv != APR_SUCCESS)
+		goto exit;
+
+	buf = apr_palloc(p, MGS_OCSP_MAX_REPLY + 1);
+	total = 0;
+	do {
+		len = MGS_OCSP_MAX_REPLY - total;
+		rv = apr_socket_recv(sock, buf + total, &len);
+		total += len;
+	} while (rv == APR_SUCCESS && total < MGS_OCSP_MAX_REPLY);
+
+	if (rv == APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+			     "GnuTLS: The reply of OCSP responder '%s' is "
+			     "larger than %d bytes", uri, MGS_OCSP_MAX_REPLY);
+		rv = APR_ENOSPC;
+		goto exit;
+	}
+	if (rv != APR_EOF)
+		goto exit;
+	rv = APR_SUCCESS;
+	buf[total] = '\0';
+
+	if (strncmp(buf, "HTTP/1.", 7) != 0 || total < 12
+	    || strncmp(buf + 9, "200", 3) != 0) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+			     "GnuTLS: OCSP responder '%s' failed: %.12s",
+			     uri, buf);
+		rv = APR_EGENERAL;
+		goto exit;
+	}
+
+	body = strstr(buf, "\r\n\r\n");
+	if (body == NULL) {
+		rv = APR_EGENERAL;
+		goto exit;
+	}
+	body += 4;
+
+	response->data = (unsigned char *) body;
+	response->size = total - (body - buf);
+
+      exit:
+	apr_socket_close(sock);
+	return rv;
+}
+
+/* Fetch and check a new OCSP response for the server certificate of sc.
+ * On success the response is stored in der, which must hold
+ * MGS_OCSP_MAX_RESPONSE bytes, and its validity in expiry and refresh.
+ */
+static apr_status_t ocsp_fetch(apr_pool_t * p, server_rec * s,
+			       mgs_srvconf_rec * sc, unsigned char *der,
+			       apr_size_t * der_len, apr_time_t * expiry,
+			       apr_time_t * refresh)
+{
+	gnutls_ocsp_req_t req = NULL;
+	gnutls_ocsp_resp_t resp = NULL;
+	gnutls_datum_t req_der = { NULL, 0 };
+	gnutls_datum_t resp_der;
+	unsigned int verify, cert_status;
+	time_t this_update, next_update;
+	apr_time_t now, start, end;
+	apr_status_t rv = APR_EGENERAL;
+	int ret;
+
+	ret = gnutls_ocsp_req_init(&req);
+	if (ret == 0)
+		ret = gnutls_ocsp_req_add_cert(req, GNUTLS_DIG_SHA1,
+					       sc->certs_x509[1],
+					       sc->certs_x509[0]);
+	if (ret == 0)
+		ret = gnutls_ocsp_req_export(req, &req_der);
+	if (ret < 0) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+			     "GnuTLS: Failed to create OCSP request: "
+			     "(%d) %s", ret, gnutls_strerror(ret));
+		goto exit;
+	}
+
+	rv = ocsp_http_post(p, s, sc->ocsp_responder, &req_der,
+			    &resp_der);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+			     "GnuTLS: Failed to fetch OCSP response for "
+			     "'%s:%d' from '%s'", s->server_hostname,
+			     s->port, sc->ocsp_responder);
+		goto exit;
+	}
+	rv = APR_EGENERAL;
+
+	if (resp_der.size > MGS_OCSP_MAX_RESPONSE) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+			     "GnuTLS: OCSP response of %u bytes is too "
+			     "large to staple", resp_der.size);
+		goto exit;
+	}
+
+	ret = gnutls_ocsp_resp_init(&resp);
+	if (ret == 0)
+		ret = gnutls_ocsp_resp_import(resp, &resp_der);
+	if (ret == 0 && gnutls_ocsp_resp_get_status(resp) !=
+	    GNUTLS_OCSP_RESP_SUCCESSFUL)
+		ret = GNUTLS_E_OCSP_RESPONSE_ERROR;
+	if (ret == 0)
+		ret = gnutls_ocsp_resp_check_crt(resp, 0,
+						 sc->certs_x509[0]);
+	if (ret == 0)
+		ret = gnutls_ocsp_resp_verify_direct(resp,
+						     sc->certs_x509[1],
+						     &verify, 0);
+	if (ret == 0 && verify != 0)
+		ret = GNUTLS_E_OCSP_RESPONSE_ERROR;
+	if (ret == 0)
+		ret = gnutls_ocsp_resp_get_single(resp, 0, NULL, NULL,
+						  NULL, NULL,
+						  &cert_status,
+						  &this_update,
+						  &next_update, NULL, NULL);
+	if (ret < 0) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+			     "GnuTLS: Invalid OCSP response for '%s:%d': "
+			     "(%d) %s", s->server_hostname, s->port, ret,
+			     gnutls_strerror(ret));
+		goto exit;
+	}
+
+	if (cert_status == GNUTLS_OCSP_CERT_REVOKED) {
+		ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+			     "GnuTLS: The OCSP responder reports the "
+			     "certificate of '%s:%d' as revoked",
+			     s->server_hostname, s->port);
+	}
+
+	now = apr_time_now();
+	apr_time_ansi_put(&start, this_update);
+	if (next_update == (time_t) - 1)
+		end = now + MGS_OCSP_DEFAULT_LIFETIME;
+	else
+		apr_time_ansi_put(&end, next_update);
+
+	if (end <= now) {
+		ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+			     "GnuTLS: The OCSP response for '%s:%d' has "
+			     "already expired", s->server_hostname,
+			     s->port);
+		goto exit;
+	}
+
+	memcpy(der, resp_der.data, resp_der.size);
+	*der_len = resp_der.size;
+	*expiry = end;
+	/* refresh once half of the lifetime has passed */
+	*refresh = (start < now ? start : now) + (end - start) / 2;
+	rv = APR_SUCCESS;
+
+      exit:
+	if (resp != NULL)
+		gnutls_ocsp_resp_deinit(resp);
+	if (req != NULL)
+		gnutls_ocsp_req_deinit(req);
+	gnutls_free(req_der.data);
+	return rv;
+}
+
+/* Refresh the cached response of sc if it is due. Only one process
+ * fetches a response at a time; the slot is locked only to claim the
+ * fetch and to store its result.
+ */
+static void ocsp_refresh(apr_pool_t * p, server_rec * s,
+			 mgs_srvconf_rec * sc, apr_interval_time_t retry)
+{
+	mgs_ocsp_slot_t *slot = &ocsp_slots[sc->ocsp_slot];
+	unsigned char *der;
+	apr_size_t der_len;
+	apr_time_t now, expiry, refresh;
+	apr_status_t rv;
+
+	now = apr_time_now();
+	if (slot->refresh > now || slot->fetching > now)
+		return;
+
+	if (apr_global_mutex_lock(ocsp_mutex) != APR_SUCCESS)
+		return;
+	if (slot->refresh > now || slot->fetching > now) {
+		apr_global_mutex_unlock(ocsp_mutex);
+		return;
+	}
+	slot->fetching = now + MGS_OCSP_FETCH_TIMEOUT * 2;
+	apr_global_mutex_unlock(ocsp_mutex);
+
+	der = apr_palloc(p, MGS_OCSP_MAX_RESPONSE);
+	rv = ocsp_fetch(p, s, sc, der, &der_len, &expiry, &refresh);
+
+	if (apr_global_mutex_lock(ocsp_mutex) != APR_SUCCESS)
+		return;
+	if (rv == APR_SUCCESS) {
+		apr_atomic_inc32(&slot->seq);
+		memcpy(slot->der, der, der_len);
+		slot->len = der_len;
+		slot->expiry = expiry;
+		apr_atomic_inc32(&slot->seq);
+		slot->refresh = refresh;
+	} else {
+		/* keep serving the old response while it is valid */
+		slot->refresh = apr_time_now() + retry;
+	}
+	slot->fetching = 0;
+	apr_global_mutex_unlock(ocsp_mutex);
+}
+
+#if APR_HAS_THREADS
+static void *APR_THREAD_FUNC ocsp_thread_main(apr_thread_t * thread,
+					      void *data)
+{
+	server_rec *base_server = data;
+	server_rec *s;
+	mgs_srvconf_rec *sc;
+	mgs_srvconf_rec *sc_base =
+	    ap_get_module_config(base_server->module_config,
+				 &gnutls_module);
+	apr_pool_t *p;
+	apr_time_t next = 0;
+
+	apr_pool_create(&p, apr_thread_pool_get(thread));
+
+	while (!ocsp_thread_stop) {
+		if (apr_time_now() >= next) {
+			for (s = base_server; s; s = s->next) {
+				sc = ap_get_module_config(s->module_config,
+							  &gnutls_module);
+				if (sc->ocsp_slot >= 0)
+					ocsp_refresh(p, s, sc,
+						     sc_base->
+						     ocsp_check_interval);
+				apr_pool_clear(p);
+			}
+			next = apr_time_now() +
+			    sc_base->ocsp_check_interval;
+		}
+		/* wake up often enough to notice the child exiting */
+		apr_sleep(apr_time_from_sec(1));
+	}
+
+	apr_pool_destroy(p);
+	apr_thread_exit(thread, APR_SUCCESS);
+	return NULL;
+}
+
+static apr_status_t ocsp_thread_cleanup(void *data)
+{
+	apr_status_t rv;
+
+	ocsp_thread_stop = 1;
+	if (ocsp_thread != NULL)
+		apr_thread_join(&rv, ocsp_thread);
+	ocsp_thread = NULL;
+	return APR_SUCCESS;
+}
+#endif
+
+int mgs_ocsp_post_config(apr_pool_t * p, server_rec * base_server)
+{
+	apr_status_t rv;
+	server_rec *s;
+	mgs_srvconf_rec *sc;
+	mgs_srvconf_rec *sc_base =
+	    ap_get_module_config(base_server->module_config,
+				 &gnutls_module);
+	int nslots = 0;
+
+	ocsp_slots = NULL;
+	ocsp_mutex = NULL;
+
+	for (s = base_server; s; s = s->next) {
+		sc = ap_get_module_config(s->module_config, &gnutls_module);
+		sc->ocsp_slot = -1;
+
+		if (sc->enabled != GNUTLS_ENABLED_TRUE
+		    || sc->ocsp_staple != GNUTLS_ENABLED_TRUE)
+			continue;
+
+		if (sc->certs_x509_num < 2) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+				     "GnuTLS: Host '%s:%d': OCSP stapling "
+				     "needs the issuer certificate after the "
+				     "server certificate in its certificate "
+				     "file", s->server_hostname, s->port);
+			return -1;
+		}
+
+		if (sc->ocsp_responder == NULL)
+			sc->ocsp_responder =
+			    ocsp_uri_from_crt(p, sc->certs_x509[0]);
+		if (sc->ocsp_responder == NULL) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+				     "GnuTLS: Host '%s:%d': The certificate "
+				     "has no OCSP responder, set "
+				     "GnuTLSOCSPResponder",
+				     s->server_hostname, s->port);
+			return -1;
+		}
+
+		sc->ocsp_slot = nslots++;
+		gnutls_certificate_set_ocsp_status_request_function
+		    (sc->certs, mgs_ocsp_staple_cb, sc);
+	}
+
+	if (nslots == 0)
+		return 0;
+
+	rv = mgs_shm_create(&ocsp_shm, nslots * sizeof(mgs_ocsp_slot_t),
+			    ap_server_root_relative(p,
+						    "logs/gnutls_ocsp.shm"),
+			    p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Cannot create the OCSP response "
+			     "cache");
+		return rv;
+	}
+	ocsp_slots = apr_shm_baseaddr_get(ocsp_shm);
+
+	rv = mgs_mutex_create(&ocsp_mutex, base_server, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Cannot create the OCSP mutex");
+		return rv;
+	}
+
+	/* Fetch the first responses before accepting connections. Failures
+	 * are not fatal, the children keep retrying in the background.
+	 */
+	for (s = base_server; s; s = s->next) {
+		sc = ap_get_module_config(s->module_config, &gnutls_module);
+		if (sc->ocsp_slot >= 0)
+			ocsp_refresh(p, s, sc, sc_base->ocsp_check_interval);
+	}
+
+	return 0;
+}
+
+void mgs_ocsp_child_init(apr_pool_t * p, server_rec * s)
+{
+	apr_status_t rv;
+
+	if (ocsp_slots == NULL)
+		return;
+
+	rv = mgs_mutex_child_init(&ocsp_mutex, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s,
+			     "GnuTLS: Failed to reopen the OCSP mutex");
+		return;
+	}
+
+#if APR_HAS_THREADS
+	ocsp_thread_stop = 0;
+	rv = apr_thread_create(&ocsp_thread, NULL, ocsp_thread_main, s, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s,
+			     "GnuTLS: Failed to start the OCSP refresh "
+			     "thread");
+		ocsp_thread = NULL;
+		return;
+	}
+	/* join before the pools used by the thread go away */
+	apr_pool_pre_cleanup_register(p, NULL, ocsp_thread_cleanup);
+#endif
+}
+
+#else				/* GnuTLS without OCSP support */
+
+int mgs_ocsp_post_config(apr_pool_t * p, server_rec * base_server)
+{
+	return 0;
+}
+
+void mgs_ocsp_child_init(apr_pool_t * p, server_rec * s)
+{
+}
+
+#endif
@@ -0,0 +1,303 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+#include "mod_gnutls.h"
+
+#include "apr_atomic.h"
+#include <gnutls/crypto.h>
+
+/**
+ * Client chain verification cache
+ *
+ * Verifying a client chain costs a signature check per certificate.
+ * Clients that reconnect all the time with the same certificates get the
+ * result from a table in shared memory instead, for at most
+ * GnuTLSVerifyCacheTimeout seconds and never past the expiration of the
+ * chain.
+ *
+ * Entries are keyed by the SHA-256 of the trust anchors of the virtual
+ * host, the generation of the revocation data and the chain as sent by
+ * the client. A different GnuTLSX509CAFile or GnuTLSClientCAPath
+ * therefore never sees the results of another, and
+ * mgs_verify_cache_invalidate() retires all entries at once when
+ * revocation data changes.
+ */
+
+/* Entries compared per lookup; the least recently stored one of the set
+ * is replaced on insert
+ */
+#define MGS_VCACHE_WAYS 4
+
+typedef struct {
+	/* bumped when the revocation data changes */
+	apr_uint32_t generation;
+	apr_uint32_t hits;
+	apr_uint32_t misses;
+} mgs_vcache_header_t;
+
+typedef struct {
+	unsigned char key[MGS_VERIFY_CACHE_KEY_SIZE];
+	unsigned int status;
+	/* 0 for a free entry */
+	apr_time_t expires;
+	apr_time_t stored;
+} mgs_vcache_entry_t;
+
+static apr_shm_t *vcache_shm;
+static mgs_vcache_header_t *vcache_header;
+static mgs_vcache_entry_t *vcache_entries;
+static apr_global_mutex_t *vcache_mutex;
+static unsigned int vcache_sets;
+static apr_interval_time_t vcache_timeout;
+
+/* The digest of the trust anchors of sc */
+static int vcache_ca_digest(apr_pool_t * p, mgs_srvconf_rec * sc)
+{
+	gnutls_hash_hd_t dig;
+	unsigned char *der;
+	size_t size;
+	unsigned int i;
+	int ret;
+
+	ret = gnutls_hash_init(&dig, GNUTLS_DIG_SHA256);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < sc->ca_list_size; i++) {
+		size = 0;
+		ret = gnutls_x509_crt_export(sc->ca_list[i],
+					     GNUTLS_X509_FMT_DER, NULL,
+					     &size);
+		if (ret != GNUTLS_E_SHORT_MEMORY_BUFFER)
+			break;
+		der = apr_palloc(p, size);
+		ret = gnutls_x509_crt_export(sc->ca_list[i],
+					     GNUTLS_X509_FMT_DER, der, &size);
+		if (ret < 0)
+			break;
+		gnutls_hash(dig, der, size);
+	}
+
+	/* the CAs read from the directory are not known yet; chains whose
+	 * issuer was not found there are not cached
+	 */
+	if (ret >= 0 && sc->ca_path_dir != NULL)
+		gnutls_hash(dig, sc->ca_path_dir, strlen(sc->ca_path_dir) + 1);
+
+	gnutls_hash_deinit(dig, sc->ca_digest);
+	return ret < 0 ? ret : 0;
+}
+
+int mgs_verify_cache_post_config(apr_pool_t * p, server_rec * base_server)
+{
+	apr_status_t rv;
+	server_rec *s;
+	mgs_srvconf_rec *sc;
+	mgs_srvconf_rec *sc_base =
+	    ap_get_module_config(base_server->module_config,
+				 &gnutls_module);
+	int ret;
+
+	vcache_header = NULL;
+	vcache_entries = NULL;
+	vcache_mutex = NULL;
+	vcache_timeout = sc_base->verify_cache_timeout;
+	vcache_sets = (sc_base->verify_cache_size + MGS_VCACHE_WAYS - 1)
+	    / MGS_VCACHE_WAYS;
+
+	if (vcache_sets == 0)
+		return 0;
+
+	for (s = base_server; s; s = s->next) {
+		sc = ap_get_module_config(s->module_config, &gnutls_module);
+		if (sc->enabled != GNUTLS_ENABLED_TRUE
+		    || (sc->ca_list_size == 0 && sc->ca_path_dir == NULL))
+			continue;
+
+		ret = vcache_ca_digest(p, sc);
+		if (ret < 0) {
+			ap_log_error(APLOG_MARK, APLOG_STARTUP, 0, s,
+				     "GnuTLS: Failed to hash the client CA "
+				     "list: (%d) %s", ret,
+				     gnutls_strerror(ret));
+			return -1;
+		}
+	}
+
+	rv = mgs_shm_create(&vcache_shm, sizeof(mgs_vcache_header_t) +
+			    vcache_sets * MGS_VCACHE_WAYS *
+			    sizeof(mgs_vcache_entry_t),
+			    ap_server_root_relative(p,
+						    "logs/gnutls_verify.shm"),
+			    p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Cannot create the verification "
+			     "cache");
+		return rv;
+	}
+	vcache_header = apr_shm_baseaddr_get(vcache_shm);
+	vcache_entries = (mgs_vcache_entry_t *) (vcache_header + 1);
+
+	rv = mgs_mutex_create(&vcache_mutex, base_server, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_STARTUP, rv, base_server,
+			     "GnuTLS: Cannot create the verification cache "
+			     "mutex");
+		return rv;
+	}
+
+	return 0;
+}
+
+void mgs_verify_cache_child_init(apr_pool_t * p, server_rec * s)
+{
+	apr_status_t rv;
+
+	rv = mgs_mutex_child_init(&vcache_mutex, p);
+	if (rv != APR_SUCCESS) {
+		ap_log_error(APLOG_MARK, APLOG_EMERG, rv, s,
+			     "GnuTLS: Failed to reopen the verification "
+			     "cache mutex");
+		/* run without the cache */
+		vcache_header = NULL;
+	}
+}
+
+int mgs_verify_cache_key(mgs_srvconf_rec * sc,
+			 const gnutls_datum_t * chain, unsigned int n,
+			 unsigned char *key)
+{
+	gnutls_hash_hd_t dig;
+	apr_uint32_t generation;
+	unsigned char buf[4];
+	unsigned int i;
+
+	if (vcache_header == NULL)
+		return -1;
+
+	if (gnutls_hash_init(&dig, GNUTLS_DIG_SHA256) < 0)
+		return -1;
+
+	generation = apr_atomic_read32(&vcache_header->generation);
+	buf[0] = generation >> 24;
+	buf[1] = generation >> 16;
+	buf[2] = generation >> 8;
+	buf[3] = generation;
+
+	gnutls_hash(dig, sc->ca_digest, sizeof(sc->ca_digest));
+	gnutls_hash(dig, buf, sizeof(buf));
+	for (i = 0; i < n; i++) {
+		/* the length keeps the certificate boundaries apart */
+		buf[0] = chain[i].size >> 24;
+		buf[1] = chain[i].size >> 16;
+		buf[2] = chain[i].size >> 8;
+		buf[3] = chain[i].size;
+		gnutls_hash(dig, buf, sizeof(buf));
+		gnutls_hash(dig, chain[i].data, chain[i].size);
+	}
+	gnutls_hash_deinit(dig, key);
+
+	return 0;
+}
+
+static mgs_vcache_entry_t *vcache_set(const unsigned char *key)
+{
+	apr_uint32_t h;
+
+	/* the key is a digest already */
+	h = ((apr_uint32_t) key[0] << 24) | ((apr_uint32_t) key[1] << 16)
+	    | ((apr_uint32_t) key[2] << 8) | key[3];
+	return &vcache_entries[(h % vcache_sets) * MGS_VCACHE_WAYS];
+}
+
+int mgs_verify_cache_get(const unsigned char *key, unsigned int *status)
+{
+	mgs_vcache_entry_t *set;
+	apr_time_t now;
+	unsigned int i;
+	int found = 0;
+
+	if (vcache_header == NULL)
+		return 0;
+
+	set = vcache_set(key);
+	if (apr_global_mutex_lock(vcache_mutex) != APR_SUCCESS)
+		return 0;
+
+	now = apr_time_now();
+	for (i = 0; i < MGS_VCACHE_WAYS; i++) {
+		if (set[i].expires > now
+		    && memcmp(set[i].key, key,
+			      MGS_VERIFY_CACHE_KEY_SIZE) == 0) {
+			*status = set[i].status;
+			found = 1;
+			break;
+		}
+	}
+
+	apr_global_mutex_unlock(vcache_mutex);
+
+	apr_atomic_inc32(found ? &vcache_header->hits :
+			 &vcache_header->misses);
+	return found;
+}
+
+void mgs_verify_cache_put(const unsigned char *key, unsigned int status,
+			  apr_time_t expires)
+{
+	mgs_vcache_entry_t *set, *e;
+	apr_time_t now;
+	unsigned int i;
+
+	if (vcache_header == NULL)
+		return;
+
+	now = apr_time_now();
+	if (expires > now + vcache_timeout)
+		expires = now + vcache_timeout;
+	if (expires <= now)
+		return;
+
+	set = vcache_set(key);
+	if (apr_global_mutex_lock(vcache_mutex) != APR_SUCCESS)
+		return;
+
+	e = &set[0];
+	for (i = 0; i < MGS_VCACHE_WAYS; i++) {
+		if (memcmp(set[i].key, key, MGS_VERIFY_CACHE_KEY_SIZE) == 0
+		    || set[i].expires <= now) {
+			e = &set[i];
+			break;
+		}
+		if (set[i].stored < e->stored)
+			e = &set[i];
+	}
+
+	memcpy(e->key, key, MGS_VERIFY_CACHE_KEY_SIZE);
+	e->status = status;
+	e->expires = expires;
+	e->stored = now;
+
+	apr_global_mutex_unlock(vcache_mutex);
+}
+
+void mgs_verify_cache_invalidate(void)
+{
+	if (vcache_header != NULL)
+		apr_atomic_inc32(&vcache_header->generation);
+}
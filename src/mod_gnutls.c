@@ -16,6 +16,7 @@
  */
 
 #include "mod_gnutls.h"
+#include "mod_status.h"
 
 static void gnutls_hooks(apr_pool_t * p)
 {
@@ -44,6 +45,20 @@ static void gnutls_hooks(apr_pool_t * p)
 
 	ap_hook_optional_fn_retrieve(mgs_hook_opt_retr, NULL, NULL,
 				     APR_HOOK_MIDDLE);
+	/* again if a module loaded after us replaced them, before
+	 * anyone else retrieves them */
+	ap_hook_optional_fn_retrieve(mgs_register_ssl_fns, NULL, NULL,
+				     APR_HOOK_REALLY_FIRST);
+
+	APR_OPTIONAL_HOOK(ap, status_hook, mgs_limit_status_hook, NULL,
+			  NULL, APR_HOOK_MIDDLE);
+#if HAVE_AP_SOCACHE
+	APR_OPTIONAL_HOOK(ap, status_hook, mgs_cache_status_hook, NULL,
+			  NULL, APR_HOOK_MIDDLE);
+#endif
+
+	/* under the names used by mod_ssl */
+	mgs_register_ssl_fns();
 
 	/* TODO: HTTP Upgrade Filter */
 	/* ap_register_output_filter ("UPGRADE_FILTER", 
@@ -71,6 +86,11 @@ static const command_rec mgs_config_cmds[] = {
 		      NULL,
 		      RSRC_CONF,
 		      "Set the CA File to verify Client Certificates"),
+	AP_INIT_TAKE1("GnuTLSClientCAPath", mgs_set_client_ca_path,
+		      NULL,
+		      RSRC_CONF,
+		      "Set a directory of hashed CA files read on demand to "
+		      "verify Client Certificates"),
 	AP_INIT_TAKE1("GnuTLSPGPKeyringFile", mgs_set_keyring_file,
 		      NULL,
 		      RSRC_CONF,
@@ -99,6 +119,15 @@ static const command_rec mgs_config_cmds[] = {
 		      NULL,
 		      RSRC_CONF,
 		      "SSL Server X509 Private Key file"),
+	AP_INIT_TAKE1("GnuTLSKeyServer", mgs_set_key_server,
+		      NULL,
+		      RSRC_CONF,
+		      "Unix socket of the key server that holds the SSL "
+		      "Server X509 Private Key"),
+	AP_INIT_TAKE1("GnuTLSKeyServerTimeout", mgs_set_key_server_timeout,
+		      NULL,
+		      RSRC_CONF,
+		      "Seconds to wait for the key server. Default: 5"),
 	AP_INIT_TAKE1("GnuTLSPGPCertificateFile", mgs_set_pgpcert_file,
 		      NULL,
 		      RSRC_CONF,
@@ -131,6 +160,26 @@ static const command_rec mgs_config_cmds[] = {
 		      NULL,
 		      RSRC_CONF,
 		      "Cache Configuration"),
+	AP_INIT_TAKE1("GnuTLSDBMShards", mgs_set_dbm_shards,
+		      NULL,
+		      RSRC_CONF,
+		      "Number of files the DBM session cache is spread "
+		      "over. Default: 1"),
+	AP_INIT_TAKE1("GnuTLSCacheMaxEntries", mgs_set_cache_max_entries,
+		      NULL,
+		      RSRC_CONF,
+		      "Most sessions kept by the DBM session cache, the "
+		      "oldest are evicted first. Default: 0, no limit"),
+	AP_INIT_TAKE1("GnuTLSCacheAdmission", mgs_set_cache_admission,
+		      NULL,
+		      RSRC_CONF,
+		      "Whether a full DBM session cache only takes the "
+		      "sessions of recently seen clients. Default: Off"),
+	AP_INIT_TAKE1("GnuTLSCacheQuota", mgs_set_cache_quota,
+		      NULL,
+		      RSRC_CONF,
+		      "Most sessions of the virtual host in the DBM session "
+		      "cache. Default: 0, no limit"),
 	AP_INIT_TAKE1("GnuTLSSessionTickets", mgs_set_tickets,
 		      NULL,
 		      RSRC_CONF,
@@ -139,10 +188,120 @@ static const command_rec mgs_config_cmds[] = {
 			 NULL,
 			 RSRC_CONF,
 			 "The priorities to enable (ciphers, Key exchange, macs, compression)."),
+	AP_INIT_ITERATE("GnuTLSECDHCurves", mgs_set_ecdh_curves,
+			NULL,
+			RSRC_CONF,
+			"The elliptic curves to use for ECDHE key exchange, "
+			"in order of preference."),
+	AP_INIT_TAKE1("GnuTLSAdaptiveCipherOrder",
+		      mgs_set_adaptive_cipher_order,
+		      NULL,
+		      RSRC_CONF,
+		      "Whether to prefer AES-GCM or ChaCha20-Poly1305 "
+		      "depending on AES hardware support. Default: Off"),
+	AP_INIT_TAKE1("GnuTLSOCSPStapling", mgs_set_ocsp_stapling,
+		      NULL,
+		      RSRC_CONF,
+		      "Whether to staple OCSP responses. Default: Off"),
+	AP_INIT_TAKE1("GnuTLSOCSPResponder", mgs_set_ocsp_responder,
+		      NULL,
+		      RSRC_CONF,
+		      "The OCSP responder to query, overrides the one "
+		      "named in the certificate"),
+	AP_INIT_TAKE1("GnuTLSOCSPCheckInterval", mgs_set_ocsp_check_interval,
+		      NULL,
+		      RSRC_CONF,
+		      "Seconds between checks of the stapled OCSP "
+		      "responses. Default: 60"),
+	AP_INIT_TAKE1("GnuTLSMaxFullHandshakes",
+		      mgs_set_max_full_handshakes,
+		      NULL,
+		      RSRC_CONF,
+		      "Maximum number of full (not resumed) handshakes in "
+		      "progress in all processes. Default: 0 (no limit)"),
+	AP_INIT_TAKE1("GnuTLSFullHandshakeQueueTimeout",
+		      mgs_set_full_handshake_queue_timeout,
+		      NULL,
+		      RSRC_CONF,
+		      "Milliseconds a full handshake over the limit waits "
+		      "before it is refused. Default: 100"),
+	AP_INIT_TAKE12("GnuTLSFullHandshakeRate",
+		       mgs_set_full_handshake_rate,
+		       NULL,
+		       RSRC_CONF,
+		       "Full handshakes per second and burst allowed per "
+		       "client address. Default: 0 (no limit)"),
+	AP_INIT_TAKE1("GnuTLSFullHandshakeRateIPv6Prefix",
+		      mgs_set_full_handshake_rate_v6_prefix,
+		      NULL,
+		      RSRC_CONF,
+		      "Length of the IPv6 prefix counted as one client by "
+		      "GnuTLSFullHandshakeRate. Default: 64"),
+	AP_INIT_TAKE1("GnuTLSFullHandshakeRateTableSize",
+		      mgs_set_full_handshake_rate_table_size,
+		      NULL,
+		      RSRC_CONF,
+		      "Number of client addresses tracked by "
+		      "GnuTLSFullHandshakeRate. Default: 16384"),
+	AP_INIT_TAKE1("GnuTLSVerifyCacheSize",
+		      mgs_set_verify_cache_size,
+		      NULL,
+		      RSRC_CONF,
+		      "Number of client certificate verification results "
+		      "shared by all children. Default: 0 (no cache)"),
+	AP_INIT_TAKE1("GnuTLSVerifyCacheTimeout",
+		      mgs_set_verify_cache_timeout,
+		      NULL,
+		      RSRC_CONF,
+		      "Seconds a client certificate verification result is "
+		      "cached. Default: 300"),
+	AP_INIT_TAKE1("GnuTLSConfigThreads", mgs_set_config_threads,
+		      NULL,
+		      RSRC_CONF,
+		      "Number of threads parsing the certificate and key "
+		      "files at startup. Default: 4"),
+	AP_INIT_TAKE1("GnuTLSReloadInterval", mgs_set_reload_interval,
+		      NULL,
+		      RSRC_CONF,
+		      "Seconds between checks of the certificate and key "
+		      "files for changes. Default: 0 (never reload)"),
+	AP_INIT_TAKE1("GnuTLSCredentialCacheSize",
+		      mgs_set_credential_cache_size,
+		      NULL,
+		      RSRC_CONF,
+		      "Number of hosts whose certificate and key are loaded "
+		      "on demand and kept per process. Default: 0 (load all "
+		      "at startup)"),
+	AP_INIT_TAKE1("GnuTLSCredentialSnapshot",
+		      mgs_set_credential_snapshot,
+		      NULL,
+		      RSRC_CONF,
+		      "File keeping the parsed certificates and keys across "
+		      "restarts"),
+	AP_INIT_TAKE1("GnuTLSX509CRLFile", mgs_set_crl_file,
+		      NULL,
+		      RSRC_CONF,
+		      "Set the CRLs checked for client certificates"),
+	AP_INIT_TAKE1("GnuTLSCRLCheckInterval", mgs_set_crl_check_interval,
+		      NULL,
+		      RSRC_CONF,
+		      "Seconds between checks of the CRL files for changes. "
+		      "Default: 60"),
+	AP_INIT_TAKE1("GnuTLSCRLIndexDir", mgs_set_crl_index_dir,
+		      NULL,
+		      RSRC_CONF,
+		      "Directory to keep the CRL indexes in, shared by all "
+		      "processes"),
 	AP_INIT_TAKE1("GnuTLSEnable", mgs_set_enabled,
 		      NULL,
 		      RSRC_CONF,
 		      "Whether this server has GnuTLS Enabled. Default: Off"),
+	AP_INIT_ITERATE("GnuTLSExportEnvHandlers",
+			mgs_set_export_env_handlers,
+			NULL,
+			RSRC_CONF,
+			"Handlers that get the SSL_* variables in their "
+			"environment. Default: all"),
 	AP_INIT_TAKE1("GnuTLSExportCertificates",
 		      mgs_set_export_certificates_enabled,
 		      NULL,
@@ -0,0 +1,263 @@
+/**
+ *  Copyright 2004-2005 Paul Querna
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ */
+
+/**
+ * GnuTLS behaviour probe: resumption is known when the server hello goes
+ * out
+ *
+ * GnuTLSMaxFullHandshakes and GnuTLSFullHandshakeRate must never count
+ * resumed handshakes. mgs_handshake_hook() admits full handshakes when
+ * the server hello is sent, relying on gnutls_session_is_resumed() being
+ * final by then, for session tickets too. This probe checks that
+ * assumption against the GnuTLS in use: a handshake hook deciding the
+ * same way over an in-memory connection must count a full handshake
+ * once and a resumption with a session ticket, over TLS 1.2 and over
+ * TLS 1.3, not at all. It does not run any code of mod_gnutls, a change
+ * of the module itself is not caught here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#if GNUTLS_VERSION_NUMBER >= 0x030400
+
+typedef struct {
+	unsigned char data[65536];
+	size_t len;
+} buffer_t;
+
+/* what the client sent to the server and back */
+static buffer_t to_server, to_client;
+
+/* full handshakes admitted by the hook */
+static int admitted;
+
+static ssize_t buf_push(buffer_t * b, const void *data, size_t size)
+{
+	if (size > sizeof(b->data) - b->len) {
+		errno = EAGAIN;
+		return -1;
+	}
+	memcpy(b->data + b->len, data, size);
+	b->len += size;
+	return size;
+}
+
+static ssize_t buf_pull(buffer_t * b, void *data, size_t size)
+{
+	if (b->len == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (size > b->len)
+		size = b->len;
+	memcpy(data, b->data, size);
+	memmove(b->data, b->data + size, b->len - size);
+	b->len -= size;
+	return size;
+}
+
+static ssize_t client_push(gnutls_transport_ptr_t p, const void *d,
+			   size_t n)
+{
+	return buf_push(&to_server, d, n);
+}
+
+static ssize_t client_pull(gnutls_transport_ptr_t p, void *d, size_t n)
+{
+	return buf_pull(&to_client, d, n);
+}
+
+static ssize_t server_push(gnutls_transport_ptr_t p, const void *d,
+			   size_t n)
+{
+	return buf_push(&to_client, d, n);
+}
+
+static ssize_t server_pull(gnutls_transport_ptr_t p, void *d, size_t n)
+{
+	return buf_pull(&to_server, d, n);
+}
+
+/* The decision mgs_handshake_hook() makes, copied */
+static int handshake_hook(gnutls_session_t session, unsigned int htype,
+			  unsigned when, unsigned int incoming,
+			  const gnutls_datum_t * msg)
+{
+	if (htype == GNUTLS_HANDSHAKE_SERVER_HELLO && !incoming
+	    && !gnutls_session_is_resumed(session))
+		admitted++;
+	return 0;
+}
+
+#define CHECK(x) do {							\
+	int check_ret = (x);						\
+	if (check_ret < 0) {						\
+		fprintf(stderr, "%s:%d: %s: %s\n", __FILE__, __LINE__,	\
+			#x, gnutls_strerror(check_ret));		\
+		exit(1);						\
+	}								\
+} while (0)
+
+static gnutls_certificate_credentials_t server_cred, client_cred;
+static gnutls_datum_t ticket_key;
+
+static void make_credentials(void)
+{
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	time_t now = time(NULL);
+
+	CHECK(gnutls_x509_privkey_init(&key));
+	CHECK(gnutls_x509_privkey_generate(key, GNUTLS_PK_ECDSA,
+					   GNUTLS_CURVE_TO_BITS
+					   (GNUTLS_ECC_CURVE_SECP256R1), 0));
+	CHECK(gnutls_x509_crt_init(&crt));
+	CHECK(gnutls_x509_crt_set_version(crt, 3));
+	CHECK(gnutls_x509_crt_set_serial(crt, "\x01", 1));
+	CHECK(gnutls_x509_crt_set_activation_time(crt, now - 3600));
+	CHECK(gnutls_x509_crt_set_expiration_time(crt, now + 3600));
+	CHECK(gnutls_x509_crt_set_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME,
+					    0, "localhost", 9));
+	CHECK(gnutls_x509_crt_set_key(crt, key));
+	CHECK(gnutls_x509_crt_sign2(crt, crt, key, GNUTLS_DIG_SHA256, 0));
+
+	CHECK(gnutls_certificate_allocate_credentials(&server_cred));
+	CHECK(gnutls_certificate_set_x509_key(server_cred, &crt, 1, key));
+	CHECK(gnutls_certificate_allocate_credentials(&client_cred));
+
+	gnutls_x509_crt_deinit(crt);
+	gnutls_x509_privkey_deinit(key);
+
+	CHECK(gnutls_session_ticket_key_generate(&ticket_key));
+}
+
+/* Run a handshake with priorities prio, resuming the session in
+ * resume_data if it is set and storing the session for the next one.
+ * Returns whether the client resumed.
+ */
+static int handshake(const char *prio, gnutls_datum_t * resume_data)
+{
+	gnutls_session_t client, server;
+	int cret = GNUTLS_E_AGAIN, sret = GNUTLS_E_AGAIN, resumed;
+	char buf[16];
+
+	to_server.len = to_client.len = 0;
+
+	CHECK(gnutls_init(&server, GNUTLS_SERVER));
+	CHECK(gnutls_priority_set_direct(server, prio, NULL));
+	CHECK(gnutls_credentials_set(server, GNUTLS_CRD_CERTIFICATE,
+				     server_cred));
+	CHECK(gnutls_session_ticket_enable_server(server, &ticket_key));
+	gnutls_transport_set_push_function(server, server_push);
+	gnutls_transport_set_pull_function(server, server_pull);
+	gnutls_handshake_set_hook_function(server, GNUTLS_HANDSHAKE_ANY,
+					   GNUTLS_HOOK_PRE, handshake_hook);
+
+	CHECK(gnutls_init(&client, GNUTLS_CLIENT));
+	CHECK(gnutls_priority_set_direct(client, prio, NULL));
+	CHECK(gnutls_credentials_set(client, GNUTLS_CRD_CERTIFICATE,
+				     client_cred));
+	gnutls_transport_set_push_function(client, client_push);
+	gnutls_transport_set_pull_function(client, client_pull);
+	if (resume_data->data != NULL)
+		CHECK(gnutls_session_set_data(client, resume_data->data,
+					      resume_data->size));
+
+	while (cret == GNUTLS_E_AGAIN || sret == GNUTLS_E_AGAIN) {
+		if (cret == GNUTLS_E_AGAIN)
+			cret = gnutls_handshake(client);
+		if (sret == GNUTLS_E_AGAIN)
+			sret = gnutls_handshake(server);
+	}
+	CHECK(cret);
+	CHECK(sret);
+
+	/* TLS 1.3 tickets come after the handshake */
+	CHECK(gnutls_record_send(server, "x", 1));
+	do {
+		cret = gnutls_record_recv(client, buf, sizeof(buf));
+	} while (cret == GNUTLS_E_AGAIN || cret == GNUTLS_E_INTERRUPTED);
+	CHECK(cret);
+
+	resumed = gnutls_session_is_resumed(client);
+
+	gnutls_free(resume_data->data);
+	CHECK(gnutls_session_get_data2(client, resume_data));
+
+	gnutls_deinit(client);
+	gnutls_deinit(server);
+	return resumed;
+}
+
+static void run(const char *name, const char *prio)
+{
+	gnutls_datum_t data = { NULL, 0 };
+
+	admitted = 0;
+	if (handshake(prio, &data) || admitted != 1) {
+		fprintf(stderr, "%s: full handshake admitted %d times\n",
+			name, admitted);
+		exit(1);
+	}
+
+	admitted = 0;
+	if (!handshake(prio, &data)) {
+		fprintf(stderr, "%s: the session was not resumed\n", name);
+		exit(1);
+	}
+	if (admitted != 0) {
+		fprintf(stderr, "%s: ticket resumption counted as a full "
+			"handshake\n", name);
+		exit(1);
+	}
+
+	gnutls_free(data.data);
+	printf("%s: ok\n", name);
+}
+
+int main(void)
+{
+	CHECK(gnutls_global_init());
+	make_credentials();
+
+	run("TLS 1.2 ticket", "NORMAL:-VERS-ALL:+VERS-TLS1.2");
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+	run("TLS 1.3 ticket", "NORMAL:-VERS-ALL:+VERS-TLS1.3");
+#endif
+
+	gnutls_certificate_free_credentials(server_cred);
+	gnutls_certificate_free_credentials(client_cred);
+	gnutls_free(ticket_key.data);
+	gnutls_global_deinit();
+	return 0;
+}
+
+#else
+
+/* no handshake hooks, see mgs_select_virtual_server_cb() */
+int main(void)
+{
+	return 77;
+}
+
+#endif